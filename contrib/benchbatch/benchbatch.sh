@@ -0,0 +1,64 @@
+#!/bin/bash
+##  Huntercoin.
+##
+##  Measure how much committing several blocks per DB transaction
+##  (-dbbatchsize) speeds up connecting the chain.  The block files of an
+##  existing data directory are reindexed into fresh data directories, once
+##  per batch size; -dbbatchsize=1 connects and commits every block on its
+##  own, as without batching.
+##
+##  Usage: benchbatch.sh <huntercoind> <datadir with blk*.dat> [batch sizes]
+##  e.g.   benchbatch.sh src/huntercoind ~/.huntercoin 1 100 500 2000
+##
+##  For each batch size this prints the reindex time (from the "Reindex:"
+##  progress line), the blocks per second and, for batched runs, the total
+##  time spent in CommitBlockBatch.  Run it on an otherwise idle disk; the
+##  source data directory is only read.
+
+set -e
+
+if [ $# -lt 2 ]; then
+  echo "Usage: $0 <huntercoind> <datadir> [batch sizes]" >&2
+  exit 1
+fi
+
+DAEMON="$1"
+SRCDIR="$2"
+shift 2
+SIZES="${@:-1 500}"
+
+WORKDIR=$(mktemp -d)
+trap 'rm -rf "$WORKDIR"' EXIT
+
+printf "%-10s %10s %10s %12s %14s\n" "batchsize" "blocks" "seconds" "blocks/s" "commits (ms)"
+for SIZE in $SIZES; do
+  DIR="$WORKDIR/$SIZE"
+  mkdir -p "$DIR"
+  cp "$SRCDIR"/blk[0-9]*.dat "$DIR"/
+  sync
+
+  "$DAEMON" -datadir="$DIR" -reindex -dbbatchsize="$SIZE" -dbbatchinterval=100000 \
+            -connect=0 -nolisten -noirc -server=0 >/dev/null 2>&1 &
+  PID=$!
+
+  # The reindex runs while loading; stop the node once that is done
+  while kill -0 $PID 2>/dev/null && ! grep -q "^Done loading" "$DIR/debug.log" 2>/dev/null; do
+    sleep 1
+  done
+  kill $PID 2>/dev/null || true
+  wait $PID 2>/dev/null || true
+
+  LINE=$(grep "^Reindex: [0-9]*/[0-9]* blocks" "$DIR/debug.log" | tail -n 1)
+  if [ -z "$LINE" ]; then
+    echo "$SIZE: no reindex result, see $DIR/debug.log" >&2
+    trap - EXIT
+    exit 1
+  fi
+  BLOCKS=$(echo "$LINE" | sed -e 's/^Reindex: \([0-9]*\)\/.*/\1/')
+  RATE=$(echo "$LINE" | sed -e 's/.* \([0-9.]*\) blocks\/s.*/\1/')
+  SECONDS_TAKEN=$(awk "BEGIN { printf \"%.1f\", $BLOCKS / ($RATE > 0 ? $RATE : 1) }")
+  COMMITS=$(grep "^CommitBlockBatch:" "$DIR/debug.log" | tail -n 1 | sed -e 's/.*(commits \([0-9]*\)ms).*/\1/')
+
+  printf "%-10s %10s %10s %12s %14s\n" "$SIZE" "$BLOCKS" "$SECONDS_TAKEN" "$RATE" "${COMMITS:--}"
+  rm -rf "$DIR"
+done
@@ -131,7 +131,7 @@ DEPENDPATH += src src/json src/cryptopp src/qt
 
 HUNTERCOIN_HEADERS = headers.h strlcpy.h serialize.h uint256.h util.h key.h bignum.h base58.h scrypt.h \
     script.h allocators.h db.h walletdb.h crypter.h net.h irc.h keystore.h main.h wallet.h bitcoinrpc.h uibase.h ui.h noui.h init.h auxpow.h \
-    gamestate.h gamemap.h gamedb.h gametx.h gamemovecreator.h
+    gamestate.h gamemap.h gamedb.h gametx.h gamemovecreator.h checkqueue.h blockstore.h
 
 HUNTERCOIN_SOURCES = \
     auxpow.cpp \
@@ -146,6 +146,7 @@ HUNTERCOIN_SOURCES = \
     irc.cpp \
     keystore.cpp \
     main.cpp \
+    blockstore.cpp \
     wallet.cpp \
     bitcoinrpc.cpp \
     init.cpp \
@@ -164,7 +165,7 @@ HUNTERCOIN_SOURCES = \
 HEADERS += \
     src/headers.h src/strlcpy.h src/serialize.h src/uint256.h src/util.h src/key.h src/bignum.h src/base58.h src/scrypt.h \
     src/script.h src/allocators.h src/db.h src/walletdb.h src/crypter.h src/net.h src/irc.h src/keystore.h src/main.h src/wallet.h src/bitcoinrpc.h src/uibase.h src/ui.h src/noui.h src/init.h src/auxpow.h \
-    src/gamestate.h src/gamemap.h src/gamedb.h src/gametx.h src/gamemovecreator.h \
+    src/gamestate.h src/gamemap.h src/gamedb.h src/gametx.h src/gamemovecreator.h src/checkqueue.h src/blockstore.h \
     src/qt/netbase.h \
     src/qt/bitcoingui.h \
     src/qt/transactiontablemodel.h \
@@ -228,6 +229,7 @@ SOURCES += \
     src/irc.cpp \
     src/keystore.cpp \
     src/main.cpp \
+    src/blockstore.cpp \
     src/wallet.cpp \
     src/bitcoinrpc.cpp \
     src/init.cpp \
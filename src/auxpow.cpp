@@ -115,7 +115,7 @@ CScript MakeCoinbaseWithAux(unsigned int nBits, unsigned int nExtraNonce, vector
 }
 
 
-void IncrementExtraNonceWithAux(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, int64& nPrevTime, vector<unsigned char>& vchAux)
+void IncrementExtraNonceWithAux(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, int64& nPrevTime, vector<unsigned char>& vchAux, const vector<uint256>* pvCoinbaseBranch)
 {
     // Update nExtraNonce
     int64 nNow = max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
@@ -126,7 +126,14 @@ void IncrementExtraNonceWithAux(CBlock* pblock, CBlockIndex* pindexPrev, unsigne
     }
 
     pblock->vtx[0].vin[0].scriptSig = MakeCoinbaseWithAux(pblock->nBits, nExtraNonce, vchAux);
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree(false);
+    if (pvCoinbaseBranch)
+    {
+        // Only the coinbase changed
+        pblock->vMerkleTree.clear();
+        pblock->hashMerkleRoot = CBlock::CheckMerkleBranch(pblock->vtx[0].GetHash(), *pvCoinbaseBranch, 0);
+    }
+    else
+        pblock->hashMerkleRoot = pblock->BuildMerkleTree(false);
 }
 
 
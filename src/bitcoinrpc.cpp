@@ -437,7 +437,7 @@ Value BlockToValue(const CBlock &block, const CBlockIndex* blockindex)
     obj.push_back(Pair("nonce", (uint64_t)block.nNonce));
     obj.push_back(Pair("bits", (uint64_t)block.nBits));
     obj.push_back(Pair("difficulty", GetDifficultyFromBits (block.nBits)));
-    obj.push_back(Pair("chainwork", blockindex->bnChainWork.GetHex()));
+    obj.push_back(Pair("chainwork", CBigNum(blockindex->nChainWork).GetHex()));
 
     if (blockindex->pprev)
         obj.push_back(Pair("previousblockhash", block.hashPrevBlock.ToString().c_str()));
@@ -476,7 +476,7 @@ Value getblockbycount(const Array& params, bool fHelp)
     CBlockIndex* pindex;
     bool found = false;
 
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin();
+    for (CBlockIndexMap::iterator mi = mapBlockIndex.begin();
          mi != mapBlockIndex.end(); ++mi)
     {
         pindex = (*mi).second;
@@ -510,7 +510,7 @@ Value getblock(const Array& params, bool fHelp)
     uint256 hash;
     hash.SetHex(params[0].get_str());
 
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
     if (mi == mapBlockIndex.end())
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "hash not found");
 
@@ -528,7 +528,7 @@ Value getblock(const Array& params, bool fHelp)
 static bool
 compareBlocksByHeight (const uint256& a, const uint256& b)
 {
-  std::map<uint256, CBlockIndex*>::const_iterator ia, ib;
+  CBlockIndexMap::const_iterator ia, ib;
 
   ia = mapBlockIndex.find (a);
   ib = mapBlockIndex.find (b);
@@ -555,7 +555,7 @@ getchains (const Array& params, bool fHelp)
      the block as pprev) so that we find the chain heads.  */
 
   std::map<uint256, bool> blockIsHead;
-  std::map<uint256, CBlockIndex*>::const_iterator i;
+  CBlockIndexMap::const_iterator i;
 
   for (i = mapBlockIndex.begin (); i != mapBlockIndex.end (); ++i)
     blockIsHead.insert (std::make_pair (i->first, true));
@@ -718,6 +718,7 @@ Value getinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("version",       (int)VERSION));
     obj.push_back(Pair("balance",       ValueFromAmount(pwalletMain->GetBalance())));
     obj.push_back(Pair("blocks",        (int)nBestHeight));
+    obj.push_back(Pair("headers",       GetBestHeaderHeight()));
     obj.push_back(Pair("timeoffset",    (boost::int64_t)GetTimeOffset()));
     obj.push_back(Pair("connections",   (int)vNodes.size()));
     obj.push_back(Pair("proxy",         (fUseProxy ? addrProxy.ToStringIPPort() : string())));
@@ -743,6 +744,111 @@ Value getinfo(const Array& params, bool fHelp)
 }
 
 
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns statistics of the signature verification cache.");
+
+    CSignatureCacheStats stats;
+    GetSignatureCacheStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("size",          (int)stats.nSize));
+    obj.push_back(Pair("maxsize",       (int)stats.nMaxSize));
+    obj.push_back(Pair("hits",          (boost::int64_t)stats.nHits));
+    obj.push_back(Pair("misses",        (boost::int64_t)stats.nMisses));
+    obj.push_back(Pair("evictions",     (boost::int64_t)stats.nEvictions));
+    uint64 nLookups = stats.nHits + stats.nMisses;
+    obj.push_back(Pair("hitrate",       nLookups ? (double)stats.nHits / nLookups : 0.0));
+    return obj;
+}
+
+
+Value getblockfileinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getblockfileinfo\n"
+            "Returns statistics of writes to the block files and of syncing them\n"
+            "to disk.  Times are in microseconds.  With -prune, also the target\n"
+            "size in bytes and the height up to which blocks may have been deleted.");
+
+    CBlockFileWriterStats stats;
+    blockfilewriter.GetStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("file",          (int)stats.nFile));
+    obj.push_back(Pair("syncpolicy",    stats.nSyncPolicy));
+    obj.push_back(Pair("writes",        (boost::int64_t)stats.nWrites));
+    obj.push_back(Pair("bytes",         (boost::int64_t)stats.nBytes));
+    obj.push_back(Pair("avgwritetime",  stats.nWrites ? (boost::int64_t)(stats.nWriteMicros / stats.nWrites) : (boost::int64_t)0));
+    obj.push_back(Pair("maxwritetime",  (boost::int64_t)stats.nMaxWriteMicros));
+    obj.push_back(Pair("preallocations", (boost::int64_t)stats.nExtends));
+    obj.push_back(Pair("preallocated",  (boost::int64_t)stats.nExtendBytes));
+    obj.push_back(Pair("syncs",         (boost::int64_t)stats.nSyncs));
+    obj.push_back(Pair("avgsynctime",   stats.nSyncs ? (boost::int64_t)(stats.nSyncMicros / stats.nSyncs) : (boost::int64_t)0));
+    obj.push_back(Pair("maxsynctime",   (boost::int64_t)stats.nMaxSyncMicros));
+    obj.push_back(Pair("unsynced",      (boost::int64_t)stats.nPendingBytes));
+    if (nPruneTarget > 0)
+    {
+        obj.push_back(Pair("prunetarget", (boost::int64_t)nPruneTarget));
+        obj.push_back(Pair("pruneheight", nBlockPruneHeight));
+    }
+    return obj;
+}
+
+
+Value getlockinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getlockinfo\n"
+            "Returns for each named critical section how often it was taken,\n"
+            "how often it had to be waited for and the total waiting time.\n"
+            "Times are in microseconds.");
+
+    std::vector<CLockStats> vStats;
+    GetLockStats(vStats);
+
+    Object ret;
+    BOOST_FOREACH(const CLockStats& stats, vStats)
+    {
+        Object obj;
+        obj.push_back(Pair("locks",         (boost::int64_t)stats.nLocks));
+        obj.push_back(Pair("contentions",   (boost::int64_t)stats.nContentions));
+        obj.push_back(Pair("waittime",      (boost::int64_t)stats.nWaitMicros));
+        obj.push_back(Pair("avgwaittime",   stats.nContentions ? (boost::int64_t)(stats.nWaitMicros / stats.nContentions) : (boost::int64_t)0));
+        ret.push_back(Pair(stats.strName, obj));
+    }
+    return ret;
+}
+
+
+Value gettemplateinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "gettemplateinfo\n"
+            "Returns how often and how fast block templates for mining were built\n"
+            "from scratch (new best block) or updated with new transactions.\n"
+            "Times are in microseconds.");
+
+    CBlockTemplateStats stats;
+    GetBlockTemplateStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("builds",        (boost::int64_t)stats.nBuilds));
+    obj.push_back(Pair("lastbuildtime", (boost::int64_t)stats.nLastBuildTime));
+    obj.push_back(Pair("avgbuildtime",  stats.nBuilds ? (boost::int64_t)(stats.nTotalBuildTime / stats.nBuilds) : (boost::int64_t)0));
+    obj.push_back(Pair("updates",       (boost::int64_t)stats.nUpdates));
+    obj.push_back(Pair("lastupdatetime", (boost::int64_t)stats.nLastUpdateTime));
+    obj.push_back(Pair("avgupdatetime", stats.nUpdates ? (boost::int64_t)(stats.nTotalUpdateTime / stats.nUpdates) : (boost::int64_t)0));
+    return obj;
+}
+
+
 Value getnewaddress(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -2244,16 +2350,22 @@ Value getworkaux(const Array& params, bool fHelp)
         static vector<unsigned char> vchAuxPrev;
         vector<unsigned char> vchAux = ParseHex(params[0].get_str());
 
-        // Update block
-        static unsigned int nTransactionsUpdatedLast;
+        // Update block; the template only takes the locks if the best
+        // block or the memory pool changed
+        static CBlockTemplate* ptemplate;
         static CBlockIndex* pindexPrev;
-        static int64 nStart;
         static CBlock* pblock;
-        if (pindexPrev != pindexBest ||
-            vchAux != vchAuxPrev ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+        if (ptemplate && ptemplate->GetAlgo() != miningAlgo)
         {
-            if (pindexPrev != pindexBest)
+            delete ptemplate;
+            ptemplate = NULL;
+        }
+        if (!ptemplate)
+            ptemplate = new CBlockTemplate(reservekey, miningAlgo);
+        bool fNewTemplate = ptemplate->Update();
+        if (fNewTemplate || !pblock || vchAux != vchAuxPrev)
+        {
+            if (pindexPrev != ptemplate->GetPrev())
             {
                 // Deallocate old blocks since they're obsolete now
                 mapNewBlock.clear();
@@ -2261,15 +2373,10 @@ Value getworkaux(const Array& params, bool fHelp)
                     delete pblock;
                 vNewBlock.clear();
             }
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            pindexPrev = pindexBest;
+            pindexPrev = ptemplate->GetPrev();
             vchAuxPrev = vchAux;
-            nStart = GetTime();
 
-            // Create new block
-            pblock = CreateNewBlock(reservekey, miningAlgo);
-            if (!pblock)
-                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+            pblock = new CBlock(ptemplate->GetBlock());
             vNewBlock.push_back(pblock);
         }
 
@@ -2280,7 +2387,7 @@ Value getworkaux(const Array& params, bool fHelp)
         // Update nExtraNonce
         static unsigned int nExtraNonce = 0;
         static int64 nPrevTime = 0;
-        IncrementExtraNonceWithAux(pblock, pindexPrev, nExtraNonce, nPrevTime, vchAux);
+        IncrementExtraNonceWithAux(pblock, pindexPrev, nExtraNonce, nPrevTime, vchAux, &ptemplate->GetCoinbaseBranch());
 
         // Save
         mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, nExtraNonce);
@@ -2489,15 +2596,21 @@ Value getauxblock(const Array& params, bool fHelp)
 
     if (params.size() == 0)
     {
-        // Update block
-        static unsigned int nTransactionsUpdatedLast;
+        // Update block; the template only takes the locks if the best
+        // block or the memory pool changed
+        static CBlockTemplate* ptemplate;
         static CBlockIndex* pindexPrev;
-        static int64 nStart;
         static CBlock* pblock;
-        if (pindexPrev != pindexBest ||
-            (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 60))
+        if (ptemplate && ptemplate->GetAlgo() != miningAlgo)
         {
-            if (pindexPrev != pindexBest)
+            delete ptemplate;
+            ptemplate = NULL;
+        }
+        if (!ptemplate)
+            ptemplate = new CBlockTemplate(reservekey, miningAlgo);
+        if (ptemplate->Update() || !pblock)
+        {
+            if (pindexPrev != ptemplate->GetPrev())
             {
                 // Deallocate old blocks since they're obsolete now
                 mapNewBlock.clear();
@@ -2505,29 +2618,26 @@ Value getauxblock(const Array& params, bool fHelp)
                     delete pblock;
                 vNewBlock.clear();
             }
-            nTransactionsUpdatedLast = nTransactionsUpdated;
-            pindexPrev = pindexBest;
-            nStart = GetTime();
+            pindexPrev = ptemplate->GetPrev();
 
             // Create new block with nonce = 0 and extraNonce = 1
-            pblock = CreateNewBlock(reservekey, miningAlgo);
+            pblock = new CBlock(ptemplate->GetBlock());
 
             // Update nTime
             pblock->nTime = max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
             pblock->nNonce = 0;
 
-            // Push OP_2 just in case we want versioning later
+            // Push OP_2 just in case we want versioning later; only the
+            // coinbase changes, so its merkle branch gives the new root
             pblock->vtx[0].vin[0].scriptSig = CScript() << pblock->nBits << CBigNum(1) << OP_2;
-            pblock->hashMerkleRoot = pblock->BuildMerkleTree(false);
+            pblock->vMerkleTree.clear();
+            pblock->hashMerkleRoot = CBlock::CheckMerkleBranch(pblock->vtx[0].GetHash(), ptemplate->GetCoinbaseBranch(), 0);
 
             // Sets the version
             pblock->SetAuxPow(new CAuxPow(miningAlgo));
 
             // Save
             mapNewBlock[pblock->GetHash()] = pblock;
-
-            if (!pblock)
-                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
             vNewBlock.push_back(pblock);
         }
 
@@ -2948,7 +3058,7 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
     if (hashBlock != 0)
     {
         entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-        map<uint256, CBlockIndex*>::const_iterator mi = mapBlockIndex.find(hashBlock);
+        CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end() && (*mi).second)
         {
             pindex = (*mi).second;
@@ -3521,6 +3631,10 @@ pair<string, rpcfn_type> pCallTable[] =
     make_pair("setgenerate",           &setgenerate),
     make_pair("gethashespersec",       &gethashespersec),
     make_pair("getinfo",               &getinfo),
+    make_pair("getsigcacheinfo",       &getsigcacheinfo),
+    make_pair("gettemplateinfo",       &gettemplateinfo),
+    make_pair("getlockinfo",           &getlockinfo),
+    make_pair("getblockfileinfo",      &getblockfileinfo),
     make_pair("getnewaddress",         &getnewaddress),
     make_pair("getaccountaddress",     &getaccountaddress),
     make_pair("setaccount",            &setaccount),
@@ -3589,6 +3703,10 @@ string pAllowInSafeMode[] =
     "setgenerate",
     "gethashespersec",
     "getinfo",
+    "getsigcacheinfo",
+    "gettemplateinfo",
+    "getlockinfo",
+    "getblockfileinfo",
     "getnewaddress",
     "getaccountaddress",
     "setlabel",
@@ -3614,6 +3732,7 @@ set<string> setAllowInSafeMode(pAllowInSafeMode, pAllowInSafeMode + sizeof(pAllo
 string pCallAsync[] =
 {
     "analyseutxo",
+    "dumputxoset",
 };
 set<string> setCallAsync(pCallAsync, pCallAsync + sizeof(pCallAsync)/sizeof(pCallAsync[0]));
 
@@ -0,0 +1,521 @@
+#include "headers.h"
+#include "blockstore.h"
+#include "db.h"
+#include "net.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+
+#ifdef __linux__
+#include <fcntl.h>
+#endif
+
+using namespace std;
+
+CBlockFileMap blockfilemap;
+
+CBlockFileMap::CBlockFileMap()
+  : cs("cs_blockfilemap"), nEnabled(-1)
+{
+}
+
+CBlockFileMap::MappingRef CBlockFileMap::Get(unsigned int nFile, unsigned int nMinSize)
+{
+    if (nFile == (unsigned int)-1)
+        return MappingRef();
+
+    CRITICAL_BLOCK(cs)
+    {
+        // Large files need address space, so map by default only on 64 bit
+        if (nEnabled == -1)
+            nEnabled = GetBoolArg("-mmapblocks", sizeof(void*) >= 8) ? 1 : 0;
+        if (!nEnabled)
+            return MappingRef();
+
+        map<unsigned int, MappingRef>::iterator mi = mapFiles.find(nFile);
+        if (mi != mapFiles.end() && mi->second->get_size() >= nMinSize)
+            return mi->second;
+
+        const string strFile = strprintf("%s/blk%04d.dat", GetDataDir().c_str(), nFile);
+        boost::system::error_code ec;
+        const boost::uintmax_t nFileSize = boost::filesystem::file_size(strFile, ec);
+        if (ec || nFileSize < nMinSize)
+            return MappingRef();
+
+        MappingRef pregion;
+        try
+        {
+            // The region keeps the mapping after the file handle is closed
+            boost::interprocess::file_mapping file(strFile.c_str(), boost::interprocess::read_only);
+            pregion.reset(new boost::interprocess::mapped_region(file, boost::interprocess::read_only));
+        }
+        catch (boost::interprocess::interprocess_exception& e)
+        {
+            printf("CBlockFileMap::Get() : mapping %s failed: %s\n", strFile.c_str(), e.what());
+            return MappingRef();
+        }
+        if (fDebug)
+            printf("CBlockFileMap::Get() : mapped %s (%"PRIszu" bytes)\n", strFile.c_str(), pregion->get_size());
+
+        mapFiles[nFile] = pregion;
+        return pregion;
+    }
+
+    // not reached
+    return MappingRef();
+}
+
+void CBlockFileMap::Close(unsigned int nFile)
+{
+    CRITICAL_BLOCK(cs)
+        mapFiles.erase(nFile);
+}
+
+void CBlockFileMap::CloseAll()
+{
+    CRITICAL_BLOCK(cs)
+        mapFiles.clear();
+}
+
+
+
+static const unsigned int BLOCKFILE_MAX_SIZE = 0x7F000000;
+// Smaller files when pruning, so that less is kept beyond the target
+static const unsigned int PRUNE_BLOCKFILE_MAX_SIZE = 0x8000000;
+static const unsigned int BLOCKFILE_CHUNK_SIZE = 16 * (1 << 20);
+
+// Limits for grouping syncs during the initial download
+static const unsigned int SYNC_GROUP_WRITES = 500;
+static const uint64 SYNC_GROUP_BYTES = 64 * (1 << 20);
+static const int64 SYNC_GROUP_MILLIS = 30 * 1000;
+
+CBlockFileWriter blockfilewriter;
+
+CBlockFileWriter::CBlockFileWriter()
+  : cs("cs_blockfilewriter"), file(NULL), nFile(1), nFileSize(0), nReserved(0),
+    nFileHeight(-1), nMaxFileSize(0),
+    nDirtyWrites(0), nDirtyBytes(0), nDirtySince(0), fSyncNow(false), fQuit(false),
+    nSyncPolicy(-1)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+CBlockFileWriter::~CBlockFileWriter()
+{
+    if (file != NULL)
+        fclose(file);
+}
+
+// Caller holds cs
+bool CBlockFileWriter::Open(CTxDB& txdb)
+{
+    // Deleted files are not written to again
+    while (txdb.IsBlockFilePruned(nFile))
+        nFile++;
+
+    // Make sure the file exists, then open it for update so that the
+    // reserved space before its end can be written to
+    FILE* f = OpenBlockFile(nFile, 0, "ab");
+    if (f != NULL)
+        fclose(f);
+    file = OpenBlockFile(nFile, 0, "rb+");
+    if (file == NULL)
+        return error("CBlockFileWriter::Open() : opening blk%04u.dat failed", nFile);
+    if (fseek(file, 0, SEEK_END) != 0)
+    {
+        CloseCurrent();
+        return error("CBlockFileWriter::Open() : fseek failed");
+    }
+    nFileSize = ftell(file);
+    nReserved = txdb.ReadBlockFileReserved(nFile);
+    if (nReserved > nFileSize)
+    {
+        CloseCurrent();
+        return error("CBlockFileWriter::Open() : blk%04u.dat has %u bytes but %u are reserved", nFile, nFileSize, nReserved);
+    }
+    if (!txdb.ReadBlockFileHeight(nFile, nFileHeight))
+        nFileHeight = -1;
+    return true;
+}
+
+// Caller holds cs
+bool CBlockFileWriter::Extend(unsigned int nSize)
+{
+    bool fDone = false;
+#ifdef __linux__
+    // Lets the file system allocate the chunk in one piece, without
+    // writing it
+    fDone = (posix_fallocate(fileno(file), nFileSize, nSize) == 0);
+#endif
+    if (!fDone)
+    {
+        std::vector<char> buf(nSize, '\0');
+        if (fseek(file, 0, SEEK_END) != 0)
+            return error("CBlockFileWriter::Extend() : fseek failed");
+        const unsigned int nWritten = fwrite(&buf[0], 1, nSize, file);
+        if (nWritten != nSize || fflush(file) != 0)
+            return error("CBlockFileWriter::Extend() : write to extend by %u bytes failed, only %u written", nSize, nWritten);
+    }
+    printf("Block file extended by %u bytes.\n", nSize);
+
+    nFileSize += nSize;
+    nReserved += nSize;
+    stats.nExtends++;
+    stats.nExtendBytes += nSize;
+    return true;
+}
+
+// Caller holds cs
+void CBlockFileWriter::CloseCurrent()
+{
+    if (file == NULL)
+        return;
+    if (nSyncPolicy > 0)
+        Sync(file);
+    fclose(file);
+    file = NULL;
+}
+
+void CBlockFileWriter::Sync(FILE* f)
+{
+    int64 nStart = GetTimeMicros();
+#ifdef __WXMSW__
+    _commit(_fileno(f));
+#else
+    fsync(fileno(f));
+#endif
+    int64 nTime = GetTimeMicros() - nStart;
+
+    boost::unique_lock<boost::mutex> lock(mutexSync);
+    stats.nSyncs++;
+    stats.nSyncMicros += nTime;
+    stats.nMaxSyncMicros = std::max(stats.nMaxSyncMicros, nTime);
+}
+
+// Any handle to the file will do, syncing covers all writes to it
+void CBlockFileWriter::SyncFile(unsigned int nFileSync)
+{
+    FILE* f = OpenBlockFile(nFileSync, 0, "rb+");
+    if (f == NULL)
+    {
+        printf("CBlockFileWriter::SyncFile() : opening blk%04u.dat failed\n", nFileSync);
+        return;
+    }
+    Sync(f);
+    fclose(f);
+}
+
+void CBlockFileWriter::MarkDirty(unsigned int nFileDirty, unsigned int nBytes)
+{
+    // Outside of the initial download a write is synced right away (and
+    // writes arriving meanwhile share that sync); during it they are
+    // grouped
+    const bool fGroup = IsInitialBlockDownload();
+
+    boost::unique_lock<boost::mutex> lock(mutexSync);
+    setDirty.insert(nFileDirty);
+    nDirtyWrites++;
+    nDirtyBytes += nBytes;
+    if (nDirtySince == 0)
+        nDirtySince = GetTimeMillis();
+    if (!fGroup || nDirtyWrites >= SYNC_GROUP_WRITES || nDirtyBytes >= SYNC_GROUP_BYTES)
+    {
+        fSyncNow = true;
+        condSync.notify_one();
+    }
+}
+
+bool CBlockFileWriter::Append(CTxDB& txdb, const CDataStream& ss, int nHeight, unsigned int& nFileRet, unsigned int& nPosRet)
+{
+    const unsigned int nSize = ss.size();
+    if (!CheckDiskSpace(nSize))
+        return error("CBlockFileWriter::Append() : out of disk space");
+    if (fDebug)
+        printf("CBlockFileWriter::Append() : adding %u bytes\n", nSize);
+
+    int nPolicy = 0;
+    CRITICAL_BLOCK(cs)
+    {
+        if (nSyncPolicy == -1)
+            nSyncPolicy = GetArg("-syncblocks", 1);
+        nPolicy = nSyncPolicy;
+        if (nMaxFileSize == 0)
+            nMaxFileSize = (nPruneTarget > 0 ? PRUNE_BLOCKFILE_MAX_SIZE : BLOCKFILE_MAX_SIZE);
+
+        const int64 nStart = GetTimeMicros();
+        loop
+        {
+            if (file == NULL && !Open(txdb))
+                return false;
+            if (nSize <= nReserved)
+                break;
+            const unsigned int nChunk = std::max(BLOCKFILE_CHUNK_SIZE, nSize - nReserved);
+            if (nFileSize + nChunk <= nMaxFileSize)
+            {
+                if (!Extend(nChunk))
+                    return false;
+                break;
+            }
+
+            // This one is full, go on with the next file
+            CloseCurrent();
+            nFile++;
+            nFileHeight = -1;
+        }
+
+        const unsigned int nPos = nFileSize - nReserved;
+        if (fseek(file, nPos, SEEK_SET) != 0
+            || fwrite(&ss.begin()[0], 1, nSize, file) != nSize
+            || fflush(file) != 0)
+        {
+            // Start over from what the DB says with the next write
+            fclose(file);
+            file = NULL;
+            return error("CBlockFileWriter::Append() : writing %u bytes to blk%04u.dat failed", nSize, nFile);
+        }
+        nReserved -= nSize;
+        if (!txdb.WriteBlockFileReserved(nFile, nReserved))
+            return error("CBlockFileWriter::Append() : WriteBlockFileReserved failed");
+        // Written with every record: the write for a higher height may
+        // have been part of a DB transaction that was aborted
+        nFileHeight = std::max(nFileHeight, nHeight);
+        if (!txdb.WriteBlockFileHeight(nFile, nFileHeight))
+            return error("CBlockFileWriter::Append() : WriteBlockFileHeight failed");
+
+        const int64 nTime = GetTimeMicros() - nStart;
+        stats.nWrites++;
+        stats.nBytes += nSize;
+        stats.nWriteMicros += nTime;
+        stats.nMaxWriteMicros = std::max(stats.nMaxWriteMicros, nTime);
+
+        if (nPolicy >= 2)
+            Sync(file);
+
+        nFileRet = nFile;
+        nPosRet = nPos;
+    }
+
+    if (nPolicy == 1)
+        MarkDirty(nFileRet, nSize);
+    return true;
+}
+
+void CBlockFileWriter::Written(FILE* f, unsigned int nFileWritten, unsigned int nBytes)
+{
+    fflush(f);
+
+    int nPolicy = 0;
+    CRITICAL_BLOCK(cs)
+    {
+        if (nSyncPolicy == -1)
+            nSyncPolicy = GetArg("-syncblocks", 1);
+        nPolicy = nSyncPolicy;
+    }
+    if (nPolicy >= 2)
+        Sync(f);
+    else if (nPolicy == 1)
+        MarkDirty(nFileWritten, nBytes);
+}
+
+void CBlockFileWriter::Close()
+{
+    std::set<unsigned int> setFiles;
+    {
+        boost::unique_lock<boost::mutex> lock(mutexSync);
+        setFiles.swap(setDirty);
+        nDirtyWrites = 0;
+        nDirtyBytes = 0;
+        nDirtySince = 0;
+    }
+    CRITICAL_BLOCK(cs)
+    {
+        if (file != NULL)
+            setFiles.erase(nFile);
+        CloseCurrent();
+    }
+    BOOST_FOREACH(unsigned int nFileSync, setFiles)
+        SyncFile(nFileSync);
+}
+
+void CBlockFileWriter::ThreadSync()
+{
+    boost::unique_lock<boost::mutex> lock(mutexSync);
+    while (!fQuit)
+    {
+        if (!fSyncNow && (setDirty.empty() || GetTimeMillis() - nDirtySince < SYNC_GROUP_MILLIS))
+        {
+            condSync.timed_wait(lock, boost::posix_time::seconds(1));
+            continue;
+        }
+
+        std::set<unsigned int> setFiles;
+        setFiles.swap(setDirty);
+        nDirtyWrites = 0;
+        nDirtyBytes = 0;
+        nDirtySince = 0;
+        fSyncNow = false;
+
+        lock.unlock();
+        BOOST_FOREACH(unsigned int nFileSync, setFiles)
+            SyncFile(nFileSync);
+        lock.lock();
+    }
+}
+
+void CBlockFileWriter::Quit()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexSync);
+        fQuit = true;
+    }
+    condSync.notify_all();
+}
+
+void CBlockFileWriter::GetStats(CBlockFileWriterStats& statsRet)
+{
+    CRITICAL_BLOCK(cs)
+    {
+        boost::unique_lock<boost::mutex> lock(mutexSync);
+        statsRet = stats;
+        statsRet.nPendingBytes = nDirtyBytes;
+        statsRet.nFile = nFile;
+        statsRet.nSyncPolicy = (nSyncPolicy == -1 ? GetArg("-syncblocks", 1) : nSyncPolicy);
+    }
+}
+
+unsigned int CBlockFileWriter::GetCurrentFile()
+{
+    CRITICAL_BLOCK(cs)
+        return nFile;
+    // not reached
+    return nFile;
+}
+
+void ThreadBlockFileSync(void* parg)
+{
+    vnThreadsRunning[9]++;
+    blockfilewriter.ThreadSync();
+    vnThreadsRunning[9]--;
+}
+
+void StartBlockFileSync()
+{
+    if (!CreateThread(ThreadBlockFileSync, NULL))
+        printf("Error: CreateThread(ThreadBlockFileSync) failed\n");
+}
+
+void StopBlockFileSync()
+{
+    blockfilewriter.Quit();
+}
+
+
+
+static const unsigned int SCAN_BUFFER_SIZE = 1 << 20;
+
+// Reads a block file in large pieces for ScanBlockFile
+class CBlockFileScanner
+{
+private:
+    FILE* file;
+    std::vector<char> vBuf;
+    unsigned int nBufPos;
+    unsigned int nBufLen;
+
+public:
+    const unsigned int nFileSize;
+
+    CBlockFileScanner(FILE* fileIn, unsigned int nFileSizeIn)
+      : file(fileIn), vBuf(SCAN_BUFFER_SIZE), nBufPos(0), nBufLen(0), nFileSize(nFileSizeIn)
+    {
+    }
+
+    // nSize bytes at nPos, or NULL if they are past the end of the file
+    const char* Fetch(unsigned int nPos, unsigned int nSize)
+    {
+        if (nSize > vBuf.size() || nPos > nFileSize || nSize > nFileSize - nPos)
+            return NULL;
+        if (nPos < nBufPos || nPos + nSize > nBufPos + nBufLen)
+        {
+            nBufPos = nPos;
+            nBufLen = 0;
+            if (fseek(file, nPos, SEEK_SET) != 0)
+                return NULL;
+            nBufLen = fread(&vBuf[0], 1, std::min((unsigned int)vBuf.size(), nFileSize - nPos), file);
+            if (nBufLen < nSize)
+                return NULL;
+        }
+        return &vBuf[nPos - nBufPos];
+    }
+
+    // Position of the next message start from nPos on, or the end of the
+    // file if there is none
+    unsigned int ScanMessageStart(unsigned int nPos)
+    {
+        const char* pchBegin = (const char*)pchMessageStart;
+        const char* pchEnd = pchBegin + sizeof(pchMessageStart);
+        while (nPos < nFileSize && nFileSize - nPos >= sizeof(pchMessageStart))
+        {
+            const unsigned int nChunk = std::min((unsigned int)vBuf.size(), nFileSize - nPos);
+            const char* pbegin = Fetch(nPos, nChunk);
+            if (pbegin == NULL)
+                break;
+            const char* p = std::search(pbegin, pbegin + nChunk, pchBegin, pchEnd);
+            if (p != pbegin + nChunk)
+                return nPos + (p - pbegin);
+            // a message start may straddle the end of this piece
+            nPos += nChunk - (sizeof(pchMessageStart) - 1);
+        }
+        return nFileSize;
+    }
+};
+
+bool ScanBlockFile(unsigned int nFile, vector<CBlockFileRecord>& vRecords, unsigned int& nReservedRet, unsigned int& nSkippedRet)
+{
+    static const char pchMessageVGameTx[8] = { 'v', 'g', 'a', 'm', 'e', 't', 'x', ':' };
+    const unsigned int nHeaderSize = sizeof(pchMessageStart) + sizeof(unsigned int);
+
+    nReservedRet = 0;
+    nSkippedRet = 0;
+    CAutoFile filein = OpenBlockFile(nFile, 0, "rb");
+    if (!filein)
+        return error("ScanBlockFile() : opening blk%04u.dat failed", nFile);
+    if (fseek(filein, 0, SEEK_END) != 0)
+        return error("ScanBlockFile() : fseek failed");
+    CBlockFileScanner scanner(filein, ftell(filein));
+
+    unsigned int nPos = 0;
+    unsigned int nEnd = 0;
+    while (nPos < scanner.nFileSize)
+    {
+        unsigned int nSize = 0;
+        const char* pheader = scanner.Fetch(nPos, nHeaderSize);
+        if (pheader != NULL && memcmp(pheader, pchMessageStart, sizeof(pchMessageStart)) == 0)
+            memcpy(&nSize, pheader + sizeof(pchMessageStart), sizeof(nSize));
+        if (nSize == 0 || nSize > scanner.nFileSize - nPos - nHeaderSize)
+        {
+            // Damaged, or the zeroed reserved space at the end
+            const unsigned int nNext = scanner.ScanMessageStart(nPos + 1);
+            if (nNext < scanner.nFileSize)
+                nSkippedRet += nNext - nPos;
+            nPos = nNext;
+            continue;
+        }
+
+        const char* ptag = NULL;
+        if (nSize >= sizeof(pchMessageVGameTx))
+            ptag = scanner.Fetch(nPos + nHeaderSize, sizeof(pchMessageVGameTx));
+        if (ptag == NULL || memcmp(ptag, pchMessageVGameTx, sizeof(pchMessageVGameTx)) != 0)
+        {
+            CBlockFileRecord record;
+            record.nFile = nFile;
+            record.nPos = nPos + nHeaderSize;
+            record.nSize = nSize;
+            vRecords.push_back(record);
+        }
+        nPos += nHeaderSize + nSize;
+        nEnd = nPos;
+    }
+    nReservedRet = scanner.nFileSize - nEnd;
+    return true;
+}
@@ -0,0 +1,237 @@
+#ifndef BLOCKSTORE_H
+#define BLOCKSTORE_H
+
+#include "serialize.h"
+#include "util.h"
+
+#include <boost/shared_ptr.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <map>
+#include <set>
+#include <vector>
+
+class CTxDB;
+
+// Read-only access to the block files (blk*.dat) through memory mappings.
+// Each file is mapped once and stays mapped; objects are deserialised
+// straight from the mapped memory, so block and transaction reads neither
+// reopen the file nor go through stdio buffering.  A mapping is replaced
+// by a larger one when a read reaches past its end, which happens as the
+// files grow with newly stored blocks.
+
+// Stream subset reading from a range of memory
+class CMappedStream
+{
+protected:
+    const char* pcur;
+    const char* pend;
+    bool fEnd;
+
+public:
+    int nType;
+    int nVersion;
+
+    CMappedStream(const char* pbegin, const char* pendIn, int nTypeIn=SER_DISK, int nVersionIn=VERSION)
+      : pcur(pbegin), pend(pendIn), fEnd(false), nType(nTypeIn), nVersion(nVersionIn)
+    {
+    }
+
+    // whether a read failed because the range ended
+    bool eof() const             { return fEnd; }
+    bool empty() const           { return pcur == pend; }
+
+    CMappedStream& read(char* pch, int nSize)
+    {
+        if (nSize < 0 || nSize > pend - pcur)
+        {
+            fEnd = true;
+            throw std::ios_base::failure("CMappedStream::read : end of data");
+        }
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    unsigned int GetSerializeSize(const T& obj)
+    {
+        return ::GetSerializeSize(obj, nType, nVersion);
+    }
+
+    template<typename T>
+    CMappedStream& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+class CBlockFileMap
+{
+private:
+    typedef boost::shared_ptr<const boost::interprocess::mapped_region> MappingRef;
+
+    CCriticalSection cs;
+    std::map<unsigned int, MappingRef> mapFiles;
+    int nEnabled;
+
+    // Mapping of the whole file with at least nMinSize bytes, or NULL
+    MappingRef Get(unsigned int nFile, unsigned int nMinSize);
+
+public:
+    CBlockFileMap();
+
+    // Deserialise obj from position nPos of block file nFile.  Returns false
+    // if the file can't be mapped (or mapping is disabled with
+    // -mmapblocks=0); the caller then reads it with stdio instead.  Throws
+    // like a file stream on truncated data.
+    template<typename T>
+    bool Read(unsigned int nFile, unsigned int nPos, T& obj, int nType=SER_DISK, int nVersion=VERSION)
+    {
+        unsigned int nMinSize = nPos + 1;
+        loop
+        {
+            // Readers keep their reference to the mapping, so it is not
+            // unmapped under them if another thread replaces it
+            MappingRef pregion = Get(nFile, nMinSize);
+            if (!pregion)
+                return false;
+            const char* pbegin = static_cast<const char*>(pregion->get_address());
+            const unsigned int nSize = pregion->get_size();
+            CMappedStream s(pbegin + nPos, pbegin + nSize, nType, nVersion);
+            try
+            {
+                s >> obj;
+                return true;
+            }
+            catch (std::ios_base::failure& e)
+            {
+                // The object may reach into a part of the file written
+                // after it was mapped; retry once with a fresh mapping
+                if (!s.eof() || nMinSize > nSize)
+                    throw;
+                nMinSize = nSize + 1;
+            }
+        }
+    }
+
+    // Drop the mapping of a file (before it is truncated or removed)
+    void Close(unsigned int nFile);
+    void CloseAll();
+};
+
+extern CBlockFileMap blockfilemap;
+
+
+
+// Appending to the block files.  The file currently written to stays
+// open; it grows in preallocated chunks whose unused part is recorded in
+// the DB ("blkreserved"), and each record is written with one call.  The
+// highest block height written to each file is recorded as well
+// ("blkheight"), which tells -prune when a file is no longer needed.  How
+// the writes are synced to disk is set with -syncblocks:
+//   0  leave it to the operating system
+//   1  sync in a background thread, so that writes close together share
+//      one fsync; during the initial download only every 500 writes,
+//      64 MB or 30 seconds (default)
+//   2  sync every write before returning
+struct CBlockFileWriterStats
+{
+    uint64 nWrites;
+    uint64 nBytes;
+    int64 nWriteMicros;
+    int64 nMaxWriteMicros;
+    uint64 nExtends;
+    uint64 nExtendBytes;
+    uint64 nSyncs;
+    int64 nSyncMicros;
+    int64 nMaxSyncMicros;
+    uint64 nPendingBytes;
+    unsigned int nFile;
+    int nSyncPolicy;
+};
+
+class CBlockFileWriter
+{
+private:
+    // current file, guarded by cs
+    CCriticalSection cs;
+    FILE* file;
+    unsigned int nFile;
+    unsigned int nFileSize;
+    unsigned int nReserved;
+    int nFileHeight;
+    unsigned int nMaxFileSize;
+
+    // writes not yet synced, guarded by mutexSync
+    boost::mutex mutexSync;
+    boost::condition_variable condSync;
+    std::set<unsigned int> setDirty;
+    unsigned int nDirtyWrites;
+    uint64 nDirtyBytes;
+    int64 nDirtySince;
+    bool fSyncNow;
+    bool fQuit;
+
+    int nSyncPolicy;
+    CBlockFileWriterStats stats;
+
+    bool Open(CTxDB& txdb);
+    bool Extend(unsigned int nSize);
+    void CloseCurrent();
+    void Sync(FILE* f);
+    void SyncFile(unsigned int nFileSync);
+    void MarkDirty(unsigned int nFileDirty, unsigned int nBytes);
+
+public:
+    CBlockFileWriter();
+    ~CBlockFileWriter();
+
+    // Append the record in ss, which belongs to the block at nHeight, to
+    // the block files and record the new reservation through txdb; the
+    // record starts at nPosRet of nFileRet
+    bool Append(CTxDB& txdb, const CDataStream& ss, int nHeight, unsigned int& nFileRet, unsigned int& nPosRet);
+
+    // Account for nBytes written to block file nFile through another
+    // handle (f), which is flushed and synced according to the policy
+    void Written(FILE* f, unsigned int nFileWritten, unsigned int nBytes);
+
+    // Sync all outstanding writes and close the current file
+    void Close();
+
+    void ThreadSync();
+    void Quit();
+
+    void GetStats(CBlockFileWriterStats& statsRet);
+
+    // The file being written to (or the next one to be opened); files
+    // before it are complete
+    unsigned int GetCurrentFile();
+};
+
+extern CBlockFileWriter blockfilewriter;
+
+void StartBlockFileSync();
+void StopBlockFileSync();
+
+
+
+// A block record found by ScanBlockFile; the block itself starts at nPos
+struct CBlockFileRecord
+{
+    unsigned int nFile;
+    unsigned int nPos;
+    unsigned int nSize;
+};
+
+// Find the block records of block file nFile for -reindex, in file order.
+// Records follow each other; where one is damaged, the scan goes on at the
+// next message start, and nSkippedRet counts the bytes passed over.  Game
+// transaction records are skipped.  The space after the last record of any
+// kind is reserved space (nReservedRet).
+bool ScanBlockFile(unsigned int nFile, std::vector<CBlockFileRecord>& vRecords, unsigned int& nReservedRet, unsigned int& nSkippedRet);
+
+#endif
@@ -0,0 +1,217 @@
+#ifndef CHECKQUEUE_H
+#define CHECKQUEUE_H
+
+#include "util.h"
+
+#include <boost/foreach.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+template<typename T> class CCheckQueueControl;
+
+// Queue of verifications to be run by a pool of worker threads.
+// A check is an object of type T with "bool operator()()" and "void swap(T&)".
+// The master thread (the one holding cs_main and feeding the queue) also
+// works on the queue while it waits for the batch result in Wait().
+template<typename T> class CCheckQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condMaster;
+
+    // checks waiting to be picked up (processed back to front)
+    std::vector<T> queue;
+
+    // threads not currently working, and threads participating at all
+    int nIdle;
+    int nTotal;
+
+    // result of the current batch so far
+    bool fAllOk;
+
+    // checks queued or in progress for the current batch
+    unsigned int nTodo;
+
+    bool fQuit;
+
+    // maximum number of checks one thread takes at a time
+    unsigned int nBatchSize;
+
+    // held by CCheckQueueControl for the duration of a batch
+    boost::mutex mutexControl;
+
+    bool Loop(bool fMaster)
+    {
+        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
+        std::vector<T> vChecks;
+        vChecks.reserve(nBatchSize);
+        unsigned int nNow = 0;
+        bool fOk = true;
+        loop
+        {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                // account for the batch just finished
+                if (nNow)
+                {
+                    fAllOk &= fOk;
+                    nTodo -= nNow;
+                    if (nTodo == 0 && !fMaster)
+                        condMaster.notify_one();
+                }
+                else
+                {
+                    // first iteration
+                    nTotal++;
+                }
+                while (queue.empty())
+                {
+                    if ((fMaster || fQuit) && nTodo == 0)
+                    {
+                        nTotal--;
+                        bool fRet = fAllOk;
+                        // reset for the next batch
+                        if (fMaster)
+                            fAllOk = true;
+                        return fRet;
+                    }
+                    nIdle++;
+                    cond.wait(lock);
+                    nIdle--;
+                }
+                // Take a share of the queue proportional to the number of
+                // threads, so the tail of a batch stays spread out
+                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
+                vChecks.resize(nNow);
+                for (unsigned int i = 0; i < nNow; i++)
+                {
+                    vChecks[i].swap(queue.back());
+                    queue.pop_back();
+                }
+                fOk = fAllOk;
+            }
+            // once a check failed the rest of the batch is only drained
+            BOOST_FOREACH(T& check, vChecks)
+                if (fOk)
+                    fOk = check();
+            vChecks.clear();
+        }
+    }
+
+public:
+    CCheckQueue(unsigned int nBatchSizeIn)
+      : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn)
+    {
+    }
+
+    // Worker thread body
+    void Thread()
+    {
+        Loop(false);
+    }
+
+    // Wait until the current batch is done; returns whether all checks passed
+    bool Wait()
+    {
+        return Loop(true);
+    }
+
+    // Add checks to the queue; the vector's elements are swapped out
+    void Add(std::vector<T>& vChecks)
+    {
+        if (vChecks.empty())
+            return;
+        boost::unique_lock<boost::mutex> lock(mutex);
+        BOOST_FOREACH(T& check, vChecks)
+        {
+            queue.push_back(T());
+            check.swap(queue.back());
+        }
+        nTodo += vChecks.size();
+        if (vChecks.size() == 1)
+            condWorker.notify_one();
+        else if (vChecks.size() > 1)
+            condWorker.notify_all();
+    }
+
+    // Let idle worker threads exit
+    void Quit()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+        }
+        condWorker.notify_all();
+    }
+
+    bool IsIdle()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return (nTotal == nIdle && nTodo == 0 && fAllOk);
+    }
+
+    friend class CCheckQueueControl<T>;
+};
+
+// RAII helper for one batch: makes sure the batch is waited for (and the
+// queue left empty for the next user) even when the caller returns early.
+// Without a queue (no worker threads) checks run inline in Add().
+template<typename T> class CCheckQueueControl
+{
+private:
+    CCheckQueue<T>* pqueue;
+    bool fDone;
+    bool fOk;
+
+public:
+    CCheckQueueControl(CCheckQueue<T>* pqueueIn) : pqueue(pqueueIn), fDone(false), fOk(true)
+    {
+        // one batch at a time; block connection and mempool acceptance
+        // may come from different threads
+        if (pqueue != NULL)
+        {
+            pqueue->mutexControl.lock();
+            assert(pqueue->IsIdle());
+        }
+    }
+
+    bool Wait()
+    {
+        if (fDone)
+            return fOk;
+        if (pqueue != NULL)
+        {
+            fOk = pqueue->Wait() && fOk;
+            pqueue->mutexControl.unlock();
+        }
+        fDone = true;
+        return fOk;
+    }
+
+    void Add(std::vector<T>& vChecks)
+    {
+        if (pqueue != NULL)
+            pqueue->Add(vChecks);
+        else
+        {
+            BOOST_FOREACH(T& check, vChecks)
+                if (fOk)
+                    fOk = check();
+        }
+        vChecks.clear();
+    }
+
+    ~CCheckQueueControl()
+    {
+        if (!fDone)
+            Wait();
+    }
+};
+
+#endif
@@ -8,8 +8,10 @@
 #include "auxpow.h" // Fixes a linker issue with GCC > 4.7.
 #include "huntercoin.h"
 #include "init.h"
+#include "blockstore.h"
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/thread/tss.hpp>
 
 using namespace std;
 using namespace boost;
@@ -23,9 +25,28 @@ unsigned int nWalletDBUpdated;
 // CDB
 //
 
-static CCriticalSection cs_db;
+static CCriticalSection cs_db("cs_db");
+
+static boost::thread_specific_ptr<CDBBuffers> pdbbuffers;
+
+CDBBuffers& GetDBBuffers()
+{
+    CDBBuffers* pbuffers = pdbbuffers.get();
+    if (pbuffers == NULL)
+    {
+        pbuffers = new CDBBuffers();
+        pdbbuffers.reset(pbuffers);
+    }
+    return *pbuffers;
+}
 static bool fDbEnvInit = false;
 bool fDetachDB = false;
+
+// Set while blocks are connected in a transaction spanning many of them
+// (initial download).  Reads of the chain databases without a transaction
+// of their own then see its uncommitted changes instead of blocking on its
+// locks.
+bool fDBReadUncommitted = false;
 DbEnv dbenv(0);
 static map<string, int> mapFileUseCount;
 static map<string, Db*> mapDb;
@@ -48,8 +69,8 @@ public:
 instance_of_cdbinit;
 
 
-CDB::CDB(const char* pszFile, const char* pszMode)
-  : pdb(NULL), nVersion(VERSION)
+CDB::CDB(const char* pszFile, const char* pszMode, bool fSecureIn, bool fChainStateIn)
+  : pdb(NULL), fSecure(fSecureIn), fChainState(fChainStateIn), nVersion(VERSION)
 {
     int ret;
     if (pszFile == NULL)
@@ -58,6 +79,8 @@ CDB::CDB(const char* pszFile, const char* pszMode)
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
     bool fCreate = strchr(pszMode, 'c');
     unsigned int nFlags = DB_THREAD;
+    if (fChainState)
+        nFlags |= DB_READ_UNCOMMITTED;
     if (fCreate)
         nFlags |= DB_CREATE;
 
@@ -370,6 +393,211 @@ CDB::PrintStorageStats (const std::string& file)
     }
 }
 
+bool
+CDB::EraseAll (const std::string& strType)
+{
+  if (!pdb)
+    return false;
+  assert (!fReadOnly);
+
+  /* The cursor must belong to the current transaction, since it is used
+     to delete records.  */
+  Dbc* pcursor = NULL;
+  if (pdb->cursor (GetTxn (), &pcursor, 0) != 0)
+    return error ("CDB::EraseAll: failed to get DB cursor");
+
+  CDataStream ssPrefix(SER_DISK, nVersion);
+  ssPrefix << (strType.empty () ? std::string ("version") : strType);
+  const std::string strPrefix = ssPrefix.str ();
+
+  unsigned nErased = 0;
+  unsigned int fFlags = (strType.empty () ? DB_NEXT : DB_SET_RANGE);
+  while (true)
+    {
+      CDataStream ssKey(SER_DISK, nVersion);
+      if (fFlags == DB_SET_RANGE)
+        ssKey << strType;
+      CDataStream ssValue(SER_DISK, nVersion);
+      const int ret = ReadAtCursor (pcursor, ssKey, ssValue, fFlags);
+      fFlags = DB_NEXT;
+      if (ret == DB_NOTFOUND)
+        break;
+      if (ret != 0)
+        {
+          pcursor->close ();
+          return error ("CDB::EraseAll: ReadAtCursor failed");
+        }
+
+      /* Keys need not start with a string (the game DB uses heights),
+         so compare the serialised prefix.  */
+      const std::string strKey = ssKey.str ();
+      if (strType.empty ())
+        {
+          if (strKey == strPrefix)
+            continue;
+        }
+      else if (strKey.compare (0, strPrefix.size (), strPrefix) != 0)
+        break;
+
+      if (pcursor->del (0) != 0)
+        {
+          pcursor->close ();
+          return error ("CDB::EraseAll: deleting a record failed");
+        }
+      ++nErased;
+    }
+  pcursor->close ();
+
+  printf ("Erased %u records from %s\n", nErased, strFile.c_str ());
+  return true;
+}
+
+
+
+//
+// CDBScan
+//
+
+// Initial size of the bulk buffer; BDB wants a multiple of 1024 here.  It
+// grows when a single record doesn't fit.
+static const unsigned int nScanBufferSize = 1 << 20;
+
+void CDBScan::Init(CDB& db, const std::string& strType)
+{
+    fSecure = db.fSecure;
+    nVersion = db.nVersion;
+    pnext = NULL;
+    fFirst = true;
+    fDone = false;
+    fError = false;
+    pchKey = pchKeyEnd = pchValue = pchValueEnd = NULL;
+
+    if (!strType.empty())
+    {
+        CDataStream ssPrefix(SER_DISK, nVersion);
+        ssPrefix << strType;
+        vchPrefix.assign(ssPrefix.begin(), ssPrefix.end());
+        vchStart = vchPrefix;
+    }
+
+    pcursor = db.GetCursor();
+    if (!pcursor)
+    {
+        fDone = true;
+        fError = true;
+        return;
+    }
+    vchBulk.resize(nScanBufferSize);
+}
+
+// Fill the bulk buffer with the next records; false at the end of the
+// database or on error
+bool CDBScan::Fetch()
+{
+    Dbt datKey;
+    u_int32_t fFlags = DB_NEXT;
+    if (fFirst)
+    {
+        if (vchStart.empty())
+            fFlags = DB_FIRST;
+        else
+        {
+            fFlags = DB_SET_RANGE;
+            datKey.set_data(&vchStart[0]);
+            datKey.set_size(vchStart.size());
+        }
+    }
+    datKey.set_flags(DB_DBT_MALLOC);
+    void* pchStart = datKey.get_data();
+
+    loop
+    {
+        datBulk.set_data(&vchBulk[0]);
+        datBulk.set_ulen(vchBulk.size());
+        datBulk.set_flags(DB_DBT_USERMEM);
+        int ret;
+        try
+        {
+            ret = pcursor->get(&datKey, &datBulk, fFlags | DB_MULTIPLE_KEY);
+        }
+        catch (DbMemoryException& e)
+        {
+            ret = DB_BUFFER_SMALL;
+        }
+        if (ret == DB_BUFFER_SMALL)
+        {
+            // The next record alone is larger than the buffer
+            unsigned int nSize = std::max((unsigned int)datBulk.get_size(), (unsigned int)vchBulk.size() * 2);
+            if (fSecure)
+                memset(&vchBulk[0], 0, vchBulk.size());
+            vchBulk.resize((nSize + 1023) / 1024 * 1024);
+            continue;
+        }
+
+        // Positioning may return the key found in memory of its own
+        if (datKey.get_data() != NULL && datKey.get_data() != pchStart)
+        {
+            if (fSecure)
+                memset(datKey.get_data(), 0, datKey.get_size());
+            free(datKey.get_data());
+        }
+
+        if (ret == DB_NOTFOUND)
+            return false;
+        if (ret != 0)
+        {
+            printf("CDBScan::Fetch() : cursor get failed, ret = %d\n", ret);
+            fError = true;
+            return false;
+        }
+        fFirst = false;
+        DB_MULTIPLE_INIT(pnext, datBulk.get_DBT());
+        return true;
+    }
+}
+
+bool CDBScan::Next()
+{
+    while (!fDone)
+    {
+        if (pnext == NULL && !Fetch())
+            break;
+
+        void* pkey;
+        void* pdata;
+        u_int32_t nKey, nData;
+        DB_MULTIPLE_KEY_NEXT(pnext, datBulk.get_DBT(), pkey, nKey, pdata, nData);
+        if (pnext == NULL)
+            continue;
+
+        // Keys are sorted, so the first one of another type ends the scan
+        pchKey = static_cast<const char*>(pkey);
+        if (!vchPrefix.empty() && (nKey < vchPrefix.size() || memcmp(pchKey, &vchPrefix[0], vchPrefix.size()) != 0))
+            break;
+        pchKeyEnd = pchKey + nKey;
+        pchKey += vchPrefix.size();
+        pchValue = static_cast<const char*>(pdata);
+        pchValueEnd = pchValue + nData;
+        return true;
+    }
+    Close();
+    return false;
+}
+
+void CDBScan::Close()
+{
+    if (pcursor)
+    {
+        pcursor->close();
+        pcursor = NULL;
+    }
+    if (fSecure && !vchBulk.empty())
+        memset(&vchBulk[0], 0, vchBulk.size());
+    vchBulk.clear();
+    pnext = NULL;
+    fDone = true;
+}
+
 void DBFlush(bool fShutdown)
 {
     // Flush log data to the actual data file
@@ -377,6 +605,13 @@ void DBFlush(bool fShutdown)
     printf("DBFlush(%s)%s\n", fShutdown ? "true" : "false", fDbEnvInit ? "" : " db not started");
     if (!fDbEnvInit)
         return;
+    if (fShutdown)
+    {
+        CUtxoCacheStats stats;
+        GetUtxoCacheStats(stats);
+        printf("UTXO cache: %u entries, %"PRI64u"/%"PRI64u" bytes, %"PRI64u" hits, %"PRI64u" misses, %"PRI64u" evicted, %"PRI64u" flushed\n",
+               stats.nEntries, stats.nUsage, stats.nMaxUsage, stats.nHits, stats.nMisses, stats.nEvictions, stats.nFlushed);
+    }
     CRITICAL_BLOCK(cs_db)
     {
         map<string, int>::iterator mi = mapFileUseCount.begin();
@@ -546,62 +781,127 @@ CTxDB::WriteBlockFileReserved (unsigned num, unsigned size)
   return Write (key, size);
 }
 
+bool
+CTxDB::ReadBlockFileHeight (unsigned num, int& nHeight)
+{
+  return Read (std::make_pair (std::string ("blkheight"), num), nHeight);
+}
+
+bool
+CTxDB::WriteBlockFileHeight (unsigned num, int nHeight)
+{
+  return Write (std::make_pair (std::string ("blkheight"), num), nHeight);
+}
+
+bool
+CTxDB::IsBlockFilePruned (unsigned num)
+{
+  return Exists (std::make_pair (std::string ("blkpruned"), num));
+}
+
+bool
+CTxDB::MarkBlockFilePruned (unsigned num)
+{
+  if (!Erase (std::make_pair (std::string ("blkreserved"), num))
+      || !Erase (std::make_pair (std::string ("blkheight"), num)))
+    return false;
+  return Write (std::make_pair (std::string ("blkpruned"), num), true);
+}
+
+bool
+CTxDB::ReadBlockPruneHeight (int& nHeight)
+{
+  return Read (std::string ("blkpruneheight"), nHeight);
+}
+
+bool
+CTxDB::WriteBlockPruneHeight (int nHeight)
+{
+  return Write (std::string ("blkpruneheight"), nHeight);
+}
+
+bool
+CTxDB::ReadTxUndo (const uint256& hash, std::vector<CUtxoEntry>& vUndo)
+{
+  return Read (std::make_pair (std::string ("txundo"), hash), vUndo);
+}
+
+bool
+CTxDB::WriteTxUndo (const uint256& hash, const std::vector<CUtxoEntry>& vUndo)
+{
+  return Write (std::make_pair (std::string ("txundo"), hash), vUndo);
+}
+
+bool
+CTxDB::EraseTxUndo (const uint256& hash)
+{
+  return Erase (std::make_pair (std::string ("txundo"), hash));
+}
+
+bool
+CTxDB::ReadUndoHeight (int& nHeight)
+{
+  return Read (std::string ("undoheight"), nHeight);
+}
+
+bool
+CTxDB::WriteUndoHeight (int nHeight)
+{
+  return Write (std::string ("undoheight"), nHeight);
+}
+
+bool
+CTxDB::EraseUndoHeight ()
+{
+  return Erase (std::string ("undoheight"));
+}
+
 CBlockIndex static * InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
-    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
+    CBlockIndex* pindexNew = NewBlockIndex();
+    mapBlockIndex.insert(make_pair(hash, pindexNew));
 
     return pindexNew;
 }
 
 #include <fstream>
 
-bool CTxDB::LoadBlockIndex()
+bool CTxDB::ScanBlockIndex()
 {
-    // Get database cursor
-    Dbc* pcursor = GetCursor();
-    if (!pcursor)
-        return false;
-
-    // Load mapBlockIndex
-    unsigned int fFlags = DB_SET_RANGE;
-    loop
+    // Two passes over the entries: the first only collects heights, so
+    // that the index objects can be allocated in height order, the second
+    // fills them in
+    vector<pair<int, uint256> > vSortedByHeight;
+    for (int nPass = 0; nPass < 2; nPass++)
     {
-        // Read next record
-        CDataStream ssKey;
-        if (fFlags == DB_SET_RANGE)
-            ssKey << make_pair(string("blockindex"), uint256(0));
-        CDataStream ssValue;
-        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
-        fFlags = DB_NEXT;
-        if (ret == DB_NOTFOUND)
-            break;
-        else if (ret != 0)
-            return false;
-
-        // Unserialize
-        string strType;
-        ssKey >> strType;
-        if (strType == "blockindex")
+        CDBScan scan(*this, "blockindex");
+        while (scan.Next())
         {
+            // Unserialize
+            CMappedStream ssKey = scan.Key();
+            uint256 hash;
+            ssKey >> hash;
             CDiskBlockIndex diskindex;
-            SetStreamVersion (ssValue);
+            CMappedStream ssValue = scan.Value();
             ssValue >> diskindex;
 
+            if (nPass == 0)
+            {
+                vSortedByHeight.push_back(make_pair(diskindex.nHeight, hash));
+                continue;
+            }
+
             // Construct block index object
-            CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
+            CBlockIndex* pindexNew = InsertBlockIndex(hash);
             pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
             pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
             pindexNew->nFile          = diskindex.nFile;
@@ -615,33 +915,48 @@ bool CTxDB::LoadBlockIndex()
             pindexNew->nNonce         = diskindex.nNonce;
 
             // Watch for genesis block
-            if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == hashGenesisBlock)
+            if (pindexGenesisBlock == NULL && hash == hashGenesisBlock)
                 pindexGenesisBlock = pindexNew;
         }
-        else
+        if (!scan.Ok())
+            return false;
+
+        if (nPass == 0)
         {
-            break;
+            sort(vSortedByHeight.begin(), vSortedByHeight.end());
+            mapBlockIndex.reserve(mapBlockIndex.size() + vSortedByHeight.size());
+            BOOST_FOREACH(const PAIRTYPE(int, uint256)& item, vSortedByHeight)
+                InsertBlockIndex(item.second);
         }
     }
-    pcursor->close();
 
-    // Calculate bnChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
-    {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    // Calculate nChainWork
+    BOOST_FOREACH(const PAIRTYPE(int, uint256)& item, vSortedByHeight)
     {
-        CBlockIndex* pindex = item.second;
-        pindex->bnChainWork = (pindex->pprev ? pindex->pprev->bnChainWork : 0) + pindex->GetBlockWork();
+        CBlockIndex* pindex = mapBlockIndex[item.second];
+        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : uint256(0)) + pindex->GetBlockWork();
     }
 
-    // Load hashBestChain pointer to end of best chain
-    if (!ReadHashBestChain(hashBestChain))
+    return true;
+}
+
+bool CTxDB::LoadBlockIndex()
+{
+    int64 nStart = GetTimeMillis();
+
+    // The best chain is read first, the snapshot of the last clean
+    // shutdown is only used if it ends at the same block
+    const bool fHaveBestChain = ReadHashBestChain(hashBestChain);
+    if (!ReadBlockIndexSnapshot(fHaveBestChain ? hashBestChain : uint256(0)))
+        if (!ScanBlockIndex())
+            return false;
+
+    printf("LoadBlockIndex(): %"PRIszu" blocks loaded in %"PRI64d"ms, %"PRIszu" kB for the index\n",
+           mapBlockIndex.size(), GetTimeMillis() - nStart,
+           (mapBlockIndex.GetMemoryUsage() + GetBlockIndexMemoryUsage()) / 1024);
+
+    // Point to end of best chain
+    if (!fHaveBestChain)
     {
         if (pindexGenesisBlock == NULL)
             return true;
@@ -651,11 +966,21 @@ bool CTxDB::LoadBlockIndex()
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
     nBestHeight = pindexBest->nHeight;
-    bnBestChainWork = pindexBest->bnChainWork;
+    nBestChainWork = pindexBest->nChainWork;
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight);
 
-    // Load bnBestInvalidWork, OK if it doesn't exist
-    ReadBestInvalidWork(bnBestInvalidWork);
+    // Load nBestInvalidWork, OK if it doesn't exist
+    CBigNum bnBestInvalidWork;
+    if (ReadBestInvalidWork(bnBestInvalidWork))
+        nBestInvalidWork = bnBestInvalidWork.getuint256();
+
+    // Load the height up to which blocks may have been pruned, if any
+    int nPruneHeight;
+    if (ReadBlockPruneHeight(nPruneHeight))
+    {
+        nBlockPruneHeight = nPruneHeight;
+        printf("LoadBlockIndex(): blocks up to height %d may have been pruned\n", nBlockPruneHeight);
+    }
 
     // Verify blocks in the best chain
     CBlockIndex* pindexFork = NULL;
@@ -663,6 +988,8 @@ bool CTxDB::LoadBlockIndex()
     {
         if (pindex->nHeight < nBestHeight-100 && !mapArgs.count("-checkblocks"))
             break;
+        if (pindex->nHeight <= nBlockPruneHeight)
+            break;
         CBlock block;
         if (!block.ReadFromDisk(pindex))
             return error("LoadBlockIndex() : block.ReadFromDisk failed");
@@ -758,6 +1085,44 @@ CTxDB::RewriteTxIndex (int oldVersion)
 
 
 
+/* ************************************************************************** */
+/* Chain state snapshot output.  */
+
+CHashedFileWriter::CHashedFileWriter (FILE* fileIn)
+  : file(fileIn), ss(SER_DISK)
+{
+  SHA256_Init (&ctx);
+  ss.reserve (1100000);
+}
+
+void
+CHashedFileWriter::Flush ()
+{
+  if (ss.empty ())
+    return;
+  SHA256_Update (&ctx, (unsigned char*)&ss.begin ()[0], ss.size ());
+  if (fwrite (&ss.begin ()[0], 1, ss.size (), file) != ss.size ())
+    throw std::ios_base::failure ("CHashedFileWriter::Flush: write failed");
+  ss.clear ();
+}
+
+uint256
+CHashedFileWriter::Finish ()
+{
+  Flush ();
+
+  /* Same double SHA-256 as Hash().  */
+  uint256 hash1;
+  SHA256_Final ((unsigned char*)&hash1, &ctx);
+  uint256 hash2;
+  SHA256 ((unsigned char*)&hash1, sizeof (hash1), (unsigned char*)&hash2);
+
+  if (fwrite (&hash2, 1, sizeof (hash2), file) != sizeof (hash2))
+    throw std::ios_base::failure ("CHashedFileWriter::Finish: write failed");
+
+  return hash2;
+}
+
 /* ************************************************************************** */
 /* CNameDB.  */
 
@@ -845,43 +1210,20 @@ CNameDB::Prune (unsigned nHeight)
      problems due to iterator invalidation.  It should also not use as
      much memory as keeping the full "in work" nameindex in memory.  */
 
-  Dbc* pcursor = GetCursor ();
-  if (!pcursor)
+  std::set<vchType> names;
+  CDBScan scan(*this, "namei");
+  while (scan.Next ())
     {
-      printf ("ERROR: CNameDB::Prune: GetCursor failed\n");
-      return;
+      CMappedStream ssKey = scan.Key ();
+      vchType vchName;
+      ssKey >> vchName;
+      names.insert (vchName);
     }
-
-  std::set<vchType> names;
-  unsigned int fFlags = DB_SET_RANGE;
-  loop
+  if (!scan.Ok ())
     {
-      // Read next record
-      CDataStream ssKey;
-      if (fFlags == DB_SET_RANGE)
-        ssKey << std::make_pair (std::string("namei"), vchType());
-      CDataStream ssValue;
-      const int ret = ReadAtCursor (pcursor, ssKey, ssValue, fFlags);
-      fFlags = DB_NEXT;
-      if (ret == DB_NOTFOUND)
-        break;
-      if (ret != 0)
-        {
-          printf ("ERROR: CNameDB::Prune: ReadAtCursor failed\n");
-          return;
-        }
-
-      // Unserialize
-      string strType;
-      ssKey >> strType;
-      if (strType == "namei")
-        {
-          vchType vchName;
-          ssKey >> vchName;
-          names.insert (vchName);
-        }
+      printf ("ERROR: CNameDB::Prune: scanning the names failed\n");
+      return;
     }
-  pcursor->close ();
 
   /* Now do the actual pruning.  */
 
@@ -936,6 +1278,67 @@ CNameDB::Prune (unsigned nHeight)
   Rewrite ();
 }
 
+/* The name section of a snapshot is the pruned height, followed by the
+   names with their full index in DB order.  Each is preceded by "true"
+   and the whole is terminated by "false".  */
+
+bool
+CNameDB::Dump (CHashedFileWriter& out, unsigned& nNames)
+{
+  nNames = 0;
+  out << ReadPrunedHeight ();
+
+  CDBScan scan(*this, "namei");
+  while (scan.Next ())
+    {
+      CMappedStream ssKey = scan.Key ();
+      vchType vchName;
+      ssKey >> vchName;
+      CMappedStream ssValue = scan.Value ();
+      std::vector<CNameIndex> vtxPos;
+      ssValue >> vtxPos;
+
+      out << true << vchName << vtxPos;
+      ++nNames;
+    }
+  if (!scan.Ok ())
+    return error ("CNameDB::Dump: scanning the names failed");
+
+  out << false;
+  return true;
+}
+
+bool
+CNameDB::Load (CMappedStream& s, unsigned& nNames)
+{
+  nNames = 0;
+  if (!EraseAll ("namei") || !Erase (std::string ("pruned")))
+    return false;
+
+  int nPrunedHeight;
+  s >> nPrunedHeight;
+  if (nPrunedHeight >= 0 && !WritePrunedHeight (nPrunedHeight))
+    return error ("CNameDB::Load: WritePrunedHeight failed");
+
+  loop
+    {
+      bool fMore;
+      s >> fMore;
+      if (!fMore)
+        break;
+
+      vchType vchName;
+      std::vector<CNameIndex> vtxPos;
+      s >> vchName >> vtxPos;
+      if (!WriteName (vchName, vtxPos))
+        return error ("CNameDB::Load: writing name '%s' failed",
+                      stringFromVch (vchName).c_str ());
+      ++nNames;
+    }
+
+  return true;
+}
+
 /* ************************************************************************** */
 /* CUtxoDB.  */
 
@@ -1046,10 +1449,9 @@ CUtxoDB::RemoveUtxo (const CTransaction& tx)
 }
 
 bool
-CUtxoDB::InternalRescan (bool fVerify, OutPointSet* outPoints)
+CUtxoDB::InternalRescan (const CBlockIndex* pindexTip, UtxoMap* pmapUtxo)
 {
-  assert ((fVerify && outPoints) || (!fVerify && !outPoints));
-  CTxDB txdb("r");
+  const bool fVerify = (pmapUtxo != NULL);
 
   /* To save DB memory, each individual block is done as a single DB
      transaction.  This shouldn't hurt much, since this routine is run
@@ -1075,14 +1477,21 @@ CUtxoDB::InternalRescan (bool fVerify, OutPointSet* outPoints)
      outputs.  */
   std::set<COutPoint> spent;
 
-  const CBlockIndex* pInd = pindexBest;
+  const CBlockIndex* pInd = pindexTip;
   for (; pInd; pInd = pInd->pprev)
     {
       if (pInd->nHeight % 1000 == 0)
         printf ("Analyse UTXO at block height %d...\n", pInd->nHeight);
 
+      /* Blocks below the tip don't change, but their files may be pruned,
+         which happens under cs_main.  */
       CBlock block;
-      block.ReadFromDisk (pInd);
+      {
+        CCriticalBlock lock(cs_main);
+        if (!block.ReadFromDisk (pInd))
+          return error ("InternalRescan: reading the block at height %d"
+                        " failed", pInd->nHeight);
+      }
 
       std::vector<const CTransaction*> vTxs;
       for (unsigned i = 0; i < block.vtx.size (); ++i)
@@ -1127,27 +1536,8 @@ CUtxoDB::InternalRescan (bool fVerify, OutPointSet* outPoints)
                   amount += tx.vout[j].nValue;
 
                   if (fVerify)
-                    {
-                      CUtxoEntry txo;
-                      if (!ReadUtxo (outp, txo))
-                        {
-                          printf ("Missing %s in UTXO database.\n",
-                                  outp.ToString ().c_str ());
-                          return error ("UTXO database is incomplete.");
-                        }
-
-                      /* It is possible that a single tx is twice
-                         in the blockchain, so ignore height in the
-                         comparison below.  */
-                      const CUtxoEntry entry(tx, j, txo.height);
-                      if (txo != entry)
-                        {
-                          printf ("Mismatch for %s in UTXO database.\n",  
-                                  outp.ToString ().c_str ());
-                          return error ("UTXO database has wrong entry.");
-                        }
-                      outPoints->insert (outp);
-                    }
+                    pmapUtxo->insert (std::make_pair (outp,
+                                      CUtxoEntry (tx, j, pInd->nHeight)));
                   else
                     {
                       if (!InsertUtxo (tx, j, pInd->nHeight))
@@ -1200,66 +1590,111 @@ CUtxoDB::Rescan ()
 {
   CCriticalBlock lock(cs_main);
   printf ("Rescanning blockchain to construct UTXO set...\n");
-  return InternalRescan (false);
+  const bool fOk = InternalRescan (pindexBest);
+  ClearUtxoCache ();
+
+  return fOk;
 }
 
 bool
 CUtxoDB::Verify ()
 {
+  /* The blockchain is read back from the best block at the start, and the
+     unspent outputs it leaves are collected in memory.  This takes long,
+     so it is done without holding cs_main.  Then, under cs_main, the
+     blocks connected in the meantime are applied to the collected outputs,
+     and these are compared with the DB in both directions.  */
+
+  const CBlockIndex* pindexPinned;
+  {
+    CCriticalBlock lock(cs_main);
+    pindexPinned = pindexBest;
+  }
+
+  UtxoMap mapUtxo;
+  printf ("Rescanning blockchain up to height %d to verify UTXO set...\n",
+          pindexPinned->nHeight);
+  if (!InternalRescan (pindexPinned, &mapUtxo))
+    return false;
+
   CCriticalBlock lock(cs_main);
-  OutPointSet outPoints;
+  if (!pindexPinned->IsInMainChain ())
+    return error ("The chain was reorganised below height %d during the"
+                  " UTXO verification, please run it again.",
+                  pindexPinned->nHeight);
 
-  /* In a first pass, the blockchain is read and it is checked that
-     every UTXO found is part of the DB.  We keep track of all COutPoints
-     that appear.  Later, go through everything in the DB and check that
-     it is part of the record built up before, to verify that there are no
-     spurious entries in the DB.  */
+  for (const CBlockIndex* pInd = pindexPinned->pnext; pInd; pInd = pInd->pnext)
+    {
+      CBlock block;
+      if (!block.ReadFromDisk (pInd))
+        return error ("Verify: reading the block at height %d failed",
+                      pInd->nHeight);
 
-  printf ("Rescanning blockchain to verify UTXO set...\n");
-  if (!InternalRescan (true, &outPoints))
-    return false;
+      std::vector<const CTransaction*> vTxs;
+      for (unsigned i = 0; i < block.vtx.size (); ++i)
+        vTxs.push_back (&block.vtx[i]);
+      for (unsigned i = 0; i < block.vgametx.size (); ++i)
+        vTxs.push_back (&block.vgametx[i]);
 
-  printf ("Verifying that the UTXO database doesn't"
-          " have superfluous entries...\n");
-  
-  /* Get database cursor.  */
-  Dbc* pcursor = GetCursor ();
-  if (!pcursor)
-    return error ("Failed to get DB cursor.");
+      for (unsigned i = 0; i < vTxs.size (); ++i)
+        {
+          const CTransaction& tx = *vTxs[i];
+          for (unsigned j = 0; j < tx.vin.size (); ++j)
+            if (!tx.vin[j].prevout.IsNull ()
+                && mapUtxo.erase (tx.vin[j].prevout) == 0)
+              return error ("Verify: tx %s spends %s, which is not unspent",
+                            tx.GetHashForLog (),
+                            tx.vin[j].prevout.ToString ().c_str ());
 
-  /* Loop through all entries.  */
-  unsigned int fFlags = DB_SET_RANGE;
-  while (true)
+          const uint256 txHash = tx.GetHash ();
+          for (unsigned j = 0; j < tx.vout.size (); ++j)
+            if (!tx.vout[j].IsUnspendable ())
+              mapUtxo[COutPoint (txHash, j)] = CUtxoEntry (tx, j, pInd->nHeight);
+        }
+    }
+
+  printf ("Verifying the UTXO database at height %d...\n", nBestHeight);
+  BOOST_FOREACH(const PAIRTYPE(COutPoint, CUtxoEntry)& item, mapUtxo)
     {
-      CDataStream ssKey;
-      if (fFlags == DB_SET_RANGE)
+      CUtxoEntry txo;
+      if (!ReadUtxo (item.first, txo))
         {
-          COutPoint p(uint256 (0), 0);
-          ssKey << GetKey (p);
+          printf ("Missing %s in UTXO database.\n",
+                  item.first.ToString ().c_str ());
+          return error ("UTXO database is incomplete.");
         }
-      CDataStream ssValue;
-      const int ret = ReadAtCursor (pcursor, ssKey, ssValue, fFlags);
-      fFlags = DB_NEXT;
-      if (ret == DB_NOTFOUND)
-        break;
-      if (ret != 0)
-        return error ("ReadAtCursor failed.");
 
-      std::string strType;
-      ssKey >> strType;
-      if (strType != "txo")
-        break;
+      /* It is possible that a single tx is twice in the blockchain,
+         so ignore height in the comparison below.  */
+      CUtxoEntry entry = item.second;
+      entry.height = txo.height;
+      if (txo != entry)
+        {
+          printf ("Mismatch for %s in UTXO database.\n",
+                  item.first.ToString ().c_str ());
+          return error ("UTXO database has wrong entry.");
+        }
+    }
 
+  printf ("Verifying that the UTXO database doesn't"
+          " have superfluous entries...\n");
+
+  /* Loop through all entries.  */
+  CDBScan scan(*this, "txo");
+  while (scan.Next ())
+    {
+      CMappedStream ssKey = scan.Key ();
       COutPoint pos;
       ssKey >> pos;
 
-      if (outPoints.find (pos) == outPoints.end ())
+      if (mapUtxo.find (pos) == mapUtxo.end ())
         {
           printf ("Spuriously in the UTXO DB: %s\n", pos.ToString ().c_str ());
           return error ("UTXO DB contains too many entries.");
         }
     }
-  pcursor->close ();
+  if (!scan.Ok ())
+    return error ("Scanning the UTXO DB failed.");
 
   return true;
 }
@@ -1270,39 +1705,477 @@ CUtxoDB::Analyse (unsigned& nUtxo, int64_t& amount)
   nUtxo = 0;
   amount = 0;
 
-  Dbc* pcursor = GetCursor ();
-  if (!pcursor)
-    return error ("Failed to get DB cursor.");
-
-  unsigned int fFlags = DB_SET_RANGE;
-  while (true)
+  CDBScan scan(*this, "txo");
+  while (scan.Next ())
     {
-      CDataStream ssKey;
-      if (fFlags == DB_SET_RANGE)
-        {
-          COutPoint p(uint256 (0), 0);
-          ssKey << GetKey (p);
-        }
-      CDataStream ssValue;
-      const int ret = ReadAtCursor (pcursor, ssKey, ssValue, fFlags);
-      fFlags = DB_NEXT;
-      if (ret == DB_NOTFOUND)
-        break;
-      if (ret != 0)
-        return error ("ReadAtCursor failed.");
+      CMappedStream ssValue = scan.Value ();
+      CUtxoEntry obj;
+      ssValue >> obj;
 
-      std::string strType;
-      ssKey >> strType;
-      if (strType != "txo")
-        break;
+      ++nUtxo;
+      amount += obj.txo.nValue;
+    }
+  if (!scan.Ok ())
+    return error ("Scanning the UTXO DB failed.");
+
+  return true;
+}
 
+bool
+CUtxoDB::WriteUtxo (const COutPoint& pos, const CUtxoEntry& txo)
+{
+  return Write (GetKey (pos), txo);
+}
+
+bool
+CUtxoDB::EraseUtxo (const COutPoint& pos)
+{
+  return Erase (GetKey (pos));
+}
+
+/* The UTXO section of a snapshot is the sequence of entries in DB order,
+   each preceded by "true" and the whole terminated by "false".  */
+
+bool
+CUtxoDB::Dump (CHashedFileWriter& out, unsigned& nUtxo)
+{
+  nUtxo = 0;
+
+  CDBScan scan(*this, "txo");
+  while (scan.Next ())
+    {
+      CMappedStream ssKey = scan.Key ();
+      COutPoint pos;
+      ssKey >> pos;
+      CMappedStream ssValue = scan.Value ();
       CUtxoEntry obj;
       ssValue >> obj;
 
+      out << true << pos << obj;
+      ++nUtxo;
+    }
+  if (!scan.Ok ())
+    return error ("Scanning the UTXO DB failed.");
+
+  out << false;
+  return true;
+}
+
+bool
+CUtxoDB::Load (CMappedStream& s, unsigned& nUtxo)
+{
+  nUtxo = 0;
+  if (!EraseAll ("txo"))
+    return false;
+
+  loop
+    {
+      bool fMore;
+      s >> fMore;
+      if (!fMore)
+        break;
+
+      COutPoint pos;
+      CUtxoEntry obj;
+      s >> pos >> obj;
+      if (!WriteUtxo (pos, obj))
+        return error ("CUtxoDB::Load: writing %s failed",
+                      pos.ToString ().c_str ());
       ++nUtxo;
-      amount += obj.txo.nValue;
     }
-  pcursor->close ();
+
+  return true;
+}
+
+/* ************************************************************************** */
+/* In-memory UTXO cache.  */
+
+/* A pending change:  Either a new (or updated) entry or a spent one.  */
+struct CUtxoPendingEntry
+{
+  CUtxoEntry txo;
+  bool fSpent;
+};
+
+class CUtxoPending : public std::map<COutPoint, CUtxoPendingEntry>
+{};
+
+/**
+ * Process-wide cache of UTXO entries that are known to be in utxo.dat.
+ * It holds only "clean" entries; changes not yet committed live in the
+ * CUtxoView of the DatabaseSet making them.  The generation counter is
+ * bumped on every commit, so that entries read from the DB concurrently
+ * with a commit are not stored when they could already be outdated.
+ */
+class CUtxoCache
+{
+private:
+
+  typedef std::map<COutPoint, CUtxoEntry> EntryMap;
+  EntryMap entries;
+  CCriticalSection cs_utxocache;
+
+  uint64 nUsage;
+  uint64 nMaxUsage;
+  bool fInit;
+  unsigned nGeneration;
+
+  uint64 nHits;
+  uint64 nMisses;
+  uint64 nEvictions;
+  uint64 nFlushed;
+
+  /* Approximate memory used for an entry, including the map node.  */
+  static inline uint64
+  EntryUsage (const CUtxoEntry& txo)
+  {
+    return sizeof (EntryMap::value_type) + 4 * sizeof (void*)
+            + txo.txo.scriptPubKey.capacity ();
+  }
+
+  void
+  Init ()
+  {
+    if (fInit)
+      return;
+    nMaxUsage = std::max ((int64)0, GetArg ("-utxocache", 32)) * 1048576;
+    fInit = true;
+  }
+
+  void
+  Put (const COutPoint& pos, const CUtxoEntry& txo)
+  {
+    EntryMap::iterator mi = entries.find (pos);
+    if (mi != entries.end ())
+      {
+        nUsage -= EntryUsage (mi->second);
+        mi->second = txo;
+      }
+    else
+      entries.insert (std::make_pair (pos, txo));
+    nUsage += EntryUsage (txo);
+  }
+
+  void
+  Remove (const COutPoint& pos)
+  {
+    EntryMap::iterator mi = entries.find (pos);
+    if (mi == entries.end ())
+      return;
+    nUsage -= EntryUsage (mi->second);
+    entries.erase (mi);
+  }
+
+  /* Evict random entries until we are within the budget again.  */
+  void
+  Shrink ()
+  {
+    while (nUsage > nMaxUsage && !entries.empty ())
+      {
+        uint256 hashRand;
+        RAND_bytes ((unsigned char*)&hashRand, sizeof (hashRand));
+        EntryMap::iterator mi = entries.lower_bound (COutPoint (hashRand, 0));
+        if (mi == entries.end ())
+          mi = entries.begin ();
+        nUsage -= EntryUsage (mi->second);
+        entries.erase (mi);
+        ++nEvictions;
+      }
+  }
+
+public:
+
+  CUtxoCache ()
+    : nUsage(0), nMaxUsage(0), fInit(false), nGeneration(0),
+      nHits(0), nMisses(0), nEvictions(0), nFlushed(0)
+  {}
+
+  bool
+  Lookup (const COutPoint& pos, CUtxoEntry& txo)
+  {
+    CRITICAL_BLOCK(cs_utxocache)
+      {
+        EntryMap::const_iterator mi = entries.find (pos);
+        if (mi == entries.end ())
+          {
+            ++nMisses;
+            return false;
+          }
+        ++nHits;
+        txo = mi->second;
+      }
+    return true;
+  }
+
+  unsigned
+  GetGeneration ()
+  {
+    unsigned nRet;
+    CRITICAL_BLOCK(cs_utxocache)
+      nRet = nGeneration;
+    return nRet;
+  }
+
+  /* Remember an entry just read from the DB.  */
+  void
+  Store (const COutPoint& pos, const CUtxoEntry& txo, unsigned nGen)
+  {
+    CRITICAL_BLOCK(cs_utxocache)
+      {
+        Init ();
+        if (nGen != nGeneration || nMaxUsage == 0)
+          return;
+        if (entries.count (pos) > 0)
+          return;
+        Put (pos, txo);
+        Shrink ();
+      }
+  }
+
+  /* Apply changes that have just been committed to the DB.  */
+  void
+  Update (const CUtxoPending& changes)
+  {
+    CRITICAL_BLOCK(cs_utxocache)
+      {
+        Init ();
+        ++nGeneration;
+        nFlushed += changes.size ();
+        for (CUtxoPending::const_iterator mi = changes.begin ();
+             mi != changes.end (); ++mi)
+          {
+            if (mi->second.fSpent || nMaxUsage == 0)
+              Remove (mi->first);
+            else
+              Put (mi->first, mi->second.txo);
+          }
+        Shrink ();
+      }
+  }
+
+  void
+  Clear ()
+  {
+    CRITICAL_BLOCK(cs_utxocache)
+      {
+        ++nGeneration;
+        entries.clear ();
+        nUsage = 0;
+      }
+  }
+
+  void
+  GetStats (CUtxoCacheStats& stats)
+  {
+    CRITICAL_BLOCK(cs_utxocache)
+      {
+        Init ();
+        stats.nEntries = entries.size ();
+        stats.nUsage = nUsage;
+        stats.nMaxUsage = nMaxUsage;
+        stats.nHits = nHits;
+        stats.nMisses = nMisses;
+        stats.nEvictions = nEvictions;
+        stats.nFlushed = nFlushed;
+      }
+  }
+};
+
+static CUtxoCache utxoCache;
+
+void
+GetUtxoCacheStats (CUtxoCacheStats& stats)
+{
+  utxoCache.GetStats (stats);
+}
+
+void
+ClearUtxoCache ()
+{
+  utxoCache.Clear ();
+}
+
+CUtxoView::CUtxoView (CUtxoDB& d)
+  : db(d), pending(new CUtxoPending ())
+{}
+
+CUtxoView::~CUtxoView ()
+{
+  delete pending;
+}
+
+bool
+CUtxoView::ReadUtxo (const COutPoint& pos, CUtxoEntry& txo)
+{
+  CUtxoPending::const_iterator mi = pending->find (pos);
+  if (mi != pending->end ())
+    {
+      if (mi->second.fSpent)
+        return false;
+      txo = mi->second.txo;
+      return true;
+    }
+
+  if (utxoCache.Lookup (pos, txo))
+    return true;
+
+  const unsigned nGen = utxoCache.GetGeneration ();
+  if (!db.ReadUtxo (pos, txo))
+    return false;
+  utxoCache.Store (pos, txo, nGen);
+
+  return true;
+}
+
+bool
+CUtxoView::InsertUtxo (const COutPoint& pos, const CUtxoEntry& txo)
+{
+  if (txo.IsUnspendable ())
+    {
+      printf ("Not added unspendable UTXO entry '%s'\n",
+              pos.ToString ().c_str ());
+      return true;
+    }
+
+  /* See CUtxoDB::InsertUtxo for the reasoning about duplicates.  */
+  CUtxoEntry existing;
+  if (ReadUtxo (pos, existing))
+    {
+      printf ("Already existing in UTXO: %s\n", pos.ToString ().c_str ());
+
+      if (!txo.isCoinbase)
+        return error ("Duplicate UTXO entry is not coinbase!");
+
+      if (existing.height >= txo.height)
+        {
+          printf ("WARNING: Existing UTXO entry should have lower height than"
+                  " new one.  This is fine if recreating the UTXO set.\n");
+          return true;
+        }
+    }
+
+  CUtxoPendingEntry& entry = (*pending)[pos];
+  entry.txo = txo;
+  entry.fSpent = false;
+
+  return AutoFlush ();
+}
+
+bool
+CUtxoView::InsertUtxo (const CTransaction& tx, unsigned n, int height)
+{
+  COutPoint pos(tx.GetHash (), n);
+  CUtxoEntry entry(tx, n, height);
+
+  return InsertUtxo (pos, entry);
+}
+
+bool
+CUtxoView::InsertUtxo (const CTransaction& tx, int height)
+{
+  for (unsigned n = 0; n < tx.vout.size (); ++n)
+    if (!InsertUtxo (tx, n, height))
+      return false;
+
+  return true;
+}
+
+bool
+CUtxoView::RemoveUtxo (const COutPoint& pos)
+{
+  CUtxoEntry txo;
+  if (!ReadUtxo (pos, txo))
+    return error ("Trying to remove non-existant UTXO entry.");
+
+  (*pending)[pos].fSpent = true;
+
+  return AutoFlush ();
+}
+
+bool
+CUtxoView::RemoveUtxo (const CTransaction& tx)
+{
+  const uint256 hash = tx.GetHash ();
+  for (unsigned n = 0; n < tx.vout.size (); ++n)
+    {
+      COutPoint pos(hash, n);
+      if (tx.vout[n].IsUnspendable ())
+        {
+          CUtxoEntry txo;
+          assert (!ReadUtxo (pos, txo));
+        }
+      else if (!RemoveUtxo (pos))
+        return false;
+    }
+
+  return true;
+}
+
+bool
+CUtxoView::Analyse (unsigned& nUtxo, int64_t& amount)
+{
+  assert (pending->empty ());
+  return db.Analyse (nUtxo, amount);
+}
+
+bool
+CUtxoView::Load (CMappedStream& s, unsigned& nUtxo)
+{
+  assert (pending->empty ());
+  const bool fOk = db.Load (s, nUtxo);
+  ClearUtxoCache ();
+
+  return fOk;
+}
+
+bool
+CUtxoView::Flush ()
+{
+  for (CUtxoPending::const_iterator mi = pending->begin ();
+       mi != pending->end (); ++mi)
+    {
+      if (mi->second.fSpent)
+        {
+          if (!db.EraseUtxo (mi->first))
+            return error ("Failed to erase UTXO entry %s",
+                          mi->first.ToString ().c_str ());
+        }
+      else if (!db.WriteUtxo (mi->first, mi->second.txo))
+        return error ("Failed to write UTXO entry %s",
+                      mi->first.ToString ().c_str ());
+    }
+
+  return true;
+}
+
+void
+CUtxoView::Commit ()
+{
+  if (pending->empty ())
+    return;
+
+  utxoCache.Update (*pending);
+  pending->clear ();
+}
+
+void
+CUtxoView::Discard ()
+{
+  pending->clear ();
+}
+
+bool
+CUtxoView::AutoFlush ()
+{
+  if (db.GetTxn ())
+    return true;
+
+  if (!Flush ())
+    {
+      Discard ();
+      return false;
+    }
+  Commit ();
 
   return true;
 }
@@ -1345,33 +2218,16 @@ bool CAddrDB::LoadAddresses()
             catch (...) { }
         }
 
-        // Get cursor
-        Dbc* pcursor = GetCursor();
-        if (!pcursor)
-            return false;
-
-        loop
+        CDBScan scan(*this, "addr");
+        while (scan.Next())
         {
-            // Read next record
-            CDataStream ssKey;
-            CDataStream ssValue;
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
-            if (ret == DB_NOTFOUND)
-                break;
-            else if (ret != 0)
-                return false;
-
-            // Unserialize
-            string strType;
-            ssKey >> strType;
-            if (strType == "addr")
-            {
-                CAddress addr;
-                ssValue >> addr;
-                mapAddresses.insert(make_pair(addr.GetKey(), addr));
-            }
+            CAddress addr;
+            CMappedStream ssValue = scan.Value();
+            ssValue >> addr;
+            mapAddresses.insert(make_pair(addr.GetKey(), addr));
         }
-        pcursor->close();
+        if (!scan.Ok())
+            return false;
 
         printf("Loaded %d addresses\n", mapAddresses.size());
     }
@@ -5,6 +5,7 @@
 #define BITCOIN_DB_H
 
 #include "key.h"
+#include "blockstore.h"
 
 #include <map>
 #include <string>
@@ -17,6 +18,7 @@ class CTxIndex;
 class CUtxoEntry;
 class COutPoint;
 class CDiskBlockIndex;
+class CBlockIndex;
 class CDiskTxPos;
 class COutPoint;
 class CAddress;
@@ -30,6 +32,7 @@ class CBlockLocator;
 extern unsigned int nWalletDBUpdated;
 extern DbEnv dbenv;
 extern bool fDetachDB;
+extern bool fDBReadUncommitted;
 
 extern void DBFlush(bool fShutdown);
 void ThreadFlushWalletDB(void* parg);
@@ -38,6 +41,23 @@ void PrintSettingsToLog();
 
 
 
+// Serialisation buffers reused by all CDB calls of one thread, so that
+// reading and writing chain data neither allocates nor wipes memory per
+// call.  Databases holding secrets (the wallet) don't use them; there the
+// buffers are wiped after each call instead.
+struct CDBBuffers
+{
+    CDataStream ssKey;
+    CDataStream ssValue;
+    std::vector<char> vchValue;
+
+    CDBBuffers() : ssKey(SER_DISK), ssValue(SER_DISK), vchValue(4096) { }
+};
+
+CDBBuffers& GetDBBuffers();
+
+
+
 class CDB
 {
 protected:
@@ -53,11 +73,21 @@ protected:
 
     bool fReadOnly;
 
+    /* Whether the database holds secrets, whose serialised form is wiped
+       from memory after each call.  */
+    bool fSecure;
+
+    /* Whether the database is part of the chain state written by block
+       batches.  Only these are opened for, and read with, uncommitted
+       reads (see fDBReadUncommitted); the wallet and addr.dat never see
+       changes that could still be rolled back.  */
+    bool fChainState;
+
     /* Store version of the DB here that will be set as version
        for serialisation on the streams.  */
     int nVersion;
 
-    explicit CDB(const char* pszFile, const char* pszMode="r+");
+    explicit CDB(const char* pszFile, const char* pszMode="r+", bool fSecureIn=false, bool fChainStateIn=false);
     ~CDB() { Close(); }
 public:
     void Close();
@@ -65,13 +95,24 @@ private:
     CDB(const CDB&);
     void operator=(const CDB&);
 
-protected:
-    template<typename K, typename T>
-    bool Read(const K& key, T& value)
+    friend class CDBScan;
+
+    // Serialise key into the thread's key buffer
+    template<typename K>
+    CDataStream& SerializeKey(CDBBuffers& buffers, const K& key) const
     {
-        if (!pdb)
-            return false;
+        CDataStream& ssKey = buffers.ssKey;
+        ssKey.clear();
+        ssKey.nVersion = nVersion;
+        ssKey << key;
+        return ssKey;
+    }
 
+    // Read and Write for databases with secrets, which wipe the serialised
+    // data and keep no buffers around
+    template<typename K, typename T>
+    bool SecureRead(const K& key, T& value)
+    {
         // Key
         CDataStream ssKey(SER_DISK, nVersion);
         ssKey.reserve(1000);
@@ -81,7 +122,7 @@ protected:
         // Read
         Dbt datValue;
         datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pdb->get(GetTxn(), &datKey, &datValue, 0);
+        int ret = pdb->get(GetTxn(), &datKey, &datValue, GetReadFlags());
         memset(datKey.get_data(), 0, datKey.get_size());
         if (datValue.get_data() == NULL)
             return false;
@@ -99,13 +140,8 @@ protected:
     }
 
     template<typename K, typename T>
-    bool Write(const K& key, const T& value, bool fOverwrite=true)
+    bool SecureWrite(const K& key, const T& value, bool fOverwrite)
     {
-        if (!pdb)
-            return false;
-        if (fReadOnly)
-            assert(("Write called on database in read-only mode", false));
-
         // Key
         CDataStream ssKey(SER_DISK, nVersion);
         ssKey.reserve(1000);
@@ -127,6 +163,78 @@ protected:
         return (ret == 0);
     }
 
+protected:
+    template<typename K, typename T>
+    bool Read(const K& key, T& value)
+    {
+        if (!pdb)
+            return false;
+        if (fSecure)
+            return SecureRead(key, value);
+
+        // Key
+        CDBBuffers& buffers = GetDBBuffers();
+        CDataStream& ssKey = SerializeKey(buffers, key);
+        Dbt datKey(&ssKey[0], ssKey.size());
+
+        // Read straight into the thread's value buffer, growing it if the
+        // value doesn't fit
+        std::vector<char>& vchValue = buffers.vchValue;
+        Dbt datValue(&vchValue[0], vchValue.size());
+        datValue.set_ulen(vchValue.size());
+        datValue.set_flags(DB_DBT_USERMEM);
+        int ret;
+        try
+        {
+            ret = pdb->get(GetTxn(), &datKey, &datValue, GetReadFlags());
+        }
+        catch (DbMemoryException& e)
+        {
+            ret = DB_BUFFER_SMALL;
+        }
+        if (ret == DB_BUFFER_SMALL)
+        {
+            vchValue.resize(datValue.get_size());
+            datValue.set_data(&vchValue[0]);
+            datValue.set_ulen(vchValue.size());
+            ret = pdb->get(GetTxn(), &datKey, &datValue, GetReadFlags());
+        }
+        if (ret != 0)
+            return false;
+
+        // Unserialize value
+        CMappedStream ssValue(&vchValue[0], &vchValue[0] + datValue.get_size(), SER_DISK, nVersion);
+        ssValue >> value;
+        return true;
+    }
+
+    template<typename K, typename T>
+    bool Write(const K& key, const T& value, bool fOverwrite=true)
+    {
+        if (!pdb)
+            return false;
+        if (fReadOnly)
+            assert(("Write called on database in read-only mode", false));
+        if (fSecure)
+            return SecureWrite(key, value, fOverwrite);
+
+        // Key
+        CDBBuffers& buffers = GetDBBuffers();
+        CDataStream& ssKey = SerializeKey(buffers, key);
+        Dbt datKey(&ssKey[0], ssKey.size());
+
+        // Value
+        CDataStream& ssValue = buffers.ssValue;
+        ssValue.clear();
+        ssValue.nVersion = nVersion;
+        ssValue << value;
+        Dbt datValue(&ssValue[0], ssValue.size());
+
+        // Write
+        int ret = pdb->put(GetTxn(), &datKey, &datValue, (fOverwrite ? 0 : DB_NOOVERWRITE));
+        return (ret == 0);
+    }
+
     template<typename K>
     bool Erase(const K& key)
     {
@@ -136,16 +244,15 @@ protected:
             assert(("Erase called on database in read-only mode", false));
 
         // Key
-        CDataStream ssKey(SER_DISK, nVersion);
-        ssKey.reserve(1000);
-        ssKey << key;
+        CDataStream& ssKey = SerializeKey(GetDBBuffers(), key);
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
         int ret = pdb->del(GetTxn(), &datKey, 0);
 
         // Clear memory
-        memset(datKey.get_data(), 0, datKey.get_size());
+        if (fSecure)
+            memset(datKey.get_data(), 0, datKey.get_size());
         return (ret == 0 || ret == DB_NOTFOUND);
     }
 
@@ -156,16 +263,15 @@ protected:
             return false;
 
         // Key
-        CDataStream ssKey(SER_DISK, nVersion);
-        ssKey.reserve(1000);
-        ssKey << key;
+        CDataStream& ssKey = SerializeKey(GetDBBuffers(), key);
         Dbt datKey(&ssKey[0], ssKey.size());
 
         // Exists
-        int ret = pdb->exists(GetTxn(), &datKey, 0);
+        int ret = pdb->exists(GetTxn(), &datKey, GetReadFlags());
 
         // Clear memory
-        memset(datKey.get_data(), 0, datKey.get_size());
+        if (fSecure)
+            memset(datKey.get_data(), 0, datKey.get_size());
         return (ret == 0);
     }
 
@@ -174,7 +280,7 @@ protected:
         if (!pdb)
             return NULL;
         Dbc* pcursor = NULL;
-        int ret = pdb->cursor(NULL, &pcursor, 0);
+        int ret = pdb->cursor(NULL, &pcursor, (fDBReadUncommitted && fChainState) ? DB_READ_UNCOMMITTED : 0);
         if (ret != 0)
             return NULL;
         return pcursor;
@@ -227,6 +333,11 @@ protected:
       ss.nVersion = nVersion;
     }
 
+    /* Erase all records whose key starts with the string strType, or all
+       records but the version if it is empty.  This is done within the
+       current transaction.  */
+    bool EraseAll (const std::string& strType);
+
 public:
     DbTxn* GetTxn()
     {
@@ -236,6 +347,15 @@ public:
             return NULL;
     }
 
+    /* Reads outside of a transaction don't wait for the page locks of a
+       long-running one (see fDBReadUncommitted).  */
+    u_int32_t GetReadFlags()
+    {
+        if (fDBReadUncommitted && fChainState && GetTxn() == NULL)
+            return DB_READ_UNCOMMITTED;
+        return 0;
+    }
+
     /* Start a new atomic DB transaction.  Optionally use the passed one
        instead, which can be used to synchronise between multiple DBs.  */
     inline bool
@@ -329,6 +449,86 @@ public:
 
 
 
+// Scan over the records of a CDB whose key starts with a type string, in
+// key order.  Records are fetched from the cursor in bulk (DB_MULTIPLE_KEY)
+// into one buffer, and keys and values are read straight from it; the
+// streams returned by Key() and Value() are valid until the next call to
+// Next().  The scan ends at the first key of another type, so a scan of one
+// type doesn't walk the rest of the database, and the caller may stop it
+// at any point.  An empty type scans the whole database.
+//
+//     CDBScan scan(*this, "txo");
+//     while (scan.Next())
+//     {
+//         CMappedStream ssKey = scan.Key();    // key after the type string
+//         CMappedStream ssValue = scan.Value();
+//         ...
+//     }
+//     if (!scan.Ok())
+//         return error(...);
+class CDBScan
+{
+private:
+    Dbc* pcursor;
+    bool fSecure;
+    int nVersion;
+
+    // serialised type string, and the key to start at
+    std::vector<char> vchPrefix;
+    std::vector<char> vchStart;
+
+    // bulk buffer and position of the next record in it (NULL when the
+    // buffer has been consumed)
+    std::vector<char> vchBulk;
+    Dbt datBulk;
+    void* pnext;
+    bool fFirst;
+    bool fDone;
+    bool fError;
+
+    const char* pchKey;
+    const char* pchKeyEnd;
+    const char* pchValue;
+    const char* pchValueEnd;
+
+    void Init(CDB& db, const std::string& strType);
+    bool Fetch();
+    void Close();
+
+    CDBScan(const CDBScan&);
+    void operator=(const CDBScan&);
+
+public:
+    CDBScan(CDB& db, const std::string& strType)
+    {
+        Init(db, strType);
+    }
+
+    // Start at the first key not below keyStart, which should itself be
+    // of type strType
+    template<typename K>
+    CDBScan(CDB& db, const std::string& strType, const K& keyStart)
+    {
+        Init(db, strType);
+        CDataStream ssStart(SER_DISK, nVersion);
+        ssStart << keyStart;
+        vchStart.assign(ssStart.begin(), ssStart.end());
+    }
+
+    ~CDBScan() { Close(); }
+
+    // Move to the next record; false at the end of the scan or on error
+    bool Next();
+
+    // Whether the scan ended without a database error
+    bool Ok() const { return !fError; }
+
+    CMappedStream Key() const   { return CMappedStream(pchKey, pchKeyEnd, SER_DISK, nVersion); }
+    CMappedStream Value() const { return CMappedStream(pchValue, pchValueEnd, SER_DISK, nVersion); }
+};
+
+
+
 
 
 
@@ -337,7 +537,7 @@ public:
 class CTxDB : public CDB
 {
 public:
-    CTxDB(const char* pszMode="r+") : CDB("blkindex.dat", pszMode) { }
+    CTxDB(const char* pszMode="r+") : CDB("blkindex.dat", pszMode, false, true) { }
 private:
     CTxDB(const CTxDB&);
     void operator=(const CTxDB&);
@@ -368,10 +568,34 @@ public:
     unsigned ReadBlockFileReserved (unsigned num);
     bool WriteBlockFileReserved (unsigned num, unsigned size);
 
+    /* Pruning (-prune): the highest block height with data in each block
+       file, the files that have been deleted and the height up to which
+       block bodies may be missing.  */
+    bool ReadBlockFileHeight (unsigned num, int& nHeight);
+    bool WriteBlockFileHeight (unsigned num, int nHeight);
+    bool IsBlockFilePruned (unsigned num);
+    bool MarkBlockFilePruned (unsigned num);
+    bool ReadBlockPruneHeight (int& nHeight);
+    bool WriteBlockPruneHeight (int nHeight);
+
+    /* Outputs spent by a transaction, so that it can be disconnected
+       without reading the previous transactions from the block files.
+       They are written from "undoheight" on while pruning.  */
+    bool ReadTxUndo (const uint256& hash, std::vector<CUtxoEntry>& vUndo);
+    bool WriteTxUndo (const uint256& hash, const std::vector<CUtxoEntry>& vUndo);
+    bool EraseTxUndo (const uint256& hash);
+    bool ReadUndoHeight (int& nHeight);
+    bool WriteUndoHeight (int nHeight);
+    bool EraseUndoHeight ();
+
     bool LoadBlockIndex();
 
     /* Update txindex to new data format.  */
     bool RewriteTxIndex (int oldVersion);
+
+private:
+    // Load the block index from all blockindex entries
+    bool ScanBlockIndex();
 };
 
 
@@ -380,6 +604,37 @@ public:
 
 
 
+/* Output of a chain state snapshot (dumputxoset).  Everything written is
+   hashed, and Finish appends the double SHA-256 of it to the file.  Write
+   errors throw like with CAutoFile.  */
+class CHashedFileWriter
+{
+private:
+
+  FILE* file;
+  SHA256_CTX ctx;
+  CDataStream ss;
+
+public:
+
+  explicit CHashedFileWriter (FILE* fileIn);
+
+  template<typename T>
+    CHashedFileWriter&
+    operator<< (const T& obj)
+  {
+    ss << obj;
+    if (ss.size () >= 1000000)
+      Flush ();
+    return *this;
+  }
+
+  void Flush ();
+  uint256 Finish ();
+};
+
+
+
 /**
  * Name index.  Non-inline implementation code is in namecoin.cpp, but the
  * class is declared here because it will be used for the "wrapper" database
@@ -407,7 +662,7 @@ private:
 public:
 
     explicit inline CNameDB (const char* pszMode="r+")
-      : CDB("nameindexfull.dat", pszMode)
+      : CDB("nameindexfull.dat", pszMode, false, true)
     {}
 
     /* This is the main interface for reading the name index.  It returns
@@ -455,6 +710,11 @@ public:
             std::vector<std::pair<vchType, CNameIndex> >& nameScan);
 
     bool ReconstructNameIndex();
+
+    /* Write the whole index to a chain state snapshot, and replace it
+       with the one in a snapshot.  */
+    bool Dump (CHashedFileWriter& out, unsigned& nNames);
+    bool Load (CMappedStream& s, unsigned& nNames);
 };
 
 
@@ -464,7 +724,7 @@ public:
 class CUtxoDB : public CDB
 {
 public:
-    CUtxoDB(const char* pszMode="r+") : CDB("utxo.dat", pszMode) { }
+    CUtxoDB(const char* pszMode="r+") : CDB("utxo.dat", pszMode, false, true) { }
 private:
     CUtxoDB(const CUtxoDB&);
     void operator=(const CUtxoDB&);
@@ -472,18 +732,20 @@ private:
     /** Type used as key into the DB.  */
     typedef std::pair<std::string, COutPoint> KeyType;
 
-    /** Set of COutPoints as used in the DB verification.  */
-    typedef std::set<COutPoint> OutPointSet;
+    /** Unspent outputs as expected by the DB verification.  */
+    typedef std::map<COutPoint, CUtxoEntry> UtxoMap;
 
     /* Construct the look-up key for a given COutPoint.  This just prepends
        the key-string "txo" to it.  */
     KeyType GetKey (const COutPoint& pos);
 
     /* Internal routine that shares code for scanning all transactions
-       in the blockchain.  It can be used (depending on the passed flags)
-       to build the UTXO DB from it, or to verify it against the
-       blockchain.  The caller must hold the cs_main lock in any case.  */
-    bool InternalRescan (bool fVerify, OutPointSet* outPoints = NULL);
+       in the blockchain from pindexTip back to the genesis block.  Without
+       pmapUtxo, it builds the UTXO DB from them; the caller must hold
+       cs_main then.  With pmapUtxo, the unspent outputs are collected there
+       for the verification instead, and cs_main is only taken while each
+       block is read.  */
+    bool InternalRescan (const CBlockIndex* pindexTip, UtxoMap* pmapUtxo = NULL);
 
 public:
 
@@ -508,12 +770,102 @@ public:
 
     /* Scan the blockchain and verify that the UTXO set in the database
        is correct.  This is used to check that the updating in ConnectBlock
-       and DisconnectBlock works as it should.  */
+       and DisconnectBlock works as it should.  The scan itself runs
+       without cs_main; only the final comparison with the DB holds it.  */
     bool Verify ();
 
     /* Read all entries to analyse the total money supply as well as
        the number of entries.  */
     bool Analyse (unsigned& nUtxo, int64_t& amount);
+
+    /* Raw access for flushing the in-memory UTXO cache.  No consistency
+       checks are done here, since they happened already in CUtxoView.  */
+    bool WriteUtxo (const COutPoint& pos, const CUtxoEntry& txo);
+    bool EraseUtxo (const COutPoint& pos);
+
+    /* Write all entries to a chain state snapshot in key order, and
+       replace the set with the one in a snapshot.  ClearUtxoCache must be
+       called after a Load.  */
+    bool Dump (CHashedFileWriter& out, unsigned& nUtxo);
+    bool Load (CMappedStream& s, unsigned& nUtxo);
+};
+
+
+
+/* Statistics about the in-memory UTXO cache.  */
+struct CUtxoCacheStats
+{
+  unsigned nEntries;
+  uint64 nUsage;
+  uint64 nMaxUsage;
+  uint64 nHits;
+  uint64 nMisses;
+  uint64 nEvictions;
+  uint64 nFlushed;
+};
+
+void GetUtxoCacheStats (CUtxoCacheStats& stats);
+
+/* Drop everything from the in-memory UTXO cache.  This must be done
+   whenever utxo.dat is changed directly instead of through a DatabaseSet,
+   like when the UTXO set is rebuilt.  */
+void ClearUtxoCache ();
+
+/* Changes made to the UTXO set in the current DatabaseSet transaction.  */
+class CUtxoPending;
+
+/**
+ * View of the UTXO set as seen through a DatabaseSet.  Reads are served
+ * from a process-wide, size-limited in-memory cache in front of utxo.dat
+ * (see -utxocache).  Changes are kept in memory as dirty entries and only
+ * written to the CUtxoDB in one batch right before the DatabaseSet
+ * transaction commits, i. e., once per connected block or reorganisation.
+ * An aborted transaction simply drops them.
+ */
+class CUtxoView
+{
+private:
+
+  CUtxoDB& db;
+  CUtxoPending* pending;
+
+  CUtxoView (const CUtxoView&);
+  void operator= (const CUtxoView&);
+
+  /* Flush and commit right away if we are not inside a transaction.  */
+  bool AutoFlush ();
+
+public:
+
+  explicit CUtxoView (CUtxoDB& d);
+  ~CUtxoView ();
+
+  /* Same interface as the corresponding CUtxoDB methods.  */
+  bool ReadUtxo (const COutPoint& pos, CUtxoEntry& txo);
+  bool InsertUtxo (const COutPoint& pos, const CUtxoEntry& txo);
+  bool InsertUtxo (const CTransaction& tx, unsigned n, int height);
+  bool InsertUtxo (const CTransaction& tx, int height);
+  bool RemoveUtxo (const COutPoint& pos);
+  bool RemoveUtxo (const CTransaction& tx);
+
+  /* Analyse the database.  Outside of transactions there are no pending
+     changes, so this just looks at the CUtxoDB.  */
+  bool Analyse (unsigned& nUtxo, int64_t& amount);
+
+  /* Replace the whole set with the one in a chain state snapshot, inside
+     the current transaction.  This drops the shared cache.  */
+  bool Load (CMappedStream& s, unsigned& nUtxo);
+
+  /* Write all pending changes to the CUtxoDB (inside its current
+     transaction, if any).  */
+  bool Flush ();
+
+  /* Called after the DB transaction has been committed; the pending
+     changes are moved into the shared cache.  */
+  void Commit ();
+
+  /* Forget about the pending changes.  */
+  void Discard ();
 };
 
 
@@ -535,10 +887,13 @@ private:
   CUtxoDB utxoDb;
   CNameDB nameDb;
 
+  /* Cached view onto utxoDb.  */
+  CUtxoView utxoView;
+
 public:
 
   inline DatabaseSet (const char* pszMode = "r+")
-    : txDb(pszMode), utxoDb(pszMode), nameDb(pszMode)
+    : txDb(pszMode), utxoDb(pszMode), nameDb(pszMode), utxoView(utxoDb)
   {}
 
   /* Expose the bundled databases.  */
@@ -549,10 +904,10 @@ public:
     return txDb;
   }
 
-  inline CUtxoDB&
+  inline CUtxoView&
   utxo ()
   {
-    return utxoDb;
+    return utxoView;
   }
 
   inline CNameDB&
@@ -579,6 +934,7 @@ public:
   inline bool
   TxnAbort ()
   {
+    utxoView.Discard ();
     if (!nameDb.TxnAbort ())
       return error ("Failed to abort child transaction in NameDB!");
     if (!utxoDb.TxnAbort ())
@@ -589,11 +945,29 @@ public:
   inline bool
   TxnCommit ()
   {
+    if (!utxoView.Flush ())
+      {
+        utxoView.Discard ();
+        return error ("Failed to flush UTXO cache!");
+      }
     if (!nameDb.TxnCommit ())
-      return error ("Failed to commit child transaction in NameDB!");
+      {
+        utxoView.Discard ();
+        return error ("Failed to commit child transaction in NameDB!");
+      }
     if (!utxoDb.TxnCommit ())
-      return error ("Failed to commit child transaction in UTXO-DB!");
-    return txDb.TxnCommit ();
+      {
+        utxoView.Discard ();
+        return error ("Failed to commit child transaction in UTXO-DB!");
+      }
+    if (!txDb.TxnCommit ())
+      {
+        utxoView.Discard ();
+        return false;
+      }
+
+    utxoView.Commit ();
+    return true;
   }
 
 };
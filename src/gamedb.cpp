@@ -3,24 +3,35 @@
 #include "gametx.h"
 
 #include "headers.h"
+#include "blockstore.h"
 #include "huntercoin.h"
 
 #include <boost/filesystem.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
 
+#include <deque>
 #include <list>
 #include <map>
 
 using namespace Game;
 
 static const int KEEP_EVERY_NTH_STATE = 2000;
+// With -prune, old blocks can't be integrated, so the states are kept
+// closely enough that every state within MIN_BLOCKS_TO_KEEP is reachable
+static const int PRUNE_KEEP_EVERY_NTH_STATE = 100;
 static const unsigned IN_MEMORY_STATE_CACHE = 10;
+static const unsigned SPECULATIVE_STATES = 50;
+// Fork points within this depth have their state in the state cache
+static const int SPECULATIVE_MAX_DEPTH = IN_MEMORY_STATE_CACHE;
 
 class CGameDB : public CDB
 {
 public:
-    CGameDB(const char* pszMode="r+") : CDB("game.dat", pszMode) { }
+    CGameDB(const char* pszMode="r+") : CDB("game.dat", pszMode, false, true) { }
 
-    CGameDB(const char* pszMode, CDB& parent) : CDB("game.dat", pszMode)
+    CGameDB(const char* pszMode, CDB& parent) : CDB("game.dat", pszMode, false, true)
     {
       vTxn.push_back (parent.GetTxn ());
       ownTxn.push_back (false);
@@ -46,6 +57,11 @@ public:
     {
         return CDB::Erase(nHeight);
     }
+
+    bool EraseAll()
+    {
+        return CDB::EraseAll("");
+    }
 };
 
 class GameStepValidator
@@ -55,6 +71,11 @@ class GameStepValidator
     
     DatabaseSet* pdbset;
 
+    // DB set of the caller when validating a block it connects or
+    // integrates; undo data written in its DB transaction is only visible
+    // through it
+    DatabaseSet* pdbsetConnect;
+
     // Detect duplicates (multiple moves per block). Probably already handled by NameDB and not needed.
     std::set<PlayerID> dup;
 
@@ -66,13 +87,13 @@ protected:
     const GameState *pstate;
 
 public:
-    GameStepValidator(const GameState *pstate_)
-        : fOwnState(false), fOwnDb(false), pdbset(NULL), pstate(pstate_)
+    GameStepValidator(const GameState *pstate_, DatabaseSet* pdbsetConnectIn = NULL)
+        : fOwnState(false), fOwnDb(false), pdbset(NULL), pdbsetConnect(pdbsetConnectIn), pstate(pstate_)
     {
     }
 
     GameStepValidator(DatabaseSet& dbset, CBlockIndex *pindex)
-        : fOwnState(true), fOwnDb(false), pdbset(&dbset)
+        : fOwnState(true), fOwnDb(false), pdbset(&dbset), pdbsetConnect(NULL)
     {
         GameState *newState = new GameState;
         if (!GetGameState (dbset, pindex, *newState))
@@ -91,6 +112,35 @@ public:
         delete pdbset;
     }
 
+    void SetDatabase(DatabaseSet* pdbsetIn)
+    {
+      if (pdbset && fOwnDb)
+        delete pdbset;
+      pdbset = pdbsetIn;
+      fOwnDb = false;
+    }
+
+    // The output spent by input i of tx when its transaction can't be read
+    // from the block files, which happens if they have been pruned.  It is
+    // in the undo data recorded when tx was connected, or still unspent.
+    bool GetPrunedPrevOut(const CTransaction& tx, unsigned int i, CTxOut& txoutRet)
+    {
+        DatabaseSet& dbset = (pdbsetConnect ? *pdbsetConnect : *pdbset);
+        std::vector<CUtxoEntry> vUndo;
+        if (dbset.tx ().ReadTxUndo (tx.GetHash (), vUndo))
+        {
+            if (vUndo.size () != tx.vin.size ())
+                return false;
+            txoutRet = vUndo[i].txo;
+            return true;
+        }
+        CUtxoEntry txo;
+        if (!dbset.utxo ().ReadUtxo (tx.vin[i].prevout, txo))
+            return false;
+        txoutRet = txo.txo;
+        return true;
+    }
+
     // Returns:
     //   false - invalid move tx
     //   true  - non-move tx or valid tx
@@ -175,11 +225,15 @@ public:
                 if (!pdbset->tx ().ReadTxIndex (prevout.hash, txindex)
                     || txindex.pos == CDiskTxPos(1,1,1))
                     continue;
-                else if (!txPrev.ReadFromDisk(txindex.pos))
-                    continue;
-                if (prevout.n >= txPrev.vout.size())
+                CTxOut vout;
+                if (txPrev.ReadFromDisk(txindex.pos))
+                {
+                    if (prevout.n >= txPrev.vout.size())
+                        continue;
+                    vout = txPrev.vout[prevout.n];
+                }
+                else if (!GetPrunedPrevOut(tx, i, vout))
                     continue;
-                const CTxOut &vout = txPrev.vout[prevout.n];
                 std::string address;
                 if (ExtractDestination(vout.scriptPubKey, address) && address == addressLock)
                 {
@@ -256,6 +310,11 @@ GameStepMiner::~GameStepMiner()
     delete pImpl;
 }
 
+void GameStepMiner::SetDatabase(DatabaseSet* pdbset)
+{
+    pImpl->SetDatabase(pdbset);
+}
+
 bool GameStepMiner::AddTx(const CTransaction& tx)
 {
     return pImpl->AddTx(tx);
@@ -266,10 +325,21 @@ int64 GameStepMiner::ComputeTax()
     return pImpl->ComputeTax();
 }
 
-bool
-PerformStep (CNameDB& nameDb, const GameState& inState, const CBlock* block,
-             int64& nTax, GameState& outState,
-             std::vector<CTransaction>* outvgametx)
+int
+GetGameStateInterval ()
+{
+  return (nPruneTarget > 0 ? PRUNE_KEEP_EVERY_NTH_STATE : KEEP_EVERY_NTH_STATE);
+}
+
+/* Validate the moves in a block and perform the game step on them.  This
+   depends only on the block and the state before it, not on the DBs.
+   pdbsetConnect is the DB set of the caller connecting or integrating the
+   block, if any; it is only needed for moves spending outputs of pruned
+   blocks.  */
+static bool
+ComputeStep (const GameState& inState, const CBlock* block,
+             GameState& outState, StepResult& stepResult,
+             DatabaseSet* pdbsetConnect = NULL)
 {
     if (block->hashPrevBlock != inState.hashBlock)
         return error("PerformStep: game state for wrong block");
@@ -278,7 +348,7 @@ PerformStep (CNameDB& nameDb, const GameState& inState, const CBlock* block,
     InitStepData(stepData, inState);
     stepData.newHash = block->GetHash();
 
-    GameStepValidator gameStepValidator(&inState);
+    GameStepValidator gameStepValidator(&inState, pdbsetConnect);
     // Create moves for all move transactions
     BOOST_FOREACH(const CTransaction& tx, block->vtx)
     {
@@ -289,10 +359,21 @@ PerformStep (CNameDB& nameDb, const GameState& inState, const CBlock* block,
             stepData.vMoves.push_back(m);
     }
 
-    StepResult stepResult;
     if (!Game::PerformStep(inState, stepData, outState, stepResult))
         return error("PerformStep failed for block %s", block->GetHash().ToString().c_str());
 
+    return true;
+}
+
+bool
+PerformStep (CNameDB& nameDb, const GameState& inState, const CBlock* block,
+             int64& nTax, GameState& outState,
+             std::vector<CTransaction>* outvgametx)
+{
+    StepResult stepResult;
+    if (!ComputeStep (inState, block, outState, stepResult))
+        return false;
+
     nTax = stepResult.nTaxAmount;
 
     if (!outvgametx)
@@ -378,6 +459,11 @@ public:
    */
   void store (const GameState& state);
 
+  /**
+   * Remove all entries.
+   */
+  void clear ();
+
 };
 
 GameStateCache::~GameStateCache ()
@@ -386,6 +472,14 @@ GameStateCache::~GameStateCache ()
     delete i->second;
 }
 
+void
+GameStateCache::clear ()
+{
+  for (gameStateMap::iterator i = map.begin (); i != map.end (); ++i)
+    delete i->second;
+  map.clear ();
+}
+
 void
 GameStateCache::store (const GameState& state)
 {
@@ -413,7 +507,7 @@ GameStateCache::store (const GameState& state)
          those first.  */
       for (i = map.begin (); i != map.end () && !deleted; ++i)
         {
-          std::map<uint256, CBlockIndex*>::const_iterator j;
+          CBlockIndexMap::const_iterator j;
           j = mapBlockIndex.find (i->second->hashBlock);
 
           if (j == mapBlockIndex.end () || !j->second->IsInMainChain ())
@@ -456,6 +550,305 @@ GameStateCache::store (const GameState& state)
 /** Our game state cache instance.  */
 static GameStateCache stateCache(IN_MEMORY_STATE_CACHE);
 
+/* ************************************************************************** */
+/* SpeculativeStates.  */
+
+/**
+ * Game steps computed in the background for blocks on side branches close
+ * to the tip.  When such a branch becomes the main chain, AdvanceGameState
+ * takes the finished step from here, so Reorganize (holding cs_main) neither
+ * runs PerformStep again nor has to reconstruct the state at the fork.
+ *
+ * A step's outcome is fixed by the block hash (which fixes its ancestry),
+ * so entries never become wrong, only useless when their branch dies.
+ * Only the game transactions are left for ConnectBlock, since they depend
+ * on the name DB at connection time.
+ */
+class SpeculativeStates
+{
+
+private:
+
+  struct Entry
+  {
+    GameState state;
+    StepResult result;
+  };
+
+  /** Type used for the map blockhash -> computed step.  */
+  typedef std::map<uint256, Entry*> entryMap;
+
+  boost::mutex mutex;
+  boost::condition_variable cond;
+
+  /** Finished steps.  */
+  entryMap map;
+
+  /** Blocks waiting for their step to be computed.  */
+  std::deque<CBlockIndex*> queue;
+
+  /** Maximum number of finished steps kept.  */
+  unsigned maxSize;
+
+  bool fQuit;
+
+  /** Whether the worker thread is between start and exit.  */
+  bool fRunning;
+
+  /**
+   * Get the state before the given block, either from a finished step or,
+   * for blocks branching off the main chain, as usual under cs_main.
+   */
+  bool getPrevState (CBlockIndex* pindex, GameState& out);
+
+  /** Compute and store the step of the given block.  */
+  void compute (CBlockIndex* pindex);
+
+  /** Process the queue until told to quit.  */
+  void run ();
+
+public:
+
+  inline SpeculativeStates (unsigned sz)
+    : maxSize(sz), fQuit(false), fRunning(false)
+  {}
+
+  ~SpeculativeStates ();
+
+  /**
+   * Queue a block for computation.
+   * @param pindex The block, which must be stored on disk.
+   */
+  void push (CBlockIndex* pindex);
+
+  /**
+   * Take out the finished step for a block if there is one.
+   * @param hash The block's hash.
+   * @param state Write the state after the block here.
+   * @param result Write the step's result here.
+   * @return True iff the step was found.
+   */
+  bool take (const uint256& hash, GameState& state, StepResult& result);
+
+  /** Worker thread body.  */
+  void thread ();
+
+  /**
+   * Let the worker thread exit and wait until it has.  After this, no
+   * step touches the databases anymore, so they can be closed.
+   */
+  void quit ();
+
+};
+
+SpeculativeStates::~SpeculativeStates ()
+{
+  for (entryMap::iterator i = map.begin (); i != map.end (); ++i)
+    delete i->second;
+}
+
+void
+SpeculativeStates::push (CBlockIndex* pindex)
+{
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (fQuit)
+      return;
+    queue.push_back (pindex);
+  }
+  cond.notify_one ();
+}
+
+bool
+SpeculativeStates::take (const uint256& hash, GameState& state,
+                         StepResult& result)
+{
+  Entry* entry;
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    const entryMap::iterator i = map.find (hash);
+    if (i == map.end ())
+      return false;
+    entry = i->second;
+    map.erase (i);
+  }
+
+  state = entry->state;
+  result = entry->result;
+  delete entry;
+
+  return true;
+}
+
+bool
+SpeculativeStates::getPrevState (CBlockIndex* pindex, GameState& out)
+{
+  CBlockIndex* pprev = pindex->pprev;
+
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    const entryMap::const_iterator i = map.find (*pprev->phashBlock);
+    if (i != map.end ())
+      {
+        out = i->second->state;
+        return true;
+      }
+  }
+
+  CRITICAL_BLOCK(cs_main)
+    {
+      /* If the parent is on a side branch without a finished step (its
+         own computation failed), give up.  */
+      if (!pprev->IsInMainChain ())
+        return false;
+
+      DatabaseSet dbset("r");
+      return GetGameState (dbset, pprev, out);
+    }
+
+  // not reached
+  return false;
+}
+
+void
+SpeculativeStates::compute (CBlockIndex* pindex)
+{
+  const int64 nStart = GetTimeMillis ();
+
+  GameState inState;
+  if (!getPrevState (pindex, inState))
+    return;
+
+  CBlock block;
+  if (!block.ReadFromDisk (pindex))
+    return;
+
+  Entry* entry = new Entry ();
+  if (!ComputeStep (inState, &block, entry->state, entry->result))
+    {
+      delete entry;
+      return;
+    }
+
+  boost::unique_lock<boost::mutex> lock(mutex);
+  const entryMap::iterator i = map.find (*pindex->phashBlock);
+  if (i != map.end ())
+    {
+      delete i->second;
+      map.erase (i);
+    }
+  map.insert (std::make_pair (*pindex->phashBlock, entry));
+
+  /* Drop the lowest steps, which are the least likely to be needed.  */
+  while (map.size () > maxSize)
+    {
+      entryMap::iterator lowest = map.begin ();
+      for (entryMap::iterator j = map.begin (); j != map.end (); ++j)
+        if (j->second->state.nHeight < lowest->second->state.nHeight)
+          lowest = j;
+      delete lowest->second;
+      map.erase (lowest);
+    }
+
+  printf ("SpeculativeStates: computed step for side block @%d %s in %"PRI64d"ms\n",
+          pindex->nHeight, pindex->phashBlock->GetHex ().c_str (),
+          GetTimeMillis () - nStart);
+}
+
+void
+SpeculativeStates::thread ()
+{
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fRunning = true;
+    vnThreadsRunning[8]++;
+  }
+
+  run ();
+
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fRunning = false;
+    vnThreadsRunning[8]--;
+  }
+  cond.notify_all ();
+}
+
+void
+SpeculativeStates::run ()
+{
+  while (true)
+    {
+      CBlockIndex* pindex;
+      {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.empty () && !fQuit)
+          cond.wait (lock);
+        if (fQuit)
+          return;
+        pindex = queue.front ();
+        queue.pop_front ();
+      }
+
+      try
+        {
+          compute (pindex);
+        }
+      catch (std::exception& e)
+        {
+          PrintException (&e, "SpeculativeStates::thread()");
+        }
+    }
+}
+
+void
+SpeculativeStates::quit ()
+{
+  boost::unique_lock<boost::mutex> lock(mutex);
+  fQuit = true;
+  queue.clear ();
+  cond.notify_all ();
+
+  /* A step in progress finishes first; it may need cs_main, so the
+     caller must not hold it.  */
+  while (fRunning)
+    cond.wait (lock);
+}
+
+/** Our instance of speculative steps.  */
+static SpeculativeStates speculativeStates(SPECULATIVE_STATES);
+
+static void
+ThreadSpeculativeGameState (void* parg)
+{
+  speculativeStates.thread ();
+}
+
+void
+StartGameStateSpeculation ()
+{
+  if (!CreateThread (ThreadSpeculativeGameState, NULL))
+    printf ("Error: CreateThread(ThreadSpeculativeGameState) failed\n");
+}
+
+void
+StopGameStateSpeculation ()
+{
+  speculativeStates.quit ();
+}
+
+void
+QueueSpeculativeGameState (CBlockIndex* pindex)
+{
+  /* Only short forks near the tip are worth it; during the initial
+     download side branches are just noise.  */
+  if (!pindex->pprev || pindex->nHeight + SPECULATIVE_MAX_DEPTH < nBestHeight
+      || IsInitialBlockDownload ())
+    return;
+
+  speculativeStates.push (pindex);
+}
+
 /* ************************************************************************** */
 
 // Caller must hold cs_main lock
@@ -538,10 +931,11 @@ GetGameState (DatabaseSet& dbset, CBlockIndex *pindex, GameState &outState)
     loop
     {
         CBlock block;
-        block.ReadFromDisk(plast);
+        if (!block.ReadFromDisk(plast))
+            return error("GetGameState: block %d is not available", plast->nHeight);
 
-        int64 nTax;
-        if (!PerformStep (dbset.name (), lastState, &block, nTax, outState))
+        StepResult stepResult;
+        if (!ComputeStep (lastState, &block, outState, stepResult, &dbset))
             return false;
         if (outState.nHeight != plast->nHeight)
             return error("GetGameState: wrong height");
@@ -556,7 +950,7 @@ GetGameState (DatabaseSet& dbset, CBlockIndex *pindex, GameState &outState)
            so that it is ensured that every other state is stored even
            if the game db is reconstructed from scratch.  (Otherwise,
            it would only contain the last state in that case.)  */
-        if (outState.nHeight % KEEP_EVERY_NTH_STATE == 0)
+        if (outState.nHeight % GetGameStateInterval () == 0)
           {
             CGameDB gameDb("r+", dbset.tx ());
             gameDb.Write(outState.nHeight, outState);
@@ -578,20 +972,34 @@ bool
 AdvanceGameState (DatabaseSet& dbset, CBlockIndex* pindex,
                   CBlock* block, int64& nFees)
 {
-    GameState currentState, outState;
+    GameState outState;
+    StepResult stepResult;
 
-    if (!GetGameState (dbset, pindex->pprev, currentState))
-        return error("AdvanceGameState: cannot get current game state");
+    /* If the block was on a side branch, its step may already be done.  */
+    if (speculativeStates.take (*pindex->phashBlock, outState, stepResult))
+    {
+        if (fDebug)
+            printf("AdvanceGameState: using speculative state for block %s\n",
+                   pindex->phashBlock->GetHex ().c_str ());
+    }
+    else
+    {
+        GameState currentState;
+        if (!GetGameState (dbset, pindex->pprev, currentState))
+            return error("AdvanceGameState: cannot get current game state");
 
-    if (currentState.nHeight != pindex->nHeight - 1)
-        return error("AdvanceGameState: incorrect height encountered");
-    if (currentState.hashBlock != block->hashPrevBlock)
-        return error("AdvanceGameState: incorrect hash encountered");
+        if (currentState.nHeight != pindex->nHeight - 1)
+            return error("AdvanceGameState: incorrect height encountered");
+        if (currentState.hashBlock != block->hashPrevBlock)
+            return error("AdvanceGameState: incorrect hash encountered");
 
-    int64 nTax = 0;
+        if (!ComputeStep (currentState, block, outState, stepResult, &dbset))
+            return false;
+    }
 
-    if (!PerformStep (dbset.name (), currentState, block, nTax,
-                      outState, &block->vgametx))
+    const int64 nTax = stepResult.nTaxAmount;
+    if (!CreateGameTransactions (dbset.name (), outState, stepResult,
+                                 block->vgametx))
       return false;
 
     if (outState.nHeight != pindex->nHeight)
@@ -605,7 +1013,7 @@ AdvanceGameState (DatabaseSet& dbset, CBlockIndex* pindex,
 
     gameDb.Write(pindex->nHeight, outState);
     // Prune old states from DB, keeping every Nth for quick lookup (intermediate states can be obtained by integrating blocks)
-    if (pindex->nHeight - 1 <= 0 || (pindex->nHeight - 1) % KEEP_EVERY_NTH_STATE != 0)
+    if (pindex->nHeight - 1 <= 0 || (pindex->nHeight - 1) % GetGameStateInterval () != 0)
         gameDb.Erase(pindex->nHeight - 1);
 
     nFees += nTax;
@@ -613,6 +1021,35 @@ AdvanceGameState (DatabaseSet& dbset, CBlockIndex* pindex,
     return true;
 }
 
+bool
+GetPlayerNameTxFiles (DatabaseSet& dbset, CBlockIndex* pindex,
+                      std::set<unsigned>& setFiles)
+{
+    GameState state;
+    if (!GetGameState (dbset, pindex, state))
+        return error ("GetPlayerNameTxFiles: cannot get game state at %d",
+                      pindex->nHeight);
+
+    BOOST_FOREACH(const PAIRTYPE(const PlayerID, PlayerState)& p, state.players)
+    {
+        std::vector<CNameIndex> vtxPos;
+        if (!dbset.name ().ReadNameVec (vchFromString (p.first), vtxPos)
+            || vtxPos.empty ())
+            continue;
+
+        /* The entry current at pindex; later ones are at least as high as
+           pindex and the caller keeps their blocks anyway.  */
+        const CNameIndex* pnidx = &vtxPos.front ();
+        BOOST_FOREACH(const CNameIndex& nidx, vtxPos)
+            if ((int)nidx.nHeight <= pindex->nHeight)
+                pnidx = &nidx;
+        setFiles.insert (pnidx->txPos.nBlockFile);
+        setFiles.insert (pnidx->txPos.nTxFile);
+    }
+
+    return true;
+}
+
 // Called from DisconnectBlock
 void RollbackGameState(CTxDB& txdb, CBlockIndex* pindex)
 {
@@ -655,8 +1092,8 @@ void EraseBadMoveTransactions()
         if (mapRemove.empty())
             return;
 
-        int countRemove = mapRemove.size();
-        printf("EraseBadMoveTransactions : erasing %d transactions\n", countRemove);
+        unsigned int countRemove = mapRemove.size();
+        printf("EraseBadMoveTransactions : erasing %u transactions\n", countRemove);
 
         bool fRepeat = true;
         while (fRepeat)
@@ -679,7 +1116,7 @@ void EraseBadMoveTransactions()
             }
         }
         if (mapRemove.size() > countRemove)
-            printf("EraseBadMoveTransactions : erasing additional %d dependent transactions\n", mapRemove.size() - countRemove);
+            printf("EraseBadMoveTransactions : erasing additional %"PRIszu" dependent transactions\n", mapRemove.size() - countRemove);
 
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapRemove)
         {
@@ -701,6 +1138,41 @@ void EraseBadMoveTransactions()
     }
 }
 
+bool
+DumpGameState (DatabaseSet& dbset, CBlockIndex* pindex,
+               CHashedFileWriter& out)
+{
+  GameState state;
+  if (!GetGameState (dbset, pindex, state))
+    return error ("DumpGameState: cannot get game state at %d",
+                  pindex->nHeight);
+
+  out << state;
+  return true;
+}
+
+bool
+LoadGameState (DatabaseSet& dbset, CBlockIndex* pindex, CMappedStream& s)
+{
+  GameState state;
+  s >> state;
+  if (state.nHeight != pindex->nHeight
+      || state.hashBlock != *pindex->phashBlock)
+    return error ("LoadGameState: state is not for block @%d %s",
+                  pindex->nHeight, pindex->phashBlock->GetHex ().c_str ());
+
+  /* Earlier states are dropped with the rest; GetGameState can integrate
+     them from the blocks should they ever be needed.  */
+  CGameDB gameDb("r+", dbset.tx ());
+  if (!gameDb.EraseAll () || !gameDb.Write (pindex->nHeight, state))
+    return error ("LoadGameState: writing the game DB failed");
+
+  stateCache.clear ();
+  stateCache.store (state);
+
+  return true;
+}
+
 void
 PruneGameDB (unsigned nHeight)
 {
@@ -769,7 +1241,7 @@ bool UpgradeGameDB()
         CGameDB gameDb("r+");
 
         GameState state;
-        for (unsigned int i = 0; i <= nBestHeight; i++)
+        for (int i = 0; i <= nBestHeight; i++)
         {
             gameDb.SetSerialisationVersion (nGameDbVersion);
             if (gameDb.Read(i, state))
@@ -3,6 +3,7 @@
 
 #include "uint256.h"
 
+#include <set>
 #include <vector>
 
 // This module acts as a connection between the game engine (gamestate.cpp) and the block chain hook (huntercoin.cpp)
@@ -19,6 +20,8 @@ class CTxDB;
 class CNameDB;
 class DatabaseSet;
 class CScript;
+class CHashedFileWriter;
+class CMappedStream;
 
 bool PerformStep (CNameDB& pnameDb, const Game::GameState& inState,
                   const CBlock* block, int64& nTax, Game::GameState& outState,
@@ -32,6 +35,30 @@ bool AdvanceGameState (DatabaseSet& dbset, CBlockIndex* pindex,
 void RollbackGameState(CTxDB& txdb, CBlockIndex* pindex);
 const Game::GameState &GetCurrentGameState();
 
+// Every this many blocks a game state stays in the game DB; smaller with
+// -prune, which needs the states within MIN_BLOCKS_TO_KEEP
+int GetGameStateInterval();
+
+// Block files holding the name transactions of the players alive at pindex
+// as of that height.  The game transactions of a later block may spend
+// them (or pay bounties to their addresses), so -prune keeps these files.
+bool GetPlayerNameTxFiles (DatabaseSet& dbset, CBlockIndex* pindex,
+                           std::set<unsigned>& setFiles);
+
+// Compute the game state after a block on a side branch in the background,
+// so that a reorganisation onto that branch finds it ready
+void QueueSpeculativeGameState(CBlockIndex* pindex);
+void StartGameStateSpeculation();
+// Returns once the speculation thread has exited; call it without cs_main
+void StopGameStateSpeculation();
+
+// Write the game state at pindex to a chain state snapshot, and replace
+// the game DB with the state read from one, which must be for pindex.
+// The caller must hold cs_main.
+bool DumpGameState (DatabaseSet& dbset, CBlockIndex* pindex,
+                    CHashedFileWriter& out);
+bool LoadGameState (DatabaseSet& dbset, CBlockIndex* pindex, CMappedStream& s);
+
 // Like name_clean; called in ResendWalletTransactions to remove outdated move transactions that are
 // no longer valid for the current game state
 void EraseBadMoveTransactions();
@@ -44,9 +44,64 @@ inline bool IsInsideMap(int x, int y)
     return x >= 0 && x < MAP_WIDTH && y >= 0 && y < MAP_HEIGHT;
 }
 
+// Precomputed tile attributes, one bitboard per layer.  Each map row is
+// packed into TILE_ROW_WORDS words, tile x being bit x % 64 of word x / 64.
+enum TileLayer
+{
+    TILE_WALKABLE,
+    TILE_SAFEZONE,
+    TILE_ADJACENT_SAFEZONE,
+    TILE_BASE_PERIMETER_YELLOW,     // base perimeters in team color order
+    TILE_BASE_PERIMETER_RED,
+    TILE_BASE_PERIMETER_GREEN,
+    TILE_BASE_PERIMETER_BLUE,
+    TILE_MONSTERPIT,                // set by SetMonsterPitBits
+    NUM_TILE_LAYERS
+};
+
+typedef unsigned long long TileWord;
+static const int TILE_ROW_WORDS = (MAP_WIDTH + 63) / 64;
+
+extern TileWord TileBits[NUM_TILE_LAYERS][MAP_HEIGHT][TILE_ROW_WORDS];
+
+// Tile must be inside the map
+inline bool TileHas(int layer, int x, int y)
+{
+    return (TileBits[layer][y][x >> 6] >> (x & 63)) & 1;
+}
+
+// Whether all tiles x0..x1 (inclusive, inside the map) of row y are set,
+// tested a word at a time
+inline bool TileRowAll(int layer, int y, int x0, int x1)
+{
+    const TileWord *row = TileBits[layer][y];
+    for (int w = x0 >> 6; w <= x1 >> 6; w++)
+    {
+        TileWord mask = ~TileWord(0);
+        if (w == x0 >> 6)
+            mask &= ~TileWord(0) << (x0 & 63);
+        if (w == x1 >> 6 && (x1 & 63) != 63)
+            mask &= (TileWord(1) << ((x1 & 63) + 1)) - 1;
+        if ((row[w] & mask) != mask)
+            return false;
+    }
+    return true;
+}
+
+// Fill the monster pit layer from RPGMonsterPitMap
+void SetMonsterPitBits();
+
+// The AI tables (Distance_To_POI, AI_merchantbasemap, the monster pit layer)
+// are filled at startup, possibly while the block index is still loading.
+// PerformStep calls WaitForMapTables so no game step runs before they are set.
+// SetMapTablesReady(false) marks them as failed; WaitForMapTables then throws
+// instead of blocking forever.
+void SetMapTablesReady(bool fOk = true);
+void WaitForMapTables();
+
 inline bool IsWalkable(int x, int y)
 {
-    return ObstacleMap[y][x] == 0;
+    return TileHas(TILE_WALKABLE, x, y);
 }
 
 inline bool IsInSpawnArea(int x, int y)
@@ -83,13 +138,22 @@ inline bool IsInSpawnArea(int x, int y)
 // todo: use dist to POI centered at 250,250 instead
 #define AI_IS_NEAR_CENTER(X,Y) ((X>100)&&(X<400)&&(Y>100)&&(Y<400))
 
-extern bool AI_IS_SAFEZONE(int X, int Y);
-extern bool AI_ADJACENT_IS_SAFEZONE(int X, int Y);
-extern int AI_IS_MONSTERPIT(int X, int Y);
-extern bool RPG_YELLOW_BASE_PERIMETER(int X, int Y);
-extern bool RPG_RED_BASE_PERIMETER(int X, int Y);
-extern bool RPG_GREEN_BASE_PERIMETER(int X, int Y);
-extern bool RPG_BLUE_BASE_PERIMETER(int X, int Y);
+// Evaluate the zone geometry of a tile layer directly (also outside of the map)
+extern bool TileLayerGeometry(int layer, int X, int Y);
+
+inline bool TileLayerAt(int layer, int X, int Y)
+{
+    if (Game::IsInsideMap(X, Y))
+        return Game::TileHas(layer, X, Y);
+    return TileLayerGeometry(layer, X, Y);
+}
+
+inline bool AI_IS_SAFEZONE(int X, int Y)            { return TileLayerAt(Game::TILE_SAFEZONE, X, Y); }
+inline bool AI_ADJACENT_IS_SAFEZONE(int X, int Y)   { return TileLayerAt(Game::TILE_ADJACENT_SAFEZONE, X, Y); }
+inline bool RPG_YELLOW_BASE_PERIMETER(int X, int Y) { return TileLayerAt(Game::TILE_BASE_PERIMETER_YELLOW, X, Y); }
+inline bool RPG_RED_BASE_PERIMETER(int X, int Y)    { return TileLayerAt(Game::TILE_BASE_PERIMETER_RED, X, Y); }
+inline bool RPG_GREEN_BASE_PERIMETER(int X, int Y)  { return TileLayerAt(Game::TILE_BASE_PERIMETER_GREEN, X, Y); }
+inline bool RPG_BLUE_BASE_PERIMETER(int X, int Y)   { return TileLayerAt(Game::TILE_BASE_PERIMETER_BLUE, X, Y); }
 
 #define AI_STATE_FARM_OUTER_RING 1
 #define AI_STATE_MANUAL_MODE 2 // currently has waypoints
@@ -219,6 +283,14 @@ extern int AsciiArtTileCount[RPG_MAP_HEIGHT + 4][RPG_MAP_WIDTH + 4];
 
 extern int RPGMonsterPitMap[RPG_MAP_HEIGHT][RPG_MAP_WIDTH];
 
+inline int AI_IS_MONSTERPIT(int X, int Y)
+{
+    if (Game::IsInsideMap(X, Y) && Game::TileHas(Game::TILE_MONSTERPIT, X, Y))
+        return RPGMonsterPitMap[Y][X];
+
+    return 0;
+}
+
 #define POIINDEX_MONSTER_FIRST 82
 #define POIINDEX_MONSTER_LAST 93
 #define POIINDEX_CRESCENT_FIRST 26
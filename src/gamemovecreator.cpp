@@ -2,10 +2,13 @@
 #include "gamemap.h"
 
 #include <deque>
+#include <queue>
 
 #ifndef Q_MOC_RUN
+#include <boost/foreach.hpp>
 #include <boost/graph/astar_search.hpp>
 #include <boost/graph/grid_graph.hpp>
+#include <boost/thread/once.hpp>
 #include <boost/unordered_map.hpp>
 #endif
 
@@ -243,23 +246,33 @@ private:
 };
 
 // Helper function for creating waypoints (linear path segments)
+// Tiles are collected into horizontal runs which are tested a word at a time.
 bool CheckLinearPath(const Game::Coord &start, const Game::Coord &target)
 {
-    CharacterState tmp;
-    tmp.from = tmp.coord = start;
-    tmp.waypoints.push_back(target);
-    while (!tmp.waypoints.empty())
-        tmp.MoveTowardsWaypoint();
-    return tmp.coord == target;
+    Coord c = start;
+    while (c != target)
+    {
+        c = LineStep(start, c, target);
+        int x0 = c.x, x1 = c.x;
+        while (c != target)
+        {
+            Coord next = LineStep(start, c, target);
+            if (next.y != c.y)
+                break;
+            c = next;
+            x0 = std::min(x0, c.x);
+            x1 = std::max(x1, c.x);
+        }
+        if (!TileRowAll(TILE_WALKABLE, c.y, x0, x1))
+            return false;
+    }
+    return true;
 }
 
-std::vector<Coord> FindPath(const Coord &start, const Coord &goal)
+// Exact A* search on the tile grid.  On success, solution holds the path
+// from start (exclusive) to goal (inclusive).
+static bool FindTilePath(const Coord &start, const Coord &goal, std::deque<Coord> &solution)
 {
-    std::vector<Game::Coord> waypoints;
-
-    if (!WalkableCoord(start) || !WalkableCoord(goal))
-        return waypoints;
-
     boost::static_property_map<int> weight(1);
 
     // The predecessor map is a vertex-to-vertex mapping.
@@ -301,13 +314,418 @@ std::vector<Coord> FindPath(const Coord &start, const Coord &goal)
     }
 
     if (!found)
-        return waypoints;
+        return false;
 
     // Walk backwards from the goal through the predecessor chain adding
     // vertices to the solution path.
-    std::deque<Game::Coord> solution;
     for (Coord u = goal; u != start; u = predecessor[u])
         solution.push_front(u);
+    return true;
+}
+
+// Hierarchical path abstraction (HPA*) for long-range queries.
+// The map is cut into square clusters.  Walkable crossings between
+// neighbouring clusters become portal nodes of a small abstract graph,
+// whose edges are the walking distances between portals inside a cluster.
+// Long queries are routed over that graph and then refined tile by tile
+// inside each cluster, so no search ever leaves a single cluster.
+// The refined path can be slightly longer than the exact shortest path.
+
+static const int HPA_CLUSTER_SIZE = 16;
+static const int HPA_CLUSTERS_X = (MAP_WIDTH + HPA_CLUSTER_SIZE - 1) / HPA_CLUSTER_SIZE;
+static const int HPA_CLUSTERS_Y = (MAP_HEIGHT + HPA_CLUSTER_SIZE - 1) / HPA_CLUSTER_SIZE;
+
+// Queries shorter than this (in L-inf distance) use the exact tile search
+static const int HPA_MIN_DISTANCE = 2 * HPA_CLUSTER_SIZE;
+
+// Entrances at least this wide get a portal at both ends instead of one in the middle
+static const int HPA_WIDE_ENTRANCE = 6;
+
+static inline int ClusterOf(const Coord &c)
+{
+    return (c.y / HPA_CLUSTER_SIZE) * HPA_CLUSTERS_X + c.x / HPA_CLUSTER_SIZE;
+}
+
+// Breadth-first walking distances from a source tile, restricted to its cluster
+struct ClusterDistances
+{
+    int x0, y0, x1, y1;     // Cluster bounds (inclusive)
+    short dist[HPA_CLUSTER_SIZE][HPA_CLUSTER_SIZE];
+
+    void Compute(const Coord &src)
+    {
+        x0 = src.x - src.x % HPA_CLUSTER_SIZE;
+        y0 = src.y - src.y % HPA_CLUSTER_SIZE;
+        x1 = std::min(x0 + HPA_CLUSTER_SIZE, MAP_WIDTH) - 1;
+        y1 = std::min(y0 + HPA_CLUSTER_SIZE, MAP_HEIGHT) - 1;
+
+        for (int j = 0; j < HPA_CLUSTER_SIZE; j++)
+            for (int i = 0; i < HPA_CLUSTER_SIZE; i++)
+                dist[j][i] = -1;
+
+        Coord queue[HPA_CLUSTER_SIZE * HPA_CLUSTER_SIZE];
+        int head = 0, tail = 0;
+        dist[src.y - y0][src.x - x0] = 0;
+        queue[tail++] = src;
+        while (head < tail)
+        {
+            const Coord c = queue[head++];
+            const short d = dist[c.y - y0][c.x - x0];
+            for (int v = c.y - 1; v <= c.y + 1; v++)
+                for (int u = c.x - 1; u <= c.x + 1; u++)
+                {
+                    if (u < x0 || u > x1 || v < y0 || v > y1)
+                        continue;
+                    if (dist[v - y0][u - x0] >= 0 || !IsWalkable(u, v))
+                        continue;
+                    dist[v - y0][u - x0] = d + 1;
+                    queue[tail++] = Coord(u, v);
+                }
+        }
+    }
+
+    // Returns -1 for unreachable tiles and tiles outside of the cluster
+    int Get(const Coord &c) const
+    {
+        if (c.x < x0 || c.x > x1 || c.y < y0 || c.y > y1)
+            return -1;
+        return dist[c.y - y0][c.x - x0];
+    }
+
+    // Walk from c down the distance gradient to the source tile,
+    // appending every step (excluding c, including the source)
+    void Descend(Coord c, std::deque<Coord> &path) const
+    {
+        for (int d = Get(c); d > 0; d--)
+        {
+            Coord next = c;
+            for (int v = c.y - 1; v <= c.y + 1 && next == c; v++)
+                for (int u = c.x - 1; u <= c.x + 1; u++)
+                    if (Get(Coord(u, v)) == d - 1)
+                    {
+                        next = Coord(u, v);
+                        break;
+                    }
+            assert(next != c);
+            c = next;
+            path.push_back(c);
+        }
+    }
+};
+
+class PathAbstraction
+{
+public:
+    void Build();
+    bool FindPath(const Coord &start, const Coord &goal, std::deque<Coord> &solution) const;
+
+    // Whether a walking path between two walkable tiles exists at all
+    bool Connected(const Coord &a, const Coord &b) const
+    {
+        return component[a.y * MAP_WIDTH + a.x] == component[b.y * MAP_WIDTH + b.x];
+    }
+
+private:
+    typedef std::pair<int, int> Edge;       // (target node, cost)
+
+    std::vector<Coord> nodes;
+    std::vector<std::vector<Edge> > edges;
+    std::vector<std::vector<int> > clusterNodes;
+    std::map<Coord, int> nodeIndex;
+
+    // Connected region of every tile (-1 for obstacles)
+    std::vector<int> component;
+
+    void LabelComponents();
+    int AddNode(const Coord &c);
+    void Link(const Coord &a, const Coord &b, int cost);
+    void AddEntrances(const Coord &a0, const Coord &b0, int dx, int dy, int len);
+    static void Refine(const Coord &a, const Coord &b, std::deque<Coord> &solution);
+};
+
+int PathAbstraction::AddNode(const Coord &c)
+{
+    std::map<Coord, int>::const_iterator mi = nodeIndex.find(c);
+    if (mi != nodeIndex.end())
+        return mi->second;
+    int n = nodes.size();
+    nodes.push_back(c);
+    edges.push_back(std::vector<Edge>());
+    clusterNodes[ClusterOf(c)].push_back(n);
+    nodeIndex.insert(std::make_pair(c, n));
+    return n;
+}
+
+void PathAbstraction::Link(const Coord &a, const Coord &b, int cost)
+{
+    int na = AddNode(a), nb = AddNode(b);
+    edges[na].push_back(Edge(nb, cost));
+    edges[nb].push_back(Edge(na, cost));
+}
+
+// Scan one side of a cluster border.  a0 is the first tile on the near side,
+// b0 the tile facing it on the far side, (dx, dy) the direction along the border.
+// Every run of near-side tiles that can step across is one entrance.
+void PathAbstraction::AddEntrances(const Coord &a0, const Coord &b0, int dx, int dy, int len)
+{
+    // For each position along the border, the offset (-1, 0, 1) of a reachable
+    // far-side tile, or 2 if the border cannot be crossed there
+    std::vector<int> cross(len, 2);
+    for (int t = 0; t < len; t++)
+    {
+        if (!IsWalkable(a0.x + t * dx, a0.y + t * dy))
+            continue;
+        static const int offsets[3] = { 0, -1, 1 };
+        for (int k = 0; k < 3; k++)
+        {
+            int s = t + offsets[k];
+            if (s >= 0 && s < len && IsWalkable(b0.x + s * dx, b0.y + s * dy))
+            {
+                cross[t] = offsets[k];
+                break;
+            }
+        }
+    }
+
+    for (int t = 0; t < len; t++)
+    {
+        if (cross[t] == 2)
+            continue;
+        int end = t;
+        while (end + 1 < len && cross[end + 1] != 2)
+            end++;
+
+        std::vector<int> portals;
+        if (end - t + 1 >= HPA_WIDE_ENTRANCE)
+        {
+            portals.push_back(t);
+            portals.push_back(end);
+        }
+        else
+            portals.push_back((t + end) / 2);
+
+        BOOST_FOREACH(int p, portals)
+        {
+            int s = p + cross[p];
+            Link(Coord(a0.x + p * dx, a0.y + p * dy), Coord(b0.x + s * dx, b0.y + s * dy), 1);
+        }
+        t = end;
+    }
+}
+
+void PathAbstraction::LabelComponents()
+{
+    component.assign(MAP_WIDTH * MAP_HEIGHT, -1);
+    std::vector<Coord> queue;
+    int label = 0;
+    for (int y = 0; y < MAP_HEIGHT; y++)
+        for (int x = 0; x < MAP_WIDTH; x++)
+        {
+            if (component[y * MAP_WIDTH + x] >= 0 || !IsWalkable(x, y))
+                continue;
+            component[y * MAP_WIDTH + x] = label;
+            queue.assign(1, Coord(x, y));
+            while (!queue.empty())
+            {
+                const Coord c = queue.back();
+                queue.pop_back();
+                for (int v = c.y - 1; v <= c.y + 1; v++)
+                    for (int u = c.x - 1; u <= c.x + 1; u++)
+                        if (WalkableCoord(u, v) && component[v * MAP_WIDTH + u] < 0)
+                        {
+                            component[v * MAP_WIDTH + u] = label;
+                            queue.push_back(Coord(u, v));
+                        }
+            }
+            label++;
+        }
+}
+
+void PathAbstraction::Build()
+{
+    LabelComponents();
+    clusterNodes.resize(HPA_CLUSTERS_X * HPA_CLUSTERS_Y);
+
+    // Borders between horizontally and vertically adjacent clusters,
+    // scanned from both sides so that every far-side component gets a portal
+    for (int x = HPA_CLUSTER_SIZE; x < MAP_WIDTH; x += HPA_CLUSTER_SIZE)
+        for (int y = 0; y < MAP_HEIGHT; y += HPA_CLUSTER_SIZE)
+        {
+            int len = std::min(HPA_CLUSTER_SIZE, MAP_HEIGHT - y);
+            AddEntrances(Coord(x - 1, y), Coord(x, y), 0, 1, len);
+            AddEntrances(Coord(x, y), Coord(x - 1, y), 0, 1, len);
+        }
+    for (int y = HPA_CLUSTER_SIZE; y < MAP_HEIGHT; y += HPA_CLUSTER_SIZE)
+        for (int x = 0; x < MAP_WIDTH; x += HPA_CLUSTER_SIZE)
+        {
+            int len = std::min(HPA_CLUSTER_SIZE, MAP_WIDTH - x);
+            AddEntrances(Coord(x, y - 1), Coord(x, y), 1, 0, len);
+            AddEntrances(Coord(x, y), Coord(x, y - 1), 1, 0, len);
+        }
+
+    // Diagonal steps across the corner where four clusters meet
+    for (int y = HPA_CLUSTER_SIZE; y < MAP_HEIGHT; y += HPA_CLUSTER_SIZE)
+        for (int x = HPA_CLUSTER_SIZE; x < MAP_WIDTH; x += HPA_CLUSTER_SIZE)
+        {
+            if (IsWalkable(x - 1, y - 1) && IsWalkable(x, y))
+                Link(Coord(x - 1, y - 1), Coord(x, y), 1);
+            if (IsWalkable(x, y - 1) && IsWalkable(x - 1, y))
+                Link(Coord(x, y - 1), Coord(x - 1, y), 1);
+        }
+
+    // Walking distances between the portals of each cluster
+    ClusterDistances cd;
+    BOOST_FOREACH(const std::vector<int> &portals, clusterNodes)
+        for (unsigned i = 0; i < portals.size(); i++)
+        {
+            cd.Compute(nodes[portals[i]]);
+            for (unsigned j = i + 1; j < portals.size(); j++)
+            {
+                int d = cd.Get(nodes[portals[j]]);
+                if (d > 0)
+                {
+                    edges[portals[i]].push_back(Edge(portals[j], d));
+                    edges[portals[j]].push_back(Edge(portals[i], d));
+                }
+            }
+        }
+
+    nodeIndex.clear();
+}
+
+// Append the tiles from a (exclusive) to b (inclusive).  Consecutive abstract
+// nodes either share a cluster or are adjacent tiles across a border.
+void PathAbstraction::Refine(const Coord &a, const Coord &b, std::deque<Coord> &solution)
+{
+    if (a == b)
+        return;
+    if (ClusterOf(a) != ClusterOf(b))
+    {
+        solution.push_back(b);
+        return;
+    }
+    ClusterDistances cd;
+    cd.Compute(b);
+    cd.Descend(a, solution);
+}
+
+bool PathAbstraction::FindPath(const Coord &start, const Coord &goal, std::deque<Coord> &solution) const
+{
+    ClusterDistances fromStart, toGoal;
+    fromStart.Compute(start);
+    toGoal.Compute(goal);
+
+    // Start and goal are inserted as two temporary nodes after the portals
+    const int nStart = nodes.size();
+    const int nGoal = nStart + 1;
+    const int goalCluster = ClusterOf(goal);
+
+    std::vector<int> dist(nodes.size() + 2, std::numeric_limits<int>::max());
+    std::vector<int> pred(nodes.size() + 2, -1);
+
+    // Open list ordered by (estimated total cost, node)
+    typedef std::pair<int, int> OpenEntry;
+    std::priority_queue<OpenEntry, std::vector<OpenEntry>, std::greater<OpenEntry> > open;
+
+    dist[nStart] = 0;
+    open.push(OpenEntry(distLInf(start, goal), nStart));
+
+    while (!open.empty())
+    {
+        const int u = open.top().second;
+        const int f = open.top().first;
+        open.pop();
+        if (u == nGoal)
+            break;
+
+        const Coord &cu = (u == nStart) ? start : nodes[u];
+        if (f - distLInf(cu, goal) > dist[u])
+            continue;   // Outdated entry
+
+        std::vector<Edge> out;
+        if (u == nStart)
+        {
+            BOOST_FOREACH(int p, clusterNodes[ClusterOf(start)])
+            {
+                int d = fromStart.Get(nodes[p]);
+                if (d >= 0)
+                    out.push_back(Edge(p, d));
+            }
+            int d = fromStart.Get(goal);
+            if (d >= 0)
+                out.push_back(Edge(nGoal, d));
+        }
+        else
+        {
+            out = edges[u];
+            if (ClusterOf(cu) == goalCluster)
+            {
+                int d = toGoal.Get(cu);
+                if (d >= 0)
+                    out.push_back(Edge(nGoal, d));
+            }
+        }
+
+        BOOST_FOREACH(const Edge &e, out)
+        {
+            int nd = dist[u] + e.second;
+            if (nd >= dist[e.first])
+                continue;
+            dist[e.first] = nd;
+            pred[e.first] = u;
+            const Coord &cv = (e.first == nGoal) ? goal : nodes[e.first];
+            open.push(OpenEntry(nd + distLInf(cv, goal), e.first));
+        }
+    }
+
+    if (pred[nGoal] < 0)
+        return false;
+
+    std::vector<Coord> chain;
+    for (int v = nGoal; v >= 0; v = pred[v])
+        chain.push_back(v == nGoal ? goal : v == nStart ? start : nodes[v]);
+    std::reverse(chain.begin(), chain.end());
+
+    for (unsigned i = 1; i < chain.size(); i++)
+        Refine(chain[i - 1], chain[i], solution);
+    return true;
+}
+
+static PathAbstraction pathAbstraction;
+static boost::once_flag pathAbstractionOnce = BOOST_ONCE_INIT;
+
+static void BuildPathAbstraction()
+{
+    pathAbstraction.Build();
+}
+
+void InitPathAbstraction()
+{
+    boost::call_once(BuildPathAbstraction, pathAbstractionOnce);
+}
+
+std::vector<Coord> FindPath(const Coord &start, const Coord &goal)
+{
+    std::vector<Game::Coord> waypoints;
+
+    if (!WalkableCoord(start) || !WalkableCoord(goal))
+        return waypoints;
+
+    InitPathAbstraction();
+    if (!pathAbstraction.Connected(start, goal))
+        return waypoints;
+
+    std::deque<Game::Coord> solution;
+    bool found = false;
+    if (distLInf(start, goal) >= HPA_MIN_DISTANCE)
+        found = pathAbstraction.FindPath(start, goal, solution);
+    // Fall back to the exact search if the abstraction misses a connection
+    if (!found)
+    {
+        solution.clear();
+        if (!FindTilePath(start, goal, solution))
+            return waypoints;
+    }
 
     // Generate waypoints by linearizing parts of path
     waypoints.push_back(start);
@@ -334,6 +752,31 @@ std::vector<Coord> FindPath(const Coord &start, const Coord &goal)
     return waypoints;
 }
 
+// If the character has walked along its queued path since it was planned,
+// drop the part already behind it so that the remaining route is reused.
+// The character walks the rest of its current segment on a new line from
+// where it stands, which need not be walkable although the planned line
+// was; then the path is planned again.  Paths the character has left are
+// kept unchanged.
+static void AdvanceQueuedPath(std::vector<Coord> &wp, const Coord &coord)
+{
+    for (unsigned i = 0; i + 1 < wp.size(); i++)
+        for (Coord c = wp[i]; c != wp[i + 1]; )
+        {
+            c = LineStep(wp[i], c, wp[i + 1]);
+            if (c == coord)
+            {
+                wp.erase(wp.begin(), wp.begin() + i);
+                wp[0] = coord;
+                if (wp.size() > 1 && wp[1] == coord)
+                    wp.erase(wp.begin() + 1);
+                else if (wp.size() > 1 && !CheckLinearPath(coord, wp[1]))
+                    wp = FindPath(coord, wp.back());
+                return;
+            }
+        }
+}
+
 std::vector<Coord> *UpdateQueuedPath(const CharacterState &ch, QueuedMoves &queuedMoves, const Game::CharacterID &chid)
 {
     QueuedMoves::iterator qm = queuedMoves.find(chid.player);
@@ -356,6 +799,12 @@ std::vector<Coord> *UpdateQueuedPath(const CharacterState &ch, QueuedMoves &queu
     // playground -- keep queued path
 //    if (wp.front() != ch.coord)
 //        wp = FindPath(ch.coord, wp.back());
+    if (wp.front() != ch.coord)
+    {
+        AdvanceQueuedPath(wp, ch.coord);
+        if (wp.empty())
+            return NULL;
+    }
     return &wp;
 }
 
@@ -9,6 +9,10 @@
 
 std::vector<Game::Coord> FindPath(const Game::Coord &start, const Game::Coord &goal);
 
+// Build the cluster/portal graph used by FindPath for long-range queries.
+// Done lazily on the first such query; call at startup to avoid the delay.
+void InitPathAbstraction();
+
 struct QueuedMove
 {
     Game::WaypointVector waypoints;
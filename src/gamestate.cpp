@@ -540,60 +540,6 @@ int Gamecache_devmode;
 int64 LastDumpStatsTime; // IsInitialBlockDownload is not enough (e.g. if regenerating gamestate)
 
 
-// larger center (including palisades, excluding lawn with coins) and the 4 corners of the map
-bool AI_IS_SAFEZONE(int X, int Y)
-{
-    if ((X+Y<=43) || (X+(MAP_HEIGHT-Y)<=43) || ((MAP_WIDTH-X)+(MAP_HEIGHT-Y)<=43) || ((MAP_WIDTH-X)+Y<=43)) return true; // bases
-
-    if ((X>=238)&&(X<=263)&&(Y>=259)&&(Y<=261)) return false; // lawn with coins
-
-    if ((X+Y<460) || (X+(MAP_HEIGHT-Y)<460) || ((MAP_WIDTH-X)+(MAP_HEIGHT-Y)<460) || ((MAP_WIDTH-X)+Y<460)) return false;
-    if ((X>=225)&&(X<=276)&&(Y>=224)&&(Y<=275)) return true; // center
-
-    return false;
-}
-bool AI_ADJACENT_IS_SAFEZONE(int X, int Y)
-{
-    if ((X+Y<42) || (X+(MAP_HEIGHT-Y)<42) || ((MAP_WIDTH-X)+(MAP_HEIGHT-Y)<42) || ((MAP_WIDTH-X)+Y<42)) return true; // bases
-
-    if ((X>=237)&&(X<=264)&&(Y>=258)&&(Y<=262)) return false; // lawn with coins
-
-    if ((X+Y<=461) || (X+(MAP_HEIGHT-Y)<=461) || ((MAP_WIDTH-X)+(MAP_HEIGHT-Y)<=461) || ((MAP_WIDTH-X)+Y<=461)) return false;
-    if ((X>225)&&(X<276)&&(Y>224)&&(Y<275)) return true; // center
-
-    return false;
-}
-int AI_IS_MONSTERPIT(int X, int Y)
-{
-    if (IsInsideMap(X, Y)) return RPGMonsterPitMap[Y][X];
-
-    return 0;
-}
-bool RPG_YELLOW_BASE_PERIMETER(int X, int Y)
-{
-    if ((X+Y<=43) &&
-        (!(X+Y<42))) return true;
-    return false;
-}
-bool RPG_RED_BASE_PERIMETER(int X, int Y)
-{
-    if (((MAP_WIDTH-X)+Y<=43) &&
-        (!((MAP_WIDTH-X)+Y<42))) return true;
-    return false;
-}
-bool RPG_GREEN_BASE_PERIMETER(int X, int Y)
-{
-    if (((MAP_WIDTH-X)+(MAP_HEIGHT-Y)<=43) &&
-        (!((MAP_WIDTH-X)+(MAP_HEIGHT-Y)<42))) return true;
-    return false;
-}
-bool RPG_BLUE_BASE_PERIMETER(int X, int Y)
-{
-    if ((X+(MAP_HEIGHT-Y)<=43) &&
-        (!(X+(MAP_HEIGHT-Y)<42))) return true;
-    return false;
-}
-
 short POI_nearest_foe_per_clevel[AI_NUM_POI][NUM_TEAM_COLORS][RPG_CLEVEL_MAX];
 // if this is "short" instead of "int", then result of "distance penalty" calculations will be wrong
 int POI_num_foes[AI_NUM_POI][NUM_TEAM_COLORS]; // count all nearby characters for each POI/each color
@@ -2694,51 +2640,8 @@ void CharacterState::MoveTowardsWaypointX_Pathfinder(RandomGenerator &rnd, int c
         } while (coord == waypoints.back());
     }
 
-    struct Helper
-    {
-        static int CoordStep(int x, int target)
-        {
-            if (x < target)
-                return x + 1;
-            else if (x > target)
-                return x - 1;
-            else
-                return x;
-        }
-
-        // Compute new 'v' coordinate using line slope information applied to the 'u' coordinate
-        // 'u' is reference coordinate (largest among dx, dy), 'v' is the coordinate to be updated
-        static int CoordUpd(int u, int v, int du, int dv, int from_u, int from_v)
-        {
-            if (dv != 0)
-            {
-                int tmp = (u - from_u) * dv;
-                int res = (abs(tmp) + abs(du) / 2) / du;
-                if (tmp < 0)
-                    res = -res;
-                return res + from_v;
-            }
-            else
-                return v;
-        }
-    };
-
-    Coord new_c;
     Coord target = waypoints.back();
-
-    int dx = target.x - from.x;
-    int dy = target.y - from.y;
-
-    if (abs(dx) > abs(dy))
-    {
-        new_c.x = Helper::CoordStep(coord.x, target.x);
-        new_c.y = Helper::CoordUpd(new_c.x, coord.y, dx, dy, from.x, from.y);
-    }
-    else
-    {
-        new_c.y = Helper::CoordStep(coord.y, target.y);
-        new_c.x = Helper::CoordUpd(new_c.y, coord.x, dy, dx, from.y, from.x);
-    }
+    Coord new_c = LineStep(from, coord, target);
 
     if (!IsWalkable(new_c))
         StopMoving();
@@ -2767,25 +2670,8 @@ void CharacterState::MoveTowardsWaypointX_Pathfinder(RandomGenerator &rnd, int c
 }
 
 
-// Simple straight-line motion
-void CharacterState::MoveTowardsWaypoint()
+Coord Game::LineStep(const Coord &from, const Coord &c, const Coord &target)
 {
-    if (waypoints.empty())
-    {
-        from = coord;
-        return;
-    }
-    if (coord == waypoints.back())
-    {
-        from = coord;
-        do
-        {
-            waypoints.pop_back();
-            if (waypoints.empty())
-                return;
-        } while (coord == waypoints.back());
-    }
-
     struct Helper
     {
         static int CoordStep(int x, int target)
@@ -2816,22 +2702,44 @@ void CharacterState::MoveTowardsWaypoint()
     };
 
     Coord new_c;
-    Coord target = waypoints.back();
-    
     int dx = target.x - from.x;
     int dy = target.y - from.y;
-    
+
     if (abs(dx) > abs(dy))
     {
-        new_c.x = Helper::CoordStep(coord.x, target.x);
-        new_c.y = Helper::CoordUpd(new_c.x, coord.y, dx, dy, from.x, from.y);
+        new_c.x = Helper::CoordStep(c.x, target.x);
+        new_c.y = Helper::CoordUpd(new_c.x, c.y, dx, dy, from.x, from.y);
     }
     else
     {
-        new_c.y = Helper::CoordStep(coord.y, target.y);
-        new_c.x = Helper::CoordUpd(new_c.y, coord.x, dy, dx, from.y, from.x);
+        new_c.y = Helper::CoordStep(c.y, target.y);
+        new_c.x = Helper::CoordUpd(new_c.y, c.x, dy, dx, from.y, from.x);
+    }
+    return new_c;
+}
+
+// Simple straight-line motion
+void CharacterState::MoveTowardsWaypoint()
+{
+    if (waypoints.empty())
+    {
+        from = coord;
+        return;
+    }
+    if (coord == waypoints.back())
+    {
+        from = coord;
+        do
+        {
+            waypoints.pop_back();
+            if (waypoints.empty())
+                return;
+        } while (coord == waypoints.back());
     }
 
+    Coord target = waypoints.back();
+    Coord new_c = LineStep(from, coord, target);
+
     if (!IsWalkable(new_c))
         StopMoving();
     else
@@ -5045,6 +4953,8 @@ std::multimap<Coord, AttackableCharacter> *MapCharactersToTiles(const std::map<P
 
 bool Game::PerformStep(const GameState &inState, const StepData &stepData, GameState &outState, StepResult &stepResult)
 {
+    WaitForMapTables();
+
     BOOST_FOREACH(const Move &m, stepData.vMoves)
         if (!m.IsValid(inState))
             return false;
@@ -103,6 +103,11 @@ struct Coord
 
 typedef std::vector<Coord> WaypointVector;
 
+// Next tile after c on the straight line from 'from' to 'target', as
+// characters step towards their waypoints.  The move creator plans paths
+// with it too, so that they are exactly the paths that will be walked.
+Coord LineStep(const Coord &from, const Coord &c, const Coord &target);
+
 struct Move
 {
     PlayerID player;
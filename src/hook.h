@@ -62,6 +62,9 @@ class GameStepMiner
 public:
     GameStepMiner (DatabaseSet& dbset, CBlockIndex *pindex);
     ~GameStepMiner();
+    // The miner can outlive the DatabaseSet it was created with (see
+    // CBlockTemplate); NULL makes it open its own when needed
+    void SetDatabase(DatabaseSet* pdbset);
     bool AddTx(const CTransaction& tx);
     int64 ComputeTax();
 };
@@ -270,7 +270,7 @@ int GetTxPosHeight(const CDiskTxPos& txPos)
     if (!block.ReadFromDisk(txPos.nBlockFile, txPos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     const CBlockIndex* pindex = (*mi).second;
@@ -778,6 +778,13 @@ Value name_debug1(const Array& params, bool fHelp)
     return true;
 }
 
+// With -prune, the block files holding old name transactions may be gone
+static bool IsTxPosPruned(const CDiskTxPos& txPos)
+{
+    CTxDB txdb("r");
+    return txdb.IsBlockFilePruned(txPos.nTxFile);
+}
+
 Value name_show(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -788,7 +795,8 @@ Value name_show(const Array& params, bool fHelp)
 
     const vchType vchName = vchFromValue(params[0]);
 
-    CRITICAL_BLOCK(cs_main)
+    /* The name DB and block files are consistent on their own, so don't
+       wait for cs_main.  */
     {
         CNameIndex nidx;
         CNameDB dbName("r");
@@ -798,7 +806,11 @@ Value name_show(const Array& params, bool fHelp)
         const CDiskTxPos txPos = nidx.txPos;
         CTransaction tx;
         if (!tx.ReadFromDisk(txPos))
+        {
+            if (IsTxPosPruned(txPos))
+                throw JSONRPCError(RPC_MISC_ERROR, strprintf("the name's transaction at height %d is in a pruned block file", (int)nidx.nHeight));
             throw JSONRPCError(RPC_WALLET_ERROR, "failed to read from from disk");
+        }
 
         Object oName;
         oName.push_back (Pair("name", stringFromVch (vchName)));
@@ -834,7 +846,7 @@ Value name_history(const Array& params, bool fHelp)
     Array oRes;
     const vchType vchName = vchFromValue(params[0]);
 
-    CRITICAL_BLOCK(cs_main)
+    /* Like name_show, without cs_main.  */
     {
         vector<CNameIndex> vtxPos;
         CNameDB dbName("r");
@@ -847,6 +859,17 @@ Value name_history(const Array& params, bool fHelp)
             CTransaction tx;
             if (!tx.ReadFromDisk(txPos))
             {
+                if (IsTxPosPruned(txPos))
+                {
+                    // keep the entry, so a pruned node doesn't show a
+                    // shortened history as if it were complete
+                    Object oName;
+                    oName.push_back (Pair("name", stringFromVch (vchName)));
+                    oName.push_back (Pair("height", (int)txPos2.nHeight));
+                    oName.push_back (Pair("error", "transaction is in a pruned block file"));
+                    oRes.push_back(oName);
+                    continue;
+                }
                 error("could not read txpos %s", txPos.ToString().c_str());
                 continue;
             }
@@ -1618,6 +1641,33 @@ name_pending (const Array& params, bool fHelp)
   return res;
 }
 
+/* Look up the game state at the given height of the snapshot's chain.
+   Older states may have to be read from disk or recomputed, which needs
+   cs_main.  */
+static void
+GetGameStateAtHeight (const CChainSnapshot& snapshot, int height,
+                      Game::GameState& state)
+{
+  CBlockIndex* pindex = NULL;
+  if (height != -1)
+    {
+      pindex = snapshot.GetAncestor (height);
+      if (!pindex)
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot find block at specified height");
+    }
+
+  CRITICAL_BLOCK(cs_main)
+    {
+      /* The snapshot's chain may have been reorganised away meanwhile.  */
+      if (pindex && !pindex->IsInMainChain ())
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Block at specified height is no longer in the main chain");
+
+      DatabaseSet dbset("r");
+      if (!GetGameState (dbset, pindex, state))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot compute game state at specified height");
+    }
+}
+
 Value game_getstate(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -1626,7 +1676,8 @@ Value game_getstate(const Array& params, bool fHelp)
                 "Returns game state, either the most recent one or at given height (-1 = initial state, 0 = state after genesis block, k = state after k-th block for k>0)\n"
                 );
 
-    int64 height = nBestHeight;
+    const CChainSnapshotRef snapshot = GetChainSnapshot ();
+    int64 height = snapshot->nHeight;
 
     if (params.size() > 0)
     {
@@ -1635,29 +1686,15 @@ Value game_getstate(const Array& params, bool fHelp)
     else if (IsInitialBlockDownload())
             throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "huntercoin is downloading blocks...");
 
-    if (height < -1 || height > nBestHeight)
+    if (height < -1 || height > snapshot->nHeight)
         throw JSONRPCError(RPC_INVALID_PARAMS, "Invalid height specified");
 
-    Game::GameState state;
-
-    CRITICAL_BLOCK(cs_main)
-    {
-        CBlockIndex* pindex;
-        if (height == -1)
-            pindex = NULL;
-        else
-        {
-            pindex = pindexBest;
-            while (pindex && pindex->nHeight > height)
-                pindex = pindex->pprev;
-            if (!pindex || pindex->nHeight != height)
-                throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot find block at specified height");
-        }
+    /* The current state is served without waiting for cs_main.  */
+    if (height == snapshot->nHeight && snapshot->pstate)
+        return snapshot->pstate->ToJsonValue();
 
-        DatabaseSet dbset("r");
-        if (!GetGameState (dbset, pindex, state))
-            throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot compute game state at specified height");
-    }
+    Game::GameState state;
+    GetGameStateAtHeight (*snapshot, height, state);
 
     return state.ToJsonValue();
 }
@@ -1681,17 +1718,20 @@ Value game_waitforchange (const Array& params, bool fHelp)
   if (params.size () > 0)
     lastHash = ParseHashV (params[0], "blockHash");
   else
-    lastHash = hashBestChain;
+    lastHash = GetChainSnapshot ()->hashBest;
 
   boost::unique_lock<boost::mutex> lock(mut_currentState);
   while (true)
     {
-      /* Atomically check whether we have found a new best block and return
-         it if that's the case.  We use a lock on cs_main in order to
-         prevent race conditions.  */
-      CRITICAL_BLOCK(cs_main)
+      /* Check whether we have found a new best block and return it if
+         that's the case.  The snapshot is published before the change is
+         signalled, and has the game state unless in initial download.  */
+      const CChainSnapshotRef snapshot = GetChainSnapshot ();
+      if (lastHash != snapshot->hashBest)
         {
-          if (lastHash != hashBestChain)
+          if (snapshot->pstate)
+            return snapshot->pstate->ToJsonValue ();
+          CRITICAL_BLOCK(cs_main)
             {
               const Game::GameState& state = GetCurrentGameState ();
               return state.ToJsonValue();
@@ -1711,7 +1751,8 @@ Value game_getplayerstate(const Array& params, bool fHelp)
                 "Returns player state. Similar to game_getstate, but filters the name.\n"
                 );
 
-    int64 height = nBestHeight;
+    const CChainSnapshotRef snapshot = GetChainSnapshot ();
+    int64 height = snapshot->nHeight;
 
     if (params.size() > 1)
     {
@@ -1721,29 +1762,17 @@ Value game_getplayerstate(const Array& params, bool fHelp)
             throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "huntercoin is downloading blocks...");
 
 
-    if (height < -1 || height > nBestHeight)
+    if (height < -1 || height > snapshot->nHeight)
         throw JSONRPCError(RPC_INVALID_PARAMS, "Invalid height specified");
 
-    Game::GameState state;
-
-    CRITICAL_BLOCK(cs_main)
-    {
-        CBlockIndex* pindex;
-        if (height == -1)
-            pindex = NULL;
-        else
-        {
-            pindex = pindexBest;
-            while (pindex && pindex->nHeight > height)
-                pindex = pindex->pprev;
-            if (!pindex || pindex->nHeight != height)
-                throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot find block at specified height");
-        }
-
-        DatabaseSet dbset("r");
-        if (!GetGameState (dbset, pindex, state))
-            throw JSONRPCError(RPC_DATABASE_ERROR, "Cannot compute game state at specified height");
-    }
+    Game::GameState stateAtHeight;
+    const Game::GameState* pstate = snapshot->pstate.get ();
+    if (height != snapshot->nHeight || !pstate)
+      {
+        GetGameStateAtHeight (*snapshot, height, stateAtHeight);
+        pstate = &stateAtHeight;
+      }
+    const Game::GameState& state = *pstate;
 
     Game::PlayerID player_name = params[0].get_str();
     std::map<Game::PlayerID, Game::PlayerState>::const_iterator mi = state.players.find(player_name);
@@ -1920,50 +1949,26 @@ bool CNameDB::ScanNames(
         vector<pair<vector<unsigned char>, CNameIndex> >& nameScan)
         //vector<pair<vector<unsigned char>, CDiskTxPos> >& nameScan)
 {
-    Dbc* pcursor = GetCursor();
-    if (!pcursor)
-        return false;
-
-    unsigned int fFlags = DB_SET_RANGE;
-    loop
-    {
-        // Read next record
-        CDataStream ssKey;
-        if (fFlags == DB_SET_RANGE)
-            ssKey << make_pair(string("namei"), vchName);
-        CDataStream ssValue;
-        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
-        fFlags = DB_NEXT;
-        if (ret == DB_NOTFOUND)
-            break;
-        else if (ret != 0)
-            return false;
-
+    CDBScan scan(*this, "namei", make_pair(string("namei"), vchName));
+    while (nameScan.size() < nMax && scan.Next())
+    {
         // Unserialize
-        string strType;
-        ssKey >> strType;
-        if (strType == "namei")
+        CMappedStream ssKey = scan.Key();
+        vector<unsigned char> vchName;
+        ssKey >> vchName;
+        //vector<CDiskTxPos> vtxPos;
+        vector<CNameIndex> vtxPos;
+        CMappedStream ssValue = scan.Value();
+        ssValue >> vtxPos;
+        //CDiskTxPos txPos;
+        CNameIndex txPos;
+        if (!vtxPos.empty())
         {
-            vector<unsigned char> vchName;
-            ssKey >> vchName;
-            string strName = stringFromVch(vchName);
-            //vector<CDiskTxPos> vtxPos;
-            vector<CNameIndex> vtxPos;
-            ssValue >> vtxPos;
-            //CDiskTxPos txPos;
-            CNameIndex txPos;
-            if (!vtxPos.empty())
-            {
-                txPos = vtxPos.back();
-            }
-            nameScan.push_back(make_pair(vchName, txPos));
+            txPos = vtxPos.back();
         }
-
-        if (nameScan.size() >= nMax)
-            break;
+        nameScan.push_back(make_pair(vchName, txPos));
     }
-    pcursor->close();
-    return true;
+    return scan.Ok();
 }
 
 /* Analyse the UTXO set.  This possibly takes a very long time.  */
@@ -2049,6 +2054,32 @@ analyseutxo (const Array& params, bool fHelp)
   return res;
 }
 
+/* Write the chain state at the best block to a snapshot file, which
+   another node can start from with -loadutxoset.  */
+static Value
+dumputxoset (const Array& params, bool fHelp)
+{
+  if (fHelp || params.size () != 1)
+    throw std::runtime_error (
+          "dumputxoset <file>\n"
+          "Write the UTXO set, name index and game state at the best block"
+          " to <file>.  Start a node with -loadutxoset=<file> to load it.");
+
+  CChainStateSnapshotInfo info;
+  if (!DumpChainStateSnapshot (params[0].get_str (), info))
+    throw JSONRPCError (RPC_MISC_ERROR,
+                        "failed to write the snapshot, see debug.log");
+
+  Object res;
+  res.push_back (Pair ("height", info.nHeight));
+  res.push_back (Pair ("blockhash", info.hashBlock.GetHex ()));
+  res.push_back (Pair ("num_utxo", static_cast<int> (info.nUtxo)));
+  res.push_back (Pair ("num_names", static_cast<int> (info.nNames)));
+  res.push_back (Pair ("hash", info.hashFile.GetHex ()));
+
+  return res;
+}
+
 bool CNameDB::ReconstructNameIndex()
 {
     CTxDB txdb("r");
@@ -2136,6 +2167,7 @@ bool CNameDB::ReconstructNameIndex()
 CHooks* InitHook()
 {
     mapCallTable.insert(make_pair("analyseutxo", &analyseutxo));
+    mapCallTable.insert(make_pair("dumputxoset", &dumputxoset));
     mapCallTable.insert(make_pair("name_new", &name_new));
     mapCallTable.insert(make_pair("name_update", &name_update));
     mapCallTable.insert(make_pair("name_firstupdate", &name_firstupdate));
@@ -2866,26 +2898,16 @@ CHuntercoinHooks::ConnectBlock (CBlock& block, DatabaseSet& dbset,
             unsigned nSize = GetSerializeSize (block.vgametx, SER_DISK);
             nSize += sizeof (pchMessageVGameTx);
 
-            unsigned nTotalSize = sizeof (pchMessageStart);
-            nTotalSize += sizeof (nSize) + nSize;
-
-            CAutoFile fileout = AppendBlockFile (dbset, block.nGameTxFile,
-                                                 nTotalSize);
-            if (!fileout)
-                return error("ConnectBlock hook : AppendBlockFile failed");
-            const unsigned startPos = ftell (fileout);
-            fileout << FLATDATA(pchMessageStart) << nSize << FLATDATA(pchMessageVGameTx);
-
-            block.nGameTxPos = ftell(fileout);
-            if (block.nGameTxPos == -1)
-                return error("ConnectBlock hook : ftell failed");
-            fileout << block.vgametx;
-
-            // Check that the total size estimate was correct.
-            if (ftell (fileout) - startPos != nTotalSize)
-              return error ("ConnectBlock hook: nTotalSize was wrong");
+            CDataStream ss(SER_DISK);
+            ss.reserve (sizeof (pchMessageStart) + sizeof (nSize) + nSize);
+            ss << FLATDATA(pchMessageStart) << nSize << FLATDATA(pchMessageVGameTx);
+            ss << block.vgametx;
 
-            FlushBlockFile(fileout);
+            unsigned nPos;
+            if (!blockfilewriter.Append (dbset.tx (), ss, pindex->nHeight,
+                                         block.nGameTxFile, nPos))
+                return error("ConnectBlock hook : appending to the block file failed");
+            block.nGameTxPos = nPos + sizeof (pchMessageStart) + sizeof (nSize) + sizeof (pchMessageVGameTx);
         }
 
         // Update block fields that were changed (because they depend on the game transactions, which were just computed)
@@ -2902,7 +2924,7 @@ CHuntercoinHooks::ConnectBlock (CBlock& block, DatabaseSet& dbset,
 
             fileout << block.nGameTxFile << block.nGameTxPos;
 
-            FlushBlockFile(fileout);
+            blockfilewriter.Written(fileout, pindex->nFile, sizeof(block.hashGameMerkleRoot) + sizeof(block.nGameTxFile) + sizeof(block.nGameTxPos));
         }
     }
 
@@ -14,6 +14,7 @@
 
 // playground -- includes
 #include "gamemap.h"
+#include "gamemovecreator.h"
 
 using namespace std;
 using namespace boost;
@@ -64,7 +65,9 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
         DBFlush(false);
         StopNode();
+        blockfilewriter.Close();
         DBFlush(true);
+        WriteBlockIndexSnapshot();
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
         delete pwalletMain;
@@ -191,6 +194,9 @@ int table1[RPG_MAP_HEIGHT + 1][RPG_MAP_WIDTH + 1];
 int table2[RPG_MAP_HEIGHT + 1][RPG_MAP_WIDTH + 1];
 int table3[RPG_MAP_HEIGHT + 1][RPG_MAP_WIDTH + 1];
 
+// dump intermediate map files to the working directory (map development only)
+static bool fWriteMapFiles = false;
+
 static bool save_obstaclemap()
 {
     FILE *fp2;
@@ -266,7 +272,6 @@ static bool Calculate_AsciiArtMap()
             AsciiArtMap[y][RPG_MAP_WIDTH] = '\0';
         }
         fclose(fp);
-        MilliSleep(20);
 
         FILE *fp_patch;
         fp_patch = fopen("asciiartpatch.txt", "r");
@@ -282,8 +287,7 @@ static bool Calculate_AsciiArtMap()
                 fgets(AsciiArtPatchMap[yp], columns+3, fp_patch);
                 AsciiArtPatchMap[yp][columns] = '\0';
             }
-            fclose(fp);
-            MilliSleep(20);
+            fclose(fp_patch);
 
             for (int yp = 0; yp < rows; yp++)
                 for (int xp = 0; xp < columns; xp++)
@@ -291,8 +295,8 @@ static bool Calculate_AsciiArtMap()
                         if (AsciiArtPatchMap[yp][xp] != '~')
                         AsciiArtMap[yul + yp][xul + xp] = AsciiArtPatchMap[yp][xp];
 
-            save_asciiartmap();
-            MilliSleep(20);
+            if (fWriteMapFiles)
+                save_asciiartmap();
 
             for (int y = 0; y < RPG_MAP_HEIGHT; y++)
             {
@@ -304,8 +308,8 @@ static bool Calculate_AsciiArtMap()
                 }
             }
 
-            save_obstaclemap();
-            MilliSleep(20);
+            if (fWriteMapFiles)
+                save_obstaclemap();
         }
 
 
@@ -339,12 +343,6 @@ static bool Calculate_AsciiArtMap()
                     if (AI_merchantbasemap[ya-1][xa-1] == AI_MBASEMAP_TP_EXIT_ACTIVE) { xul--; yul--; }
                     if (AI_merchantbasemap[ya+1][xa-1] == AI_MBASEMAP_TP_EXIT_ACTIVE) xul--;
                     if (AI_merchantbasemap[ya-1][xa+1] == AI_MBASEMAP_TP_EXIT_ACTIVE) yul--;
-#ifdef GUI
-                    Displaycache_gamemap[yul][xul][0] = 27;       //  Displaycache_gamemapgood[yul][xul] = 1;
-                    Displaycache_gamemap[yul][xul+1][0] = 29;     //  Displaycache_gamemapgood[yul][xul+1] = 1;
-                    Displaycache_gamemap[yul+1][xul][0] = 54;     //  Displaycache_gamemapgood[yul+1][xul] = 1;
-                    Displaycache_gamemap[yul+1][xul+1][0] = 55;   //  Displaycache_gamemapgood[yul+1][xul+1] = 1;
-#endif
                     AsciiArtMap[yul][xul] = '.';
                     AsciiArtMap[yul][xul+1] = '.';
 //                    if ( (!(ASCIIART_IS_TREE(AsciiArtMap[yul+2][xul+1]))) && (!(ASCIIART_IS_TREE(AsciiArtMap[yul+2][xul+2]))) )
@@ -523,7 +521,9 @@ static bool Calculate_AsciiArtMap()
                 }
             }
 
-        MilliSleep(20);
+        if (!fWriteMapFiles)
+            return true;
+
         fp = NULL;
         fp = fopen("asciiartobstaclemap502x502.txt", "w");
         if (fp == NULL)
@@ -668,7 +668,8 @@ static bool Calculate_AsciiArtMap()
         AsciiLogMap[y][RPG_MAP_WIDTH] = '\0';
         AsciiArtMap[y][RPG_MAP_WIDTH] = '\0';
     }
-    save_obstaclemap();
+    if (fWriteMapFiles)
+        save_obstaclemap();
 
     // dump new ascii art map
     for (int y = 0; y < RPG_MAP_HEIGHT; y++)
@@ -714,11 +715,12 @@ static bool Calculate_AsciiArtMap()
         }
         AsciiArtMap[y][RPG_MAP_WIDTH] = '\0';
     }
+    if (!fWriteMapFiles)
+        return true;
     save_asciiartmap();
 
 
     // merge the old map and parts of the random map (increase size from 502*502 to 542*512)
-    MilliSleep(20);
     fp = NULL;
     fp = fopen("asciiart502x502map.txt", "r");
     if (fp != NULL)
@@ -731,7 +733,6 @@ static bool Calculate_AsciiArtMap()
         }
         fclose(fp);
 
-        MilliSleep(20);
         FILE *fp3;
         fp3 = fopen("asciiartmergedmap.txt", "w");
         if (fp3 != NULL)
@@ -970,6 +971,312 @@ static void Calculate_distance_to_tiles()
 }
 
 
+#ifdef GUI
+static void Calculate_teleportpad_tiles()
+{
+    for (int poi = POIINDEX_TP_FIRST; poi <= POIINDEX_TP_LAST; poi++)
+    {
+        int xa = POI_pos_xa[poi];
+        int ya = POI_pos_ya[poi];
+        if ((xa > 1) && (ya > 1) && (xa < Game::MAP_WIDTH - 4) && (ya < Game::MAP_HEIGHT - 4))
+        {
+            int xul = xa;
+            int yul = ya;
+            if (AI_merchantbasemap[ya-1][xa-1] == AI_MBASEMAP_TP_EXIT_ACTIVE) { xul--; yul--; }
+            if (AI_merchantbasemap[ya+1][xa-1] == AI_MBASEMAP_TP_EXIT_ACTIVE) xul--;
+            if (AI_merchantbasemap[ya-1][xa+1] == AI_MBASEMAP_TP_EXIT_ACTIVE) yul--;
+            Displaycache_gamemap[yul][xul][0] = 27;       //  Displaycache_gamemapgood[yul][xul] = 1;
+            Displaycache_gamemap[yul][xul+1][0] = 29;     //  Displaycache_gamemapgood[yul][xul+1] = 1;
+            Displaycache_gamemap[yul+1][xul][0] = 54;     //  Displaycache_gamemapgood[yul+1][xul] = 1;
+            Displaycache_gamemap[yul+1][xul+1][0] = 55;   //  Displaycache_gamemapgood[yul+1][xul+1] = 1;
+        }
+    }
+}
+#endif
+
+//
+// Map bundle: everything derived from the static map and the ascii art files,
+// compiled once and stored in the data directory.  Rebuilt whenever any of
+// the inputs change (the key is a hash over all of them).
+//
+static const int MAP_BUNDLE_VERSION = 1;
+
+static void HashMapInputFile(CDataStream& ss, const char* pszFile)
+{
+    FILE* file = fopen(pszFile, "rb");
+    if (file == NULL)
+    {
+        ss << std::string(pszFile) << false;
+        return;
+    }
+    std::vector<char> vch;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0)
+        vch.insert(vch.end(), buf, buf + n);
+    fclose(file);
+    ss << std::string(pszFile) << true << vch;
+}
+
+static uint256 GetMapBundleKey()
+{
+    CDataStream ss(SER_DISK);
+    ss << FLATDATA(Game::ObstacleMap);
+    ss << FLATDATA(POI_pos_xa) << FLATDATA(POI_pos_ya) << FLATDATA(POI_pos_xb) << FLATDATA(POI_pos_yb) << FLATDATA(POI_type);
+    ss << FLATDATA(Merchant_base_x) << FLATDATA(Merchant_base_y);
+    HashMapInputFile(ss, "asciiartmap.txt");
+    HashMapInputFile(ss, "asciiartpatch.txt");
+    HashMapInputFile(ss, "asciiart502x502map.txt");
+    return Hash(ss.begin(), ss.end());
+}
+
+static std::string GetMapBundlePath()
+{
+    return GetDataDir() + "/mapbundle.dat";
+}
+
+static bool LoadMapBundle(const uint256& hashKey)
+{
+    CAutoFile filein = fopen(GetMapBundlePath().c_str(), "rb");
+    if (!filein)
+        return false;
+
+    try
+    {
+        int nVersion;
+        uint256 hashFile;
+        filein >> nVersion >> hashFile;
+        if (nVersion != MAP_BUNDLE_VERSION || hashFile != hashKey)
+        {
+            printf("LoadMapBundle() : map bundle is stale, rebuilding\n");
+            return false;
+        }
+        filein >> FLATDATA(Distance_To_POI);
+        filein >> FLATDATA(AI_merchantbasemap);
+        filein >> FLATDATA(AsciiArtMap);
+        filein >> FLATDATA(AsciiArtTileCount);
+        filein >> FLATDATA(RPGMonsterPitMap);
+    }
+    catch (std::exception &e) {
+        printf("LoadMapBundle() : I/O error reading map bundle\n");
+        return false;
+    }
+    return true;
+}
+
+static bool SaveMapBundle(const uint256& hashKey)
+{
+    // write to a temporary file first so an interrupted write never leaves
+    // a bundle with a valid header but truncated payload
+    std::string strPath = GetMapBundlePath();
+    std::string strTmp = strPath + ".new";
+    CAutoFile fileout = fopen(strTmp.c_str(), "wb");
+    if (!fileout)
+        return false;
+
+    try
+    {
+        fileout << MAP_BUNDLE_VERSION << hashKey;
+        fileout << FLATDATA(Distance_To_POI);
+        fileout << FLATDATA(AI_merchantbasemap);
+        fileout << FLATDATA(AsciiArtMap);
+        fileout << FLATDATA(AsciiArtTileCount);
+        fileout << FLATDATA(RPGMonsterPitMap);
+    }
+    catch (std::exception &e) {
+        printf("SaveMapBundle() : I/O error writing map bundle\n");
+        fileout.fclose();
+        boost::filesystem::remove(strTmp);
+        return false;
+    }
+    fileout.fclose();
+
+    try
+    {
+        boost::filesystem::remove(strPath);
+        boost::filesystem::rename(strTmp, strPath);
+    }
+    catch (boost::filesystem::filesystem_error &e) {
+        printf("SaveMapBundle() : %s\n", e.what());
+        return false;
+    }
+    return true;
+}
+
+//
+// Startup tasks: independent parts of initialisation run concurrently,
+// each one waiting only for the tasks it depends on.
+//
+class CStartupTask
+{
+public:
+    const char* pszName;
+    void (*pfn)(CStartupTask* ptask);
+    std::vector<CStartupTask*> vDepends;
+    int64 nStartTime;
+    int64 nEndTime;
+    bool fDone;
+    std::string strError;
+    std::string strException;
+
+    CStartupTask(const char* pszNameIn, void (*pfnIn)(CStartupTask*))
+      : pszName(pszNameIn), pfn(pfnIn), nStartTime(0), nEndTime(0), fDone(false)
+    {
+    }
+
+    void DependsOn(CStartupTask& task)
+    {
+        vDepends.push_back(&task);
+    }
+};
+
+static boost::mutex mutexStartupTasks;
+static boost::condition_variable condStartupTasks;
+
+static void ThreadStartupTask(CStartupTask* ptask)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexStartupTasks);
+        BOOST_FOREACH(CStartupTask* pdep, ptask->vDepends)
+            while (!pdep->fDone)
+                condStartupTasks.wait(lock);
+    }
+
+    ptask->nStartTime = GetTimeMillis();
+    try
+    {
+        ptask->pfn(ptask);
+    }
+    catch (std::exception& e) {
+        ptask->strException = e.what();
+    }
+    catch (...) {
+        ptask->strException = "unknown exception";
+    }
+
+    {
+        boost::lock_guard<boost::mutex> lock(mutexStartupTasks);
+        ptask->nEndTime = GetTimeMillis();
+        ptask->fDone = true;
+    }
+    condStartupTasks.notify_all();
+}
+
+// Run the tasks and return when all of them have finished.  Tasks must be
+// listed after everything they depend on.
+static void RunStartupTasks(const std::vector<CStartupTask*>& vTasks)
+{
+    int64 nStart = GetTimeMillis();
+    boost::thread_group threads;
+    BOOST_FOREACH(CStartupTask* ptask, vTasks)
+        threads.create_thread(boost::bind(&ThreadStartupTask, ptask));
+    threads.join_all();
+
+    printf("Startup tasks:\n");
+    CStartupTask* plast = NULL;
+    BOOST_FOREACH(CStartupTask* ptask, vTasks)
+    {
+        printf(" %-12s start %6"PRI64d"ms  run %6"PRI64d"ms\n", ptask->pszName,
+               ptask->nStartTime - nStart, ptask->nEndTime - ptask->nStartTime);
+        if (plast == NULL || ptask->nEndTime > plast->nEndTime)
+            plast = ptask;
+    }
+
+    // Walk back from the task that finished last, each time through the
+    // dependency that held it up the longest
+    std::string strPath;
+    for (CStartupTask* ptask = plast; ptask != NULL; )
+    {
+        strPath = std::string(ptask->pszName) + strprintf(" (%"PRI64d"ms)", ptask->nEndTime - ptask->nStartTime) +
+                  (strPath.empty() ? "" : " -> ") + strPath;
+        CStartupTask* pprev = NULL;
+        BOOST_FOREACH(CStartupTask* pdep, ptask->vDepends)
+            if (pprev == NULL || pdep->nEndTime > pprev->nEndTime)
+                pprev = pdep;
+        ptask = pprev;
+    }
+    if (plast)
+        printf(" critical path: %s = %"PRI64d"ms\n", strPath.c_str(), plast->nEndTime - nStart);
+
+    BOOST_FOREACH(CStartupTask* ptask, vTasks)
+        if (!ptask->strException.empty())
+            throw runtime_error(strprintf("startup task %s: %s", ptask->pszName, ptask->strException.c_str()));
+}
+
+static bool fNeedUtxoRescan = false;
+static bool fFirstRun = false;
+
+static void StartupMapTables(CStartupTask* ptask)
+{
+    // Tasks that step the game state wait for the tables; release them on
+    // failure too, so startup reports the error instead of hanging
+    try
+    {
+        fWriteMapFiles = GetBoolArg("-writemapfiles");
+        uint256 hashMapBundle = GetMapBundleKey();
+        if (fWriteMapFiles || !LoadMapBundle(hashMapBundle))
+        {
+            Calculate_distance_to_POI();
+            Calculate_merchantbasemap();
+            Calculate_AsciiArtMap();
+            if (!SaveMapBundle(hashMapBundle))
+                printf("StartupMapTables() : failed to write map bundle\n");
+        }
+        Calculate_distance_to_tiles();
+#ifdef GUI
+        Calculate_teleportpad_tiles();
+#endif
+        Game::SetMonsterPitBits();
+    }
+    catch (...)
+    {
+        Game::SetMapTablesReady(false);
+        throw;
+    }
+    Game::SetMapTablesReady();
+    InitPathAbstraction();
+}
+
+static void StartupAddresses(CStartupTask* ptask)
+{
+    if (!LoadAddresses())
+        ptask->strError = _("Error loading addr.dat      \n");
+}
+
+static void StartupBlockIndex(CStartupTask* ptask)
+{
+    if (!LoadBlockIndex())
+        ptask->strError = _("Error loading blkindex.dat      \n");
+}
+
+static void StartupUtxoRescan(CStartupTask* ptask)
+{
+    /* Now that the block index is loaded, perform the UTXO
+       set rescan if necessary.  */
+    if (fNeedUtxoRescan)
+      {
+        if (nBlockPruneHeight >= 0)
+          {
+            ptask->strError = _("Cannot rebuild utxo.dat, blocks have been pruned      \n");
+            return;
+          }
+        CUtxoDB db("r+");
+        db.Rescan ();
+      }
+}
+
+static void StartupGameDB(CStartupTask* ptask)
+{
+    if (!UpgradeGameDB())
+        printf("ERROR: GameDB update failed\n");
+}
+
+static void StartupWallet(CStartupTask* ptask)
+{
+    if (!pwalletMain->LoadWallet(fFirstRun))
+        ptask->strError = "Error loading " + GetArg("-walletpath", "wallet.dat") + "      \n";
+}
+
 bool AppInit2(int argc, char* argv[])
 {
 #ifdef _MSC_VER
@@ -1216,6 +1523,40 @@ bool AppInit2(int argc, char* argv[])
         }
     }
 
+    // Pruned nodes keep only recent blocks, so they offer neither the chain
+    // nor its headers (those are read from the block files too)
+    nPruneTarget = GetArg("-prune", 0) * 1024 * 1024;
+    if (nPruneTarget > 0)
+    {
+        if (nPruneTarget < MIN_PRUNE_TARGET)
+        {
+            wxMessageBox(strprintf(_("-prune must be at least %"PRI64d" MB"), MIN_PRUNE_TARGET / (1024 * 1024)), "Huntercoin");
+            return false;
+        }
+        nLocalServices &= ~(uint64)(NODE_NETWORK | NODE_HEADERS);
+        addrLocalHost.nServices = nLocalServices;
+        printf("Pruning block files to %"PRI64d" MB\n", nPruneTarget / (1024 * 1024));
+    }
+
+    // The block index and chain state are rebuilt from the block files by
+    // LoadBlockIndex, which also fills the name index and UTXO set; with a
+    // chain state snapshot (-loadutxoset), only from the snapshot's block on
+    fReindex = GetBoolArg("-reindex");
+    if (mapArgs.count("-loadutxoset"))
+    {
+        if (!OpenChainStateSnapshot(mapArgs["-loadutxoset"]))
+        {
+            wxMessageBox(_("Cannot load the chain state snapshot, see debug.log"), "Huntercoin");
+            return false;
+        }
+        fReindex = true;
+    }
+    if (fReindex && !RemoveChainState())
+    {
+        wxMessageBox(_("Cannot reindex the block files, see debug.log"), "Huntercoin");
+        return false;
+    }
+
     hooks = InitHook();
 
     //
@@ -1227,15 +1568,6 @@ bool AppInit2(int argc, char* argv[])
     int64 nStart;
 
 
-    // playground -- calculate distances
-    nStart = GetTimeMillis();
-    Calculate_distance_to_POI();
-    Calculate_distance_to_tiles();
-    Calculate_merchantbasemap();
-    Calculate_AsciiArtMap();
-    printf("AI initialized %15"PRI64d"ms\n", GetTimeMillis() - nStart);
-
-
     /* Start the RPC server already here.  This is to make it available
        "immediately" upon starting the daemon process.  Until everything
        is initialised, it will always just return a "status error" and
@@ -1243,13 +1575,6 @@ bool AppInit2(int argc, char* argv[])
     if (fServer)
         CreateThread(ThreadRPCServer, NULL);
 
-    rpcWarmupStatus = "loading addresses";
-    printf("Loading addresses...\n");
-    nStart = GetTimeMillis();
-    if (!LoadAddresses())
-        strErrors += _("Error loading addr.dat      \n");
-    printf(" addresses   %15"PRI64d"ms\n", GetTimeMillis() - nStart);
-
     /* See if the name index exists and create at least the database file
        if not.  This is necessary so that DatabaseSet can be used without
        failing due to a missing file in LoadBlockIndex.  */
@@ -1258,61 +1583,63 @@ bool AppInit2(int argc, char* argv[])
       filesystem::path nmindex;
       nmindex = filesystem::path (GetDataDir ()) / "nameindexfull.dat";
 
-      if (!filesystem::exists (nmindex))
+      if (!filesystem::exists (nmindex) && !fReindex)
         needNameRescan = true;
 
       CNameDB dbName("cr+");
     }
 
     /* Do the same for the UTXO database.  */
-    bool needUtxoRescan = false;
     {
       filesystem::path utxofile = filesystem::path(GetDataDir()) / "utxo.dat";
-      if (!filesystem::exists(utxofile))
-        needUtxoRescan = true;
+      if (!filesystem::exists(utxofile) && !fReindex)
+        fNeedUtxoRescan = true;
 
       CUtxoDB db("cr+");
     }
 
-    /* Load block index.  */
-    rpcWarmupStatus = "loading block index";
-    printf("Loading block index...\n");
-    nStart = GetTimeMillis();
-    if (!LoadBlockIndex())
-        strErrors += _("Error loading blkindex.dat      \n");
-    printf(" block index %15"PRI64d"ms\n", GetTimeMillis() - nStart);
-
-    /* Now that hte block index is loaded, perform the UTXO
-       set rescan if necessary.  */
-    if (needUtxoRescan)
-      {
-        CUtxoDB db("r+");
-        rpcWarmupStatus = "rescanning for utxo set";
-        db.Rescan ();
-      }
-
-    rpcWarmupStatus = "upgrading game db";
-    if (!UpgradeGameDB())
-        printf("ERROR: GameDB update failed\n");
-
-    rpcWarmupStatus = "loading wallet";
-    printf("Loading wallet...\n");
-    nStart = GetTimeMillis();
-    bool fFirstRun;
     string argWalletPath = GetArg("-walletpath", "wallet.dat");
     boost::filesystem::path pathWalletFile(argWalletPath);
     walletPath = pathWalletFile.string();
-    
     pwalletMain = new CWallet(walletPath);
-    if (!pwalletMain->LoadWallet(fFirstRun))
-      strErrors += "Error loading " + argWalletPath + "      \n";
-    
-    printf(" wallet      %15"PRI64d"ms\n", GetTimeMillis() - nStart);
+
+    /* The map tables are pure computation and the other tasks are mostly
+       database I/O, so they overlap well.  Only the game DB upgrade runs
+       game steps and needs the map tables (PerformStep also waits for them,
+       in case LoadBlockIndex has to connect or reorganise blocks).  */
+    CStartupTask taskMapTables("map tables", StartupMapTables);
+    CStartupTask taskAddresses("addresses", StartupAddresses);
+    CStartupTask taskBlockIndex("block index", StartupBlockIndex);
+    CStartupTask taskUtxoRescan("utxo rescan", StartupUtxoRescan);
+    CStartupTask taskGameDB("game db", StartupGameDB);
+    CStartupTask taskWallet("wallet", StartupWallet);
+    taskUtxoRescan.DependsOn(taskBlockIndex);
+    taskGameDB.DependsOn(taskUtxoRescan);
+    taskGameDB.DependsOn(taskMapTables);
+
+    std::vector<CStartupTask*> vTasks;
+    vTasks.push_back(&taskMapTables);
+    vTasks.push_back(&taskAddresses);
+    vTasks.push_back(&taskBlockIndex);
+    vTasks.push_back(&taskUtxoRescan);
+    vTasks.push_back(&taskGameDB);
+    vTasks.push_back(&taskWallet);
+
+    StartScriptCheckThreads();
+    StartBlockFileSync();
+
+    rpcWarmupStatus = "loading block index and wallet";
+    printf("Loading block index, wallet, addresses and map tables...\n");
+    RunStartupTasks(vTasks);
+    BOOST_FOREACH(CStartupTask* ptask, vTasks)
+        strErrors += ptask->strError;
 
     RegisterWallet(pwalletMain);
 
     /* Rescan for name index now if we need to do it.  */
-    if (needNameRescan)
+    if (needNameRescan && nBlockPruneHeight >= 0)
+      strErrors += _("Cannot rebuild nameindexfull.dat, blocks have been pruned      \n");
+    else if (needNameRescan)
       {
         rpcWarmupStatus = "rescanning for names";
         rescanfornames ();
@@ -1343,6 +1670,8 @@ bool AppInit2(int argc, char* argv[])
     if (pindexBest != pindexRescan)
     {
         printf("Rescanning last %i blocks (from block %i)...\n", pindexBest->nHeight - pindexRescan->nHeight, pindexRescan->nHeight);
+        if (pindexRescan->nHeight <= nBlockPruneHeight)
+            printf("WARNING: blocks up to height %d have been pruned, the rescan skips them\n", nBlockPruneHeight);
         nStart = GetTimeMillis();
         pwalletMain->ScanForWalletTransactions(pindexRescan, true);
         printf(" rescan      %15"PRI64d"ms\n", GetTimeMillis() - nStart);
@@ -1369,6 +1698,10 @@ bool AppInit2(int argc, char* argv[])
     rpcWarmupStatus = "reaccept wallet transactions";
     pwalletMain->ReacceptWalletTransactions();
 
+    // Check a snapshot loaded with -loadutxoset against the blocks
+    if (GetBoolArg("-verifyutxoset"))
+        StartChainStateSnapshotVerify();
+
     //
     // Parameters
     //
@@ -1389,7 +1722,7 @@ bool AppInit2(int argc, char* argv[])
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (CBlockIndexMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -1506,10 +1839,22 @@ std::string HelpMessage()
         "  -min             \t\t  " + _("Start minimized\n") +
         "  -datadir=<dir>   \t\t  " + _("Specify data directory\n") +
         "  -dbcache=<n>     \t\t  " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -utxocache=<n>   \t\t  " + _("Set in-memory UTXO cache size in megabytes (default: 32)") + "\n" +
+        "  -dbbatchsize=<n> \t\t  " + _("Commit up to <n> blocks at once during initial download (default: 500)") + "\n" +
+        "  -dbbatchinterval=<n>\t  " + _("Commit blocks of the initial download at least every <n> seconds (default: 30)") + "\n" +
         "  -dblogsize=<n>   \t\t  " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
+        "  -mmapblocks      \t\t  " + _("Read blocks from memory mapped block files (default: 1 on 64 bit systems)") + "\n" +
+        "  -syncblocks=<n>  \t\t  " + _("Sync block files to disk: 0 never, 1 grouped in the background, 2 after every block (default: 1)") + "\n" +
+        "  -prune=<n>       \t\t  " + _("Delete old block files to keep them below <n> megabytes (at least 550); the last day of blocks and the game and name state are kept") + "\n" +
+        "  -reindex         \t\t  " + _("Rebuild the block index and the chain state from the blk*.dat files") + "\n" +
+        "  -loadutxoset=<file>\t  " + _("Reindex, taking the chain state up to its block from a dumputxoset file") + "\n" +
+        "  -verifyutxoset   \t\t  " + _("Verify the UTXO set loaded with -loadutxoset against the blocks in the background (the name index and game state are not checked)") + "\n" +
+        "  -par=<n>         \t\t  " + _("Number of script and block verification threads (default: number of cores - 1)") + "\n" +
+        "  -maxsigcachesize=<n>\t  " + _("Number of verified signatures to keep in memory (default: 50000)") + "\n" +
         "  -timeout=<n>     \t  "   + _("Specify connection timeout (in milliseconds)\n") +
         "  -proxy=<ip:port> \t  "   + _("Connect through socks4 proxy\n") +
         "  -dns             \t  "   + _("Allow DNS lookups for addnode and connect\n") +
+        "  -headersfirst    \t  "   + _("Download headers first, then blocks from several peers in parallel (default: 1)") + "\n" +
         "  -addnode=<ip>    \t  "   + _("Add a node to connect to\n") +
         "  -connect=<ip>    \t\t  " + _("Connect only to the specified node\n") +
         "  -nolisten        \t  "   + _("Don't accept connections from outside\n") +
@@ -1540,6 +1885,7 @@ std::string HelpMessage()
         "  -keypool=<n>     \t  "   + _("Set key pool size to <n> (default: 100)\n") +
         "  -noaddressreuse  \t  "   + _("Avoid address reuse for game moves\n") +
         "  -rescan          \t  "   + _("Rescan the block chain for missing wallet transactions\n") +
+        "  -writemapfiles   \t  "   + _("Rebuild the map bundle and dump the intermediate ascii art map files\n") +
         "  -algo=<algo>     \t  "   + _("Mining algorithm: sha256d or scrypt. Also affects getdifficulty.\n");
 
 #ifdef USE_SSL
@@ -8,9 +8,12 @@
 #include "auxpow.h"
 #include "cryptopp/sha.h"
 #include "gamedb.h"
+#include "gamestate.h"
 #include "huntercoin.h"
+#include "checkqueue.h"
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
 
 #include <cassert>
 
@@ -24,17 +27,236 @@ using namespace boost;
 CCriticalSection cs_setpwalletRegistered;
 set<CWallet*> setpwalletRegistered;
 
-CCriticalSection cs_main;
+CCriticalSection cs_main("cs_main");
 
 // Game can append transactions to the block file
-CCriticalSection cs_AppendBlockFile;
+CCriticalSection cs_AppendBlockFile("cs_AppendBlockFile");
 
 map<uint256, CTransaction> mapTransactions;
-CCriticalSection cs_mapTransactions;
+CCriticalSection cs_mapTransactions("cs_mapTransactions");
 unsigned int nTransactionsUpdated = 0;
+// Bumped from the script and block check threads too, hence atomic
+boost::detail::atomic_count nHashCacheHits(0);
 map<COutPoint, CInPoint> mapNextTx;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+// Memory pool transactions as seen by CreateNewBlock: size, fee and the
+// inputs' contribution to priority, the in-pool transactions each one
+// depends on, and an index by fee rate.  Transactions are added and removed
+// together with mapTransactions (under cs_mapTransactions); their inputs are
+// looked up lazily in Update, only for new transactions and those whose
+// parents changed.
+class CMemPoolEntry
+{
+public:
+    CTransaction* ptx;
+    unsigned int nTxSize;
+    int nSigOps;
+
+    // Fee and fee per kB; valid unless fDirty or fMissingInputs
+    int64 nFee;
+    int64 nFeeRate;
+
+    // Sums over confirmed inputs of value and value * height, from which
+    // the priority at any chain height follows
+    double dValueIn;
+    double dValueHeight;
+
+    // Inputs neither in the UTXO set nor in the pool
+    bool fMissingInputs;
+    bool fDirty;
+
+    set<uint256> setParents;
+    set<uint256> setChildren;
+
+    CMemPoolEntry(CTransaction* ptxIn)
+    {
+        ptx = ptxIn;
+        nTxSize = ::GetSerializeSize(*ptx, SER_NETWORK);
+        nSigOps = ptx->GetSigOpCount();
+        nFee = nFeeRate = 0;
+        dValueIn = dValueHeight = 0;
+        fMissingInputs = false;
+        fDirty = true;
+    }
+
+    // Priority is sum(valuein * age) / txsize, where inputs from the pool
+    // count as not confirmed yet
+    double GetPriority(int nHeight) const
+    {
+        return (dValueIn * (nHeight + 1) - dValueHeight) / nTxSize;
+    }
+};
+
+class CMemPoolIndex
+{
+private:
+    map<uint256, CMemPoolEntry> mapEntries;
+    multimap<int64, CMemPoolEntry*> mapByFeeRate;
+    set<uint256> setDirty;
+
+    // Best block the confirmed inputs were looked up at
+    CBlockIndex* pindexUpdated;
+
+    void Unindex(CMemPoolEntry& entry)
+    {
+        if (entry.fDirty || entry.fMissingInputs)
+            return;
+        multimap<int64, CMemPoolEntry*>::iterator mi = mapByFeeRate.lower_bound(entry.nFeeRate);
+        for (; mi != mapByFeeRate.end() && mi->first == entry.nFeeRate; ++mi)
+            if (mi->second == &entry)
+            {
+                mapByFeeRate.erase(mi);
+                break;
+            }
+    }
+
+    void MarkDirty(CMemPoolEntry& entry)
+    {
+        Unindex(entry);
+        entry.fDirty = true;
+        setDirty.insert(entry.ptx->GetHash());
+    }
+
+    void Recompute(DatabaseSet& dbset, CMemPoolEntry& entry)
+    {
+        const CTransaction& tx = *entry.ptx;
+        const uint256 hash = tx.GetHash();
+        BOOST_FOREACH(const uint256& hashParent, entry.setParents)
+        {
+            map<uint256, CMemPoolEntry>::iterator mi = mapEntries.find(hashParent);
+            if (mi != mapEntries.end())
+                mi->second.setChildren.erase(hash);
+        }
+        entry.setParents.clear();
+
+        int64 nValueIn = 0;
+        entry.dValueIn = entry.dValueHeight = 0;
+        entry.fMissingInputs = false;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            map<uint256, CMemPoolEntry>::iterator mi = mapEntries.find(txin.prevout.hash);
+            if (mi != mapEntries.end())
+            {
+                const CTransaction& txParent = *mi->second.ptx;
+                if (txin.prevout.n >= txParent.vout.size())
+                {
+                    entry.fMissingInputs = true;
+                    continue;
+                }
+                nValueIn += txParent.vout[txin.prevout.n].nValue;
+                entry.setParents.insert(txin.prevout.hash);
+                mi->second.setChildren.insert(hash);
+                continue;
+            }
+
+            CUtxoEntry txo;
+            if (!dbset.utxo().ReadUtxo(txin.prevout, txo))
+            {
+                entry.fMissingInputs = true;
+                continue;
+            }
+            nValueIn += txo.txo.nValue;
+            entry.dValueIn += static_cast<double>(txo.txo.nValue);
+            entry.dValueHeight += static_cast<double>(txo.txo.nValue) * txo.height;
+        }
+
+        entry.nFee = nValueIn - tx.GetValueOut();
+        entry.nFeeRate = entry.nFee * 1000 / entry.nTxSize;
+        entry.fDirty = false;
+        if (!entry.fMissingInputs)
+            mapByFeeRate.insert(make_pair(entry.nFeeRate, &entry));
+    }
+
+public:
+    CMemPoolIndex() : pindexUpdated(NULL)
+    {
+    }
+
+    void Add(CTransaction* ptx)
+    {
+        const uint256 hash = ptx->GetHash();
+        mapEntries.insert(make_pair(hash, CMemPoolEntry(ptx)));
+        setDirty.insert(hash);
+
+        // Transactions already in the pool may spend it, e.g. after a
+        // reorganisation put it back
+        for (unsigned int i = 0; i < ptx->vout.size(); i++)
+        {
+            map<COutPoint, CInPoint>::iterator mi = mapNextTx.find(COutPoint(hash, i));
+            if (mi == mapNextTx.end())
+                continue;
+            map<uint256, CMemPoolEntry>::iterator miChild = mapEntries.find(mi->second.ptx->GetHash());
+            if (miChild != mapEntries.end() && miChild->first != hash)
+                MarkDirty(miChild->second);
+        }
+    }
+
+    void Remove(const uint256& hash)
+    {
+        map<uint256, CMemPoolEntry>::iterator mi = mapEntries.find(hash);
+        if (mi == mapEntries.end())
+            return;
+        CMemPoolEntry& entry = mi->second;
+        Unindex(entry);
+
+        // Children either follow it into a block or lost their inputs
+        BOOST_FOREACH(const uint256& hashChild, entry.setChildren)
+        {
+            map<uint256, CMemPoolEntry>::iterator miChild = mapEntries.find(hashChild);
+            if (miChild != mapEntries.end())
+                MarkDirty(miChild->second);
+        }
+        BOOST_FOREACH(const uint256& hashParent, entry.setParents)
+        {
+            map<uint256, CMemPoolEntry>::iterator miParent = mapEntries.find(hashParent);
+            if (miParent != mapEntries.end())
+                miParent->second.setChildren.erase(hash);
+        }
+        setDirty.erase(hash);
+        mapEntries.erase(mi);
+    }
+
+    // Look up the inputs of changed transactions.  Confirmed inputs stay at
+    // their height as long as the chain only grows by one block at a time;
+    // anything else (several blocks, reorganisations) redoes all of them.
+    void Update(DatabaseSet& dbset, CBlockIndex* pindexPrev)
+    {
+        if (pindexPrev != pindexUpdated
+            && (pindexPrev == NULL || pindexPrev->pprev != pindexUpdated))
+        {
+            for (map<uint256, CMemPoolEntry>::iterator mi = mapEntries.begin(); mi != mapEntries.end(); ++mi)
+                MarkDirty(mi->second);
+        }
+        pindexUpdated = pindexPrev;
+
+        BOOST_FOREACH(const uint256& hash, setDirty)
+        {
+            map<uint256, CMemPoolEntry>::iterator mi = mapEntries.find(hash);
+            if (mi != mapEntries.end())
+                Recompute(dbset, mi->second);
+        }
+        setDirty.clear();
+    }
+
+    CMemPoolEntry* Get(const uint256& hash)
+    {
+        map<uint256, CMemPoolEntry>::iterator mi = mapEntries.find(hash);
+        if (mi == mapEntries.end())
+            return NULL;
+        return &mi->second;
+    }
+
+    // Highest fee rate first
+    typedef multimap<int64, CMemPoolEntry*>::reverse_iterator iterator;
+    iterator begin() { return mapByFeeRate.rbegin(); }
+    iterator end() { return mapByFeeRate.rend(); }
+};
+
+static CMemPoolIndex mempoolindex;
+
+CBlockIndexMap mapBlockIndex;
+static CBlockIndexArena blockIndexArena;
+static bool fBlockIndexLoaded = false;  // completely in memory, see WriteBlockIndexSnapshot
 uint256 hashGenesisBlock;
 // playground -- lower start difficulty
 //CBigNum bnProofOfWorkLimit[NUM_ALGOS] = { CBigNum(~uint256(0) >> 32), CBigNum(~uint256(0) >> 20) };
@@ -44,11 +266,13 @@ CBigNum bnInitialHashTarget[NUM_ALGOS] = { CBigNum(~uint256(0) >> 24), CBigNum(~
 const int nInitialBlockThreshold = 0; // Regard blocks up until N-threshold as "initial download"
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
-CBigNum bnBestChainWork = 0;
-CBigNum bnBestInvalidWork = 0;
+uint256 nBestChainWork = 0;
+uint256 nBestInvalidWork = 0;
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
 int64 nTimeBestReceived = 0;
+// Bodies of main chain blocks up to this height may have been pruned
+int nBlockPruneHeight = -1;
 int miningAlgo = ALGO_SHA256D;
 
 CMedianFilter<int> cPeerBlockCounts(8, 0); // Amount of blocks that other nodes claim to have
@@ -56,12 +280,28 @@ CMedianFilter<int> cPeerBlockCounts(8, 0); // Amount of blocks that other nodes
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 
+// Headers-first sync: headers we have validated but don't have the block
+// for yet.  These index objects are not in mapBlockIndex, but their pprev
+// chain always ends in it.
+static map<uint256, CBlockIndex*> mapHeaderIndex;
+static multimap<uint256, CBlockIndex*> mapHeaderIndexByPrev;
+static CBlockIndex* pindexBestHeader = NULL;
+
+// Best header chain beyond our blocks, in order, and how far we got
+static vector<uint256> vHeaderPath;
+static unsigned int nHeaderPathPos = 0;
+
+// Blocks requested by headers-first sync and when the requests time out
+static map<uint256, int64> mapBlocksInFlight;
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+static const unsigned int MAX_BLOCKS_IN_FLIGHT_PER_PEER = 16;
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+static const int64 BLOCK_DOWNLOAD_TIMEOUT = 60;
+
 map<uint256, CDataStream*> mapOrphanTransactions;
 multimap<uint256, CDataStream*> mapOrphanTransactionsByPrev;
 
 const std::string strMessageMagic = "Bitcoin Signed Message:\n";
-static const unsigned BLOCKFILE_MAX_SIZE = 0x7F000000;
-static const unsigned BLOCKFILE_CHUNK_SIZE = 16 * (1 << 20);
 
 double dHashesPerSec;
 int64 nHPSTimerStart;
@@ -79,10 +319,176 @@ int fUseUPnP = true;
 #else
 int fUseUPnP = false;
 #endif
+int64 nPruneTarget = 0;
+bool fReindex = false;
 
 
 CHooks* hooks;
 
+// Signature checks of ConnectBlock and AcceptToMemoryPool run on these
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static int nScriptCheckThreads = 0;
+
+// A block received during initial download, on its way through the
+// context-free checks.  Blocks of -reindex have no node; they are read from
+// the block files by the check thread first.
+class CBlockCheckJob
+{
+public:
+    CNode* pfrom;
+    CBlock block;
+    unsigned int nFile;
+    unsigned int nBlockPos;
+    bool fDone;
+    bool fOk;
+
+    CBlockCheckJob(CNode* pfromIn, const CBlock& blockIn) : pfrom(pfromIn), block(blockIn), nFile(-1), nBlockPos(0), fDone(false), fOk(false)
+    {
+    }
+
+    CBlockCheckJob(unsigned int nFileIn, unsigned int nBlockPosIn) : pfrom(NULL), nFile(nFileIn), nBlockPos(nBlockPosIn), fDone(false), fOk(false)
+    {
+    }
+
+    bool Run()
+    {
+        if (pfrom == NULL)
+        {
+            try
+            {
+                if (!ReadFromBlockFile(nFile, nBlockPos, block))
+                    return error("CBlockCheckJob() : reading blk%04u.dat at %u failed", nFile, nBlockPos);
+            }
+            catch (std::exception& e)
+            {
+                return error("CBlockCheckJob() : deserialising blk%04u.dat at %u failed: %s", nFile, nBlockPos, e.what());
+            }
+            // known by its hash
+            if (block.GetHash() == hashGenesisBlock)
+                return true;
+        }
+        return block.CheckBlock(INT_MAX);
+    }
+};
+
+// Block check queue for the initial download.  CheckBlock (scrypt PoW,
+// auxpow, merkle root, transaction sanity) runs on worker threads without
+// cs_main while the message handler thread connects earlier blocks.
+// Checked blocks are handed back in the order they were received.  This is
+// the only stage taken off that thread: the game step and the DB commit
+// still run in order inside ConnectBlock/CommitBlockBatch, since both need
+// the previous block's game state and chain DB writes.
+class CBlockCheckPipeline
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condWorker;
+    boost::condition_variable condDone;
+
+    std::deque<CBlockCheckJob*> queue;
+    unsigned int nNextToCheck;
+    std::set<uint256> setQueued;
+    unsigned int nMaxQueued;
+    bool fQuit;
+
+public:
+    CBlockCheckPipeline(unsigned int nMaxQueuedIn) : nNextToCheck(0), nMaxQueued(nMaxQueuedIn), fQuit(false)
+    {
+    }
+
+    // Returns false if the pipeline is full; the caller then checks the
+    // block itself
+    bool Push(CNode* pfrom, const CBlock& block)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fQuit || queue.size() >= nMaxQueued)
+                return false;
+        }
+        CBlockCheckJob* pjob = new CBlockCheckJob(pfrom, block);
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            pfrom->AddRef();
+            queue.push_back(pjob);
+            setQueued.insert(block.GetHash());
+        }
+        condWorker.notify_one();
+        return true;
+    }
+
+    // Queue the block at nBlockPos of block file nFile (-reindex); returns
+    // false if the pipeline is full
+    bool PushFromDisk(unsigned int nFile, unsigned int nBlockPos)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fQuit || queue.size() >= nMaxQueued)
+                return false;
+            queue.push_back(new CBlockCheckJob(nFile, nBlockPos));
+        }
+        condWorker.notify_one();
+        return true;
+    }
+
+    void Thread()
+    {
+        loop
+        {
+            CBlockCheckJob* pjob;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fQuit && nNextToCheck >= queue.size())
+                    condWorker.wait(lock);
+                if (fQuit)
+                    return;
+                pjob = queue[nNextToCheck++];
+            }
+            bool fOk = pjob->Run();
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                pjob->fOk = fOk;
+                pjob->fDone = true;
+            }
+            condDone.notify_all();
+        }
+    }
+
+    // Take the checked blocks from the front of the queue; with fWait,
+    // wait for the first one unless the queue is empty
+    void PopChecked(std::vector<CBlockCheckJob*>& vJobs, bool fWait = false)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (fWait && !fQuit && !queue.empty() && !queue.front()->fDone)
+            condDone.wait(lock);
+        while (!queue.empty() && queue.front()->fDone)
+        {
+            vJobs.push_back(queue.front());
+            setQueued.erase(queue.front()->block.GetHash());
+            queue.pop_front();
+            nNextToCheck--;
+        }
+    }
+
+    bool Contains(const uint256& hash)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return setQueued.count(hash) > 0;
+    }
+
+    void Quit()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+        }
+        condWorker.notify_all();
+        condDone.notify_all();
+    }
+};
+
+static CBlockCheckPipeline blockcheckpipeline(256);
+static int nBlockCheckThreads = 0;
+
 
 
 /* Configure the fork heights.  */
@@ -366,7 +772,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -544,8 +950,20 @@ CTransaction::AcceptToMemoryPool (DatabaseSet& dbset, bool fCheckInputs,
         // Check against previous transactions
         CTestPool poolUnused;
         int64 nFees = 0;
-        if (!ConnectInputs (dbset, poolUnused, CDiskTxPos(1,1,1), pindexBest,
-                            nFees, false, false))
+        std::vector<CScriptCheck> vChecks;
+        bool fConnected;
+        {
+            CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads && vin.size() > 1 ? &scriptcheckqueue : NULL);
+            fConnected = ConnectInputs (dbset, poolUnused, CDiskTxPos(1,1,1), pindexBest,
+                                        nFees, false, false, 0, &vChecks);
+            if (fConnected)
+            {
+                control.Add(vChecks);
+                if (!control.Wait())
+                    fConnected = error("AcceptToMemoryPool() : %s VerifySignature failed", hash.ToString().substr(0,10).c_str());
+            }
+        }
+        if (!fConnected)
         {
             if (pfMissingInputs)
                 *pfMissingInputs = true;
@@ -628,6 +1046,7 @@ bool CTransaction::AddToMemoryPoolUnchecked()
         mapTransactions[hash] = *this;
         for (int i = 0; i < vin.size(); i++)
             mapNextTx[vin[i].prevout] = CInPoint(&mapTransactions[hash], i);
+        mempoolindex.Add(&mapTransactions[hash]);
         nTransactionsUpdated++;
     }
     return true;
@@ -643,6 +1062,7 @@ bool CTransaction::RemoveFromMemoryPool()
     {
         BOOST_FOREACH(const CTxIn& txin, vin)
             mapNextTx.erase(txin.prevout);
+        mempoolindex.Remove(GetHash());
         mapTransactions.erase(GetHash());
         nTransactionsUpdated++;
     }
@@ -701,7 +1121,7 @@ int CMerkleTx::GetDepthInMainChain(int& nHeightRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -796,7 +1216,7 @@ CTxIndex::GetContainingBlock () const
         return NULL;
 
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return NULL;
 
@@ -890,15 +1310,9 @@ bool CBlock::ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fRead
 {
     SetNull();
 
-    // Open history file to read
-    CAutoFile filein = OpenBlockFile(nFile, nBlockPos, "rb");
-    if (!filein)
-        return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-    if (!fReadTransactions)
-        filein.nType |= SER_BLOCKHEADERONLY;
-
     // Read block
-    filein >> *this;
+    if (!ReadFromBlockFile(nFile, nBlockPos, *this, fReadTransactions ? SER_DISK : SER_DISK | SER_BLOCKHEADERONLY))
+        return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
 
     // Check the header
     if (!CheckProofOfWork(INT_MAX))
@@ -906,23 +1320,15 @@ bool CBlock::ReadFromDisk(unsigned int nFile, unsigned int nBlockPos, bool fRead
 
     if (fReadTransactions && nGameTxFile != -1)
     {
-        // If same file, do not reopen
-        if (nFile == nGameTxFile)
-        {
-            if (fseek(filein, nGameTxPos, SEEK_SET) != 0)
-                return error("CBlock::ReadFromDisk() : fseek failed when trying to read game transactions (nFile=%d, nBlockPos=%d, nGameTxFile=%d, nGameTxPos=%d)", nFile, nBlockPos, nGameTxFile, nGameTxPos);
-            filein >> vgametx;
-        }
-        else
-        {
-            CAutoFile filein2 = OpenBlockFile(nGameTxFile, nGameTxPos, "rb");
-            if (!filein2)
-                return error("CBlock::ReadFromDisk() : OpenBlockFile failed when trying to read game transactions (nFile=%d, nBlockPos=%d, nGameTxFile=%d, nGameTxPos=%d)", nFile, nBlockPos, nGameTxFile, nGameTxPos);
-            filein2 >> vgametx;
-        }
+        // The block files stay mapped, so a separate game tx file costs
+        // no extra open
+        if (!ReadFromBlockFile(nGameTxFile, nGameTxPos, vgametx))
+            return error("CBlock::ReadFromDisk() : OpenBlockFile failed when trying to read game transactions (nFile=%d, nBlockPos=%d, nGameTxFile=%d, nGameTxPos=%d)", nFile, nBlockPos, nGameTxFile, nGameTxPos);
     }
     else
         vgametx.clear();
+
+    CacheHashes();
     return true;
 }
 
@@ -935,6 +1341,19 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex)
     return true;
 }
 
+void CBlock::CacheHashes() const
+{
+    hashCached = Hash(BEGIN(nVersion), END(nNonce));
+    fHashCached = true;
+    fPoWHashCached = false;
+    if (auxpow.get() != NULL)
+        auxpow->parentBlock.CacheHashes();
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        tx.CacheHash();
+    BOOST_FOREACH(const CTransaction& tx, vgametx)
+        tx.CacheHash();
+}
+
 void CBlock::SetAuxPow(CAuxPow* pow)
 {
     if (pow != NULL)
@@ -1069,87 +1488,692 @@ bool IsInitialBlockDownload()
             pindexBest->GetBlockTime() < GetTime() - 3600);
 }
 
-void static InvalidChainFound(CBlockIndex* pindexNew)
+bool static HeadersFirstEnabled()
 {
-    if (pindexNew->bnChainWork > bnBestInvalidWork)
-    {
-        bnBestInvalidWork = pindexNew->bnChainWork;
-        CTxDB().WriteBestInvalidWork(bnBestInvalidWork);
-#ifdef GUI
-        uiInterface.NotifyBlocksChanged();
-#endif
-    }
-    printf("InvalidChainFound: invalid block=%s  height=%d  work=%s\n", pindexNew->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->nHeight, pindexNew->bnChainWork.ToString().c_str());
-    printf("InvalidChainFound:  current best=%s  height=%d  work=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainWork.ToString().c_str());
-    if (pindexBest && bnBestInvalidWork > bnBestChainWork + pindexBest->GetBlockWork() * 6)
-        printf("InvalidChainFound: WARNING: Displayed transactions may not be correct!  You may need to upgrade, or other nodes may need to upgrade.\n");
+    static int fHeadersFirst = -1;
+    if (fHeadersFirst == -1)
+        fHeadersFirst = GetBoolArg("-headersfirst", true);
+    return fHeadersFirst;
 }
 
+bool static PeerServesHeaders(const CNode* pnode)
+{
+    return HeadersFirstEnabled() && !pnode->fClient && (pnode->nServices & NODE_HEADERS);
+}
 
+// Best chain known from headers, at least as good as pindexBest; needs
+// cs_main
+static CBlockIndex* GetBestHeader()
+{
+    if (pindexBestHeader == NULL
+        || (pindexBest && pindexBest->nChainWork > pindexBestHeader->nChainWork))
+        pindexBestHeader = pindexBest;
+    return pindexBestHeader;
+}
 
+// Also called without cs_main (getinfo)
+int GetBestHeaderHeight()
+{
+    int nHeight = -1;
+    CRITICAL_BLOCK(cs_main)
+    {
+        CBlockIndex* pindex = GetBestHeader();
+        if (pindex)
+            nHeight = pindex->nHeight;
+    }
+    return nHeight;
+}
 
+static CBlockIndex* LookupBlockOrHeader(const uint256& hash)
+{
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return (*mi).second;
+    map<uint256, CBlockIndex*>::iterator miHeader = mapHeaderIndex.find(hash);
+    if (miHeader != mapHeaderIndex.end())
+        return (*miHeader).second;
+    return NULL;
+}
 
+// Validate a header received in "headers" and add it to the header index.
+// This does all checks of AcceptBlock that don't need the transactions.
+bool static AcceptBlockHeader(CBlock& header, CBlockIndex*& pindexRet)
+{
+    uint256 hash = header.GetHash();
+    pindexRet = LookupBlockOrHeader(hash);
+    if (pindexRet)
+        return true;
 
+    CBlockIndex* pindexPrev = LookupBlockOrHeader(header.hashPrevBlock);
+    if (!pindexPrev)
+        return error("AcceptBlockHeader() : prev block %s not found", header.hashPrevBlock.ToString().substr(0,20).c_str());
+    int nHeight = pindexPrev->nHeight+1;
 
+    if (!header.CheckProofOfWork(nHeight))
+        return error("AcceptBlockHeader() : proof of work failed");
+    if (header.nBits != GetNextWorkRequired(pindexPrev, header.GetAlgo()))
+        return error("AcceptBlockHeader() : incorrect proof of work");
+    if (header.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return error("AcceptBlockHeader() : block's timestamp is too early");
+    if (header.GetBlockTime() > GetAdjustedTime() + 30 * 60)
+        return error("AcceptBlockHeader() : block timestamp too far in the future");
+    if (header.GetBlockTime() <= pindexPrev->GetBlockTime() - 2 * 30 * 60)
+        return error("AcceptBlockHeader() : block's timestamp is too early compare to last block");
+    if (!hooks->Lockin(nHeight, hash))
+        return error("AcceptBlockHeader() : rejected by checkpoint lockin at %d", nHeight);
 
+    CBlockIndex* pindexNew = new CBlockIndex(0, 0, header);
+    map<uint256, CBlockIndex*>::iterator mi = mapHeaderIndex.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+    pindexNew->pprev = pindexPrev;
+    pindexNew->nHeight = nHeight;
+    pindexNew->nChainWork = pindexPrev->nChainWork + pindexNew->GetBlockWork();
+    mapHeaderIndexByPrev.insert(make_pair(header.hashPrevBlock, pindexNew));
 
+    if (pindexNew->nChainWork > GetBestHeader()->nChainWork)
+        pindexBestHeader = pindexNew;
 
+    pindexRet = pindexNew;
+    return true;
+}
 
-bool
-CTransaction::DisconnectInputs (DatabaseSet& dbset, CBlockIndex* pindex)
+// The block for a header has been added to mapBlockIndex: replace the
+// header's index object by the real one
+void static HeaderConnected(const uint256& hash, CBlockIndex* pindexNew)
 {
-    if (!hooks->DisconnectInputs (dbset, *this, pindex))
-        return false;
-
-    const bool fGameTx = IsGameTx ();
-
-    // Relinquish previous transactions' spent pointers
-    if (!IsCoinBase())
+    map<uint256, CBlockIndex*>::iterator mi = mapHeaderIndex.find(hash);
+    if (mi != mapHeaderIndex.end())
     {
-        BOOST_FOREACH(const CTxIn& txin, vin)
-        {
-            COutPoint prevout = txin.prevout;
+        CBlockIndex* pindexHeader = (*mi).second;
+        uint256 hashPrev = pindexHeader->pprev->GetBlockHash();
+        for (multimap<uint256, CBlockIndex*>::iterator it = mapHeaderIndexByPrev.lower_bound(hashPrev);
+             it != mapHeaderIndexByPrev.upper_bound(hashPrev); ++it)
+            if ((*it).second == pindexHeader)
+            {
+                mapHeaderIndexByPrev.erase(it);
+                break;
+            }
+        if (pindexBestHeader == pindexHeader)
+            pindexBestHeader = pindexNew;
+        mapHeaderIndex.erase(mi);
+        delete pindexHeader;
+    }
 
-            // Game transactions can be like coin-base, i.e. produce coins out of nothing
-            if (fGameTx && prevout.IsNull())
-                continue;
+    for (multimap<uint256, CBlockIndex*>::iterator it = mapHeaderIndexByPrev.lower_bound(hash);
+         it != mapHeaderIndexByPrev.upper_bound(hash); ++it)
+        (*it).second->pprev = pindexNew;
 
-            // Get prev txindex from disk
-            CTxIndex txindex;
-            if (!dbset.tx ().ReadTxIndex (prevout.hash, txindex))
-                return error("DisconnectInputs() : ReadTxIndex failed");
+    if (pindexBestHeader && pindexNew->nChainWork > pindexBestHeader->nChainWork)
+        pindexBestHeader = pindexNew;
+}
 
-            /* Put the previous txo back to the UTXO set.  This requires loading
-               the transaction from disk first.  We could avoid that by keeping
-               "not too old" UTXO entries somewhere, but for now this
-               should do well enough.  DisconnectInputs shouldn't happen
-               too much during normal operation anyway.  */
-            CTransaction txPrev;
-            if (!txPrev.ReadFromDisk (txindex.pos))
-              return error ("DisconnectInputs: %s ReadFromDisk"
-                            " prev tx %s failed",
-                            GetHash ().ToString ().c_str (),
-                            prevout.hash.ToString ().c_str ());
-            assert (!txPrev.vout[prevout.n].IsUnspendable ());
-            if (!dbset.utxo ().InsertUtxo (txPrev, prevout.n,
-                                           txindex.GetHeight ()))
-              return error ("DisconnectInputs: Failed to InsertUtxo");
+// Erase the header with this hash (if any) and all headers building on it;
+// returns how many were erased.  pindexBestHeader is left to the caller.
+unsigned int static EraseHeaders(const uint256& hash)
+{
+    unsigned int nErased = 0;
+    vector<uint256> vWorkQueue;
+    vWorkQueue.push_back(hash);
+    for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+    {
+        uint256 hashInvalid = vWorkQueue[i];
+        for (multimap<uint256, CBlockIndex*>::iterator it = mapHeaderIndexByPrev.lower_bound(hashInvalid);
+             it != mapHeaderIndexByPrev.upper_bound(hashInvalid); ++it)
+            vWorkQueue.push_back((*it).second->GetBlockHash());
+        mapHeaderIndexByPrev.erase(hashInvalid);
+
+        map<uint256, CBlockIndex*>::iterator mi = mapHeaderIndex.find(hashInvalid);
+        if (mi == mapHeaderIndex.end())
+            continue;
+        CBlockIndex* pindexHeader = (*mi).second;
+        // Descendants were already dropped from mapHeaderIndexByPrev
+        // together with their parent
+        if (i == 0)
+        {
+            uint256 hashPrev = pindexHeader->pprev->GetBlockHash();
+            for (multimap<uint256, CBlockIndex*>::iterator it = mapHeaderIndexByPrev.lower_bound(hashPrev);
+                 it != mapHeaderIndexByPrev.upper_bound(hashPrev); ++it)
+                if ((*it).second == pindexHeader)
+                {
+                    mapHeaderIndexByPrev.erase(it);
+                    break;
+                }
         }
+        mapHeaderIndex.erase(mi);
+        mapBlocksInFlight.erase(hashInvalid);
+        delete pindexHeader;
+        nErased++;
     }
+    return nErased;
+}
 
-    // Remove transaction from index
-    if (!dbset.utxo ().RemoveUtxo (*this))
-      return error ("DisconnectInputs: Failed to RemoveUtxo");
-    if (!dbset.tx ().EraseTxIndex (*this))
-      return error ("DisconnectInputs: EraseTxPos failed");
-
-    return true;
+// Forget the header with this hash (if any) and all headers building on it
+void static InvalidateHeaders(const uint256& hash)
+{
+    unsigned int nErased = EraseHeaders(hash);
+    if (nErased > 1)
+        printf("InvalidateHeaders() : dropped %u headers building on %s\n", nErased - 1, hash.ToString().substr(0,20).c_str());
+
+    // Find the best remaining header chain
+    pindexBestHeader = pindexBest;
+    BOOST_FOREACH(PAIRTYPE(const uint256, CBlockIndex*)& item, mapHeaderIndex)
+        if (!pindexBestHeader || item.second->nChainWork > pindexBestHeader->nChainWork)
+            pindexBestHeader = item.second;
+}
+
+// Headers of side branches are only removed when their blocks arrive, which
+// for a branch that lost may be never.  Every HEADER_PRUNE_INTERVAL blocks,
+// drop the headers at or below our best block that aren't on the best
+// header chain, along with everything building on them.
+static const int HEADER_PRUNE_INTERVAL = 1000;
+
+void static PruneStaleHeaders()
+{
+    static int nLastPruneHeight = -1;
+    if (nLastPruneHeight >= 0 && nBestHeight >= nLastPruneHeight
+        && nBestHeight < nLastPruneHeight + HEADER_PRUNE_INTERVAL)
+        return;
+    nLastPruneHeight = nBestHeight;
+
+    // The header-only part of the best header chain that isn't above
+    // nBestHeight (non-empty only if that chain forks off below it)
+    set<CBlockIndex*> setKeep;
+    CBlockIndex* pindex = GetBestHeader();
+    while (pindex && pindex->nHeight > nBestHeight)
+        pindex = pindex->pprev;
+    for (; pindex && !mapBlockIndex.count(pindex->GetBlockHash()); pindex = pindex->pprev)
+        setKeep.insert(pindex);
+
+    vector<uint256> vStale;
+    BOOST_FOREACH(PAIRTYPE(const uint256, CBlockIndex*)& item, mapHeaderIndex)
+        if (item.second->nHeight <= nBestHeight && !setKeep.count(item.second))
+            vStale.push_back(item.first);
+
+    // A stale header may already be gone as a descendant of an earlier one
+    unsigned int nErased = 0;
+    BOOST_FOREACH(const uint256& hash, vStale)
+        nErased += EraseHeaders(hash);
+    if (nErased > 0)
+        printf("PruneStaleHeaders() : dropped %u side branch headers, %"PRIszu" left\n", nErased, mapHeaderIndex.size());
+}
+
+// Keep vHeaderPath in sync with the best header chain
+void static UpdateHeaderPath()
+{
+    CBlockIndex* pindexTip = GetBestHeader();
+    if (!pindexTip)
+        return;
+    uint256 hashTip = pindexTip->GetBlockHash();
+    if (!vHeaderPath.empty() && vHeaderPath.back() == hashTip)
+        return;
+
+    // Usually the new tip just extends the old one
+    vector<uint256> vNew;
+    CBlockIndex* pindex = pindexTip;
+    while (pindex && !mapBlockIndex.count(pindex->GetBlockHash()))
+    {
+        if (!vHeaderPath.empty() && pindex->GetBlockHash() == vHeaderPath.back())
+            break;
+        vNew.push_back(pindex->GetBlockHash());
+        pindex = pindex->pprev;
+    }
+    if (vHeaderPath.empty() || !pindex || pindex->GetBlockHash() != vHeaderPath.back())
+    {
+        vHeaderPath.clear();
+        nHeaderPathPos = 0;
+    }
+    vHeaderPath.insert(vHeaderPath.end(), vNew.rbegin(), vNew.rend());
+}
+
+// Pick blocks on the best header chain for this peer to download
+void static FindBlocksToDownload(CNode* pto, vector<CInv>& vGetData)
+{
+    int64 nNow = GetTime();
+
+    // Forget requests that were answered or have timed out
+    for (set<uint256>::iterator it = pto->setBlocksInFlight.begin(); it != pto->setBlocksInFlight.end(); )
+    {
+        map<uint256, int64>::iterator mi = mapBlocksInFlight.find(*it);
+        if (mi == mapBlocksInFlight.end() || (*mi).second < nNow)
+        {
+            if (mi != mapBlocksInFlight.end())
+            {
+                printf("block download of %s from %s timed out\n", (*it).ToString().substr(0,20).c_str(), pto->addr.ToString().c_str());
+                mapBlocksInFlight.erase(mi);
+            }
+            pto->setBlocksInFlight.erase(it++);
+        }
+        else
+            ++it;
+    }
+
+    if (pto->setBlocksInFlight.size() >= MAX_BLOCKS_IN_FLIGHT_PER_PEER)
+        return;
+
+    PruneStaleHeaders();
+    UpdateHeaderPath();
+    while (nHeaderPathPos < vHeaderPath.size() && mapBlockIndex.count(vHeaderPath[nHeaderPathPos]))
+        nHeaderPathPos++;
+    if (nHeaderPathPos > 10000)
+    {
+        vHeaderPath.erase(vHeaderPath.begin(), vHeaderPath.begin() + nHeaderPathPos);
+        nHeaderPathPos = 0;
+    }
+
+    // Blocks are fetched in a sliding window above the first missing one,
+    // out of order and from several peers; ProcessBlock keeps the early
+    // ones as orphans until they can be connected in order
+    unsigned int nEnd = std::min((unsigned int)vHeaderPath.size(), nHeaderPathPos + BLOCK_DOWNLOAD_WINDOW);
+    for (unsigned int i = nHeaderPathPos; i < nEnd && pto->setBlocksInFlight.size() < MAX_BLOCKS_IN_FLIGHT_PER_PEER; i++)
+    {
+        const uint256& hash = vHeaderPath[i];
+        if (mapBlocksInFlight.count(hash) || mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash)
+            || blockcheckpipeline.Contains(hash))
+            continue;
+        map<uint256, CBlockIndex*>::iterator mi = mapHeaderIndex.find(hash);
+        if (mi == mapHeaderIndex.end())
+            continue;
+        // Only ask peers that should have the block
+        if (!pto->fServedHeaders && pto->nStartingHeight < (*mi).second->nHeight)
+            break;
+
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+        mapBlocksInFlight[hash] = nNow + BLOCK_DOWNLOAD_TIMEOUT;
+        pto->setBlocksInFlight.insert(hash);
+    }
+}
+
+void static MarkBlockReceived(CNode* pfrom, const uint256& hash)
+{
+    if (pfrom->setBlocksInFlight.erase(hash))
+        mapBlocksInFlight.erase(hash);
+}
+
+// Ask a peer for the blocks we are missing, by headers if it can serve them
+void static PushGetBlocksOrHeaders(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
+{
+    if (PeerServesHeaders(pnode))
+        pnode->PushGetHeaders(GetBestHeader());
+    else
+        pnode->PushGetBlocks(pindexBegin, hashEnd);
+}
+
+void static InvalidChainFound(DatabaseSet& dbset, CBlockIndex* pindexNew)
+{
+    InvalidateHeaders(pindexNew->GetBlockHash());
+    if (pindexNew->nChainWork > nBestInvalidWork)
+    {
+        nBestInvalidWork = pindexNew->nChainWork;
+        dbset.tx().WriteBestInvalidWork(CBigNum(nBestInvalidWork));
+#ifdef GUI
+        uiInterface.NotifyBlocksChanged();
+#endif
+    }
+    printf("InvalidChainFound: invalid block=%s  height=%d  work=%s\n", pindexNew->GetBlockHash().ToString().substr(0,20).c_str(), pindexNew->nHeight, CBigNum(pindexNew->nChainWork).ToString().c_str());
+    printf("InvalidChainFound:  current best=%s  height=%d  work=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, CBigNum(nBestChainWork).ToString().c_str());
+    if (pindexBest && CBigNum(nBestInvalidWork) > CBigNum(nBestChainWork) + CBigNum(pindexBest->GetBlockWork()) * 6)
+        printf("InvalidChainFound: WARNING: Displayed transactions may not be correct!  You may need to upgrade, or other nodes may need to upgrade.\n");
+}
+
+
+
+// During initial download, blocks are connected inside one DB transaction
+// that spans many of them instead of committing (and logging) every block
+// on its own.  The batch is committed after -dbbatchsize blocks or
+// -dbbatchinterval seconds, and the log is flushed so that it survives a
+// crash; an interrupted batch is rolled back as a whole, best chain
+// included, and its blocks are downloaded again.
+//
+// The batch must be opened and closed while holding cs_main, so nothing
+// else can write to the databases in between.
+static DatabaseSet* pdbsetBlockBatch = NULL;
+static int nBatchBlocks = 0;
+static int64 nBatchStart = 0;
+static int64 nBatchTotalBlocks = 0;
+static int64 nBatchTotalTime = 0;
+static int64 nBatchTotalCommitTime = 0;
+
+// Block files marked as pruned in the DB, which are deleted once that is
+// committed
+static set<unsigned int> setBlockFilesToDelete;
+
+void static DeletePrunedBlockFiles()
+{
+    BOOST_FOREACH(unsigned int nFile, setBlockFilesToDelete)
+    {
+        blockfilemap.Close(nFile);
+        const string strFile = strprintf("%s/blk%04u.dat", GetDataDir().c_str(), nFile);
+        boost::system::error_code ec;
+        boost::filesystem::remove(strFile, ec);
+        if (ec)
+            printf("DeletePrunedBlockFiles() : removing %s failed: %s\n", strFile.c_str(), ec.message().c_str());
+        else
+            printf("Pruned block file %s\n", strFile.c_str());
+    }
+    setBlockFilesToDelete.clear();
+}
+
+// Each block connected within the batch commits a transaction nested in
+// it, and CUtxoView::Commit moves the block's UTXO changes into the shared
+// cache right then, before the batch itself is committed.  So while a
+// batch is open the cache may be ahead of what utxo.dat will keep; a batch
+// that doesn't commit must be followed by ClearUtxoCache() before the UTXO
+// set is read again, as done below.
+bool static CommitBlockBatch(bool fContinue)
+{
+    int64 nCommitStart = GetTimeMillis();
+    if (!pdbsetBlockBatch->TxnCommit())
+    {
+        // the caller deletes the batch, which aborts what's left of it
+        ClearUtxoCache();
+        setBlockFilesToDelete.clear();
+        error("CommitBlockBatch() : committing blocks up to height %d failed", nBestHeight);
+        StartShutdown();
+        return false;
+    }
+    dbenv.log_flush(NULL);
+    DeletePrunedBlockFiles();
+
+    int64 nNow = GetTimeMillis();
+    nBatchTotalBlocks += nBatchBlocks;
+    nBatchTotalTime += nNow - nBatchStart;
+    nBatchTotalCommitTime += nNow - nCommitStart;
+    printf("CommitBlockBatch: %d blocks up to height %d in %"PRI64d"ms (commit %"PRI64d"ms), total %"PRI64d" blocks in %"PRI64d"ms (commits %"PRI64d"ms)\n",
+           nBatchBlocks, nBestHeight, nNow - nBatchStart, nNow - nCommitStart,
+           nBatchTotalBlocks, nBatchTotalTime, nBatchTotalCommitTime);
+
+    nBatchBlocks = 0;
+    nBatchStart = nNow;
+    if (fContinue && !pdbsetBlockBatch->TxnBegin())
+        return false;
+    return true;
+}
+
+// Count a block connected within the batch, and commit if it's full
+void static BlockBatchConnected()
+{
+    if (pdbsetBlockBatch == NULL)
+        return;
+    nBatchBlocks++;
+    if (nBatchBlocks >= GetArg("-dbbatchsize", 500)
+        || GetTimeMillis() - nBatchStart >= GetArg("-dbbatchinterval", 30) * 1000)
+    {
+        if (!CommitBlockBatch(true))
+        {
+            delete pdbsetBlockBatch;
+            pdbsetBlockBatch = NULL;
+            fDBReadUncommitted = false;
+        }
+    }
+}
+
+// Opens a batch for its lifetime, unless one is open already or the
+// initial download is done
+class CBlockBatch
+{
+private:
+    bool fOwner;
+
+public:
+    CBlockBatch(bool fOpen = true) : fOwner(false)
+    {
+        if (!fOpen || pdbsetBlockBatch != NULL || !IsInitialBlockDownload() || GetArg("-dbbatchsize", 500) <= 1)
+            return;
+        pdbsetBlockBatch = new DatabaseSet("r+");
+        if (!pdbsetBlockBatch->TxnBegin())
+        {
+            delete pdbsetBlockBatch;
+            pdbsetBlockBatch = NULL;
+            return;
+        }
+        fDBReadUncommitted = true;
+        fOwner = true;
+        nBatchBlocks = 0;
+        nBatchStart = GetTimeMillis();
+    }
+
+    ~CBlockBatch()
+    {
+        if (!fOwner || pdbsetBlockBatch == NULL)
+            return;
+        CommitBlockBatch(false);
+        delete pdbsetBlockBatch;
+        pdbsetBlockBatch = NULL;
+        fDBReadUncommitted = false;
+    }
+};
+
+
+
+// With -prune, the oldest block files are deleted while the block files
+// take more than nPruneTarget bytes.  A file can go once all of its blocks
+// are more than MIN_BLOCKS_TO_KEEP plus a game state interval deep, so
+// that every state a reorganisation can go back to is integrated from a
+// stored one, and once undo data ("txundo") has been recorded for the
+// blocks in reach of a reorganisation.  Files with the name transactions of
+// the players still alive there are kept, since game transactions spend
+// them.
+//
+// Within a block batch the files are only deleted when it is committed.
+// Caller must hold cs_main.
+void static PruneBlockFiles(DatabaseSet& dbset)
+{
+    if (nPruneTarget <= 0 || pindexBest == NULL)
+        return;
+
+    // Checking the sizes is cheap, but collecting the pinned files is not
+    static int64 nLastPrune = 0;
+    if (GetTime() - nLastPrune < 60)
+        return;
+    nLastPrune = GetTime();
+
+    const int nPruneHeight = nBestHeight - MIN_BLOCKS_TO_KEEP - GetGameStateInterval();
+    int nUndoHeight;
+    if (nPruneHeight <= 0 || !dbset.tx().ReadUndoHeight(nUndoHeight) || nPruneHeight < nUndoHeight)
+        return;
+
+    // Files written before blkheight was recorded: the highest block body
+    // in them, with a margin for the game transactions written while
+    // connecting the bodies ahead of them
+    static map<unsigned int, int> mapLegacyHeight;
+
+    const unsigned int nCurrentFile = blockfilewriter.GetCurrentFile();
+    uint64 nTotal = 0;
+    vector<pair<unsigned int, uint64> > vCandidates;
+    map<unsigned int, int> mapFileHeight;
+    for (unsigned int nFile = 1; nFile <= nCurrentFile; nFile++)
+    {
+        const string strFile = strprintf("%s/blk%04u.dat", GetDataDir().c_str(), nFile);
+        boost::system::error_code ec;
+        const boost::uintmax_t nSize = boost::filesystem::file_size(strFile, ec);
+        if (ec || setBlockFilesToDelete.count(nFile))
+            continue;
+        if (dbset.tx().IsBlockFilePruned(nFile))
+        {
+            // left over from an interrupted deletion
+            boost::filesystem::remove(strFile, ec);
+            continue;
+        }
+        nTotal += nSize;
+        if (nFile == nCurrentFile)
+            continue;
+
+        int nFileHeight;
+        if (!dbset.tx().ReadBlockFileHeight(nFile, nFileHeight))
+        {
+            if (!mapLegacyHeight.count(nFile))
+            {
+                mapLegacyHeight[nFile] = INT_MAX;
+                int nMaxBody = -1;
+                for (CBlockIndexMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+                    if (mi->second->nFile == nFile)
+                        nMaxBody = max(nMaxBody, mi->second->nHeight);
+                if (nMaxBody >= 0)
+                    mapLegacyHeight[nFile] = nMaxBody + BLOCK_DOWNLOAD_WINDOW;
+            }
+            nFileHeight = mapLegacyHeight[nFile];
+        }
+        if (nFileHeight <= nPruneHeight)
+        {
+            vCandidates.push_back(make_pair(nFile, (uint64)nSize));
+            mapFileHeight[nFile] = nFileHeight;
+        }
+    }
+    if (nTotal <= (uint64)nPruneTarget || vCandidates.empty())
+        return;
+
+    // The deepest stored game state a reorganisation may integrate from;
+    // players alive after it were alive there or spawned later
+    const int nStateHeight = (nBestHeight - MIN_BLOCKS_TO_KEEP) / GetGameStateInterval() * GetGameStateInterval();
+    CBlockIndex* pindexState = pindexBest;
+    while (pindexState->nHeight > nStateHeight)
+        pindexState = pindexState->pprev;
+    set<unsigned int> setPinned;
+    if (!GetPlayerNameTxFiles(dbset, pindexState, setPinned))
+    {
+        error("PruneBlockFiles() : cannot determine the files with name transactions");
+        return;
+    }
+
+    set<unsigned int> setPrune;
+    int nNewPruneHeight = nBlockPruneHeight;
+    for (unsigned int i = 0; i < vCandidates.size() && nTotal > (uint64)nPruneTarget; i++)
+    {
+        const unsigned int nFile = vCandidates[i].first;
+        if (setPinned.count(nFile))
+            continue;
+        setPrune.insert(nFile);
+        nTotal -= vCandidates[i].second;
+        nNewPruneHeight = max(nNewPruneHeight, mapFileHeight[nFile]);
+    }
+    if (setPrune.empty())
+        return;
+
+    // The undo data of the pruned blocks is no longer needed
+    dbset.TxnBegin();
+    for (CBlockIndex* pindex = pindexGenesisBlock; pindex && pindex->nHeight <= nPruneHeight; pindex = pindex->pnext)
+    {
+        if (!setPrune.count(pindex->nFile))
+            continue;
+        CBlock block;
+        if (!ReadFromBlockFile(pindex->nFile, pindex->nBlockPos, block))
+            continue;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            if (!dbset.tx().EraseTxUndo(tx.GetHash()))
+            {
+                dbset.TxnAbort();
+                error("PruneBlockFiles() : EraseTxUndo failed");
+                return;
+            }
+    }
+    BOOST_FOREACH(unsigned int nFile, setPrune)
+        if (!dbset.tx().MarkBlockFilePruned(nFile))
+        {
+            dbset.TxnAbort();
+            error("PruneBlockFiles() : MarkBlockFilePruned failed");
+            return;
+        }
+    if (!dbset.tx().WriteBlockPruneHeight(nNewPruneHeight) || !dbset.TxnCommit())
+    {
+        error("PruneBlockFiles() : committing the pruned files failed");
+        return;
+    }
+
+    printf("PruneBlockFiles() : pruning %"PRIszu" block files up to height %d, %"PRI64u" MB left\n",
+           setPrune.size(), nNewPruneHeight, nTotal / (1024 * 1024));
+    nBlockPruneHeight = nNewPruneHeight;
+    setBlockFilesToDelete.insert(setPrune.begin(), setPrune.end());
+    if (pdbsetBlockBatch == NULL)
+        DeletePrunedBlockFiles();
+}
+
+
+
+
+
+
+
+
+
+
+
+bool
+CTransaction::DisconnectInputs (DatabaseSet& dbset, CBlockIndex* pindex)
+{
+    if (!hooks->DisconnectInputs (dbset, *this, pindex))
+        return false;
+
+    const bool fGameTx = IsGameTx ();
+
+    // Relinquish previous transactions' spent pointers
+    if (!IsCoinBase())
+    {
+        /* While pruning, the spent outputs are recorded when the transaction
+           is connected, since the previous transactions may be gone from
+           the block files by now.  */
+        std::vector<CUtxoEntry> vUndo;
+        const bool fUndo = (!fGameTx && dbset.tx ().ReadTxUndo (GetHash (), vUndo));
+        if (fUndo && vUndo.size () != vin.size ())
+            return error ("DisconnectInputs: %s has undo data for %"PRIszu
+                          " inputs instead of %"PRIszu,
+                          GetHash ().ToString ().c_str (),
+                          vUndo.size (), vin.size ());
+
+        for (unsigned i = 0; i < vin.size (); i++)
+        {
+            const COutPoint prevout = vin[i].prevout;
+
+            // Game transactions can be like coin-base, i.e. produce coins out of nothing
+            if (fGameTx && prevout.IsNull())
+                continue;
+
+            if (fUndo)
+            {
+                if (!dbset.utxo ().InsertUtxo (prevout, vUndo[i]))
+                  return error ("DisconnectInputs: Failed to InsertUtxo");
+                continue;
+            }
+
+            // Get prev txindex from disk
+            CTxIndex txindex;
+            if (!dbset.tx ().ReadTxIndex (prevout.hash, txindex))
+                return error("DisconnectInputs() : ReadTxIndex failed");
+
+            /* Put the previous txo back to the UTXO set.  This requires loading
+               the transaction from disk first.  We could avoid that by keeping
+               "not too old" UTXO entries somewhere, but for now this
+               should do well enough.  DisconnectInputs shouldn't happen
+               too much during normal operation anyway.  */
+            CTransaction txPrev;
+            if (!txPrev.ReadFromDisk (txindex.pos))
+              return error ("DisconnectInputs: %s ReadFromDisk"
+                            " prev tx %s failed",
+                            GetHash ().ToString ().c_str (),
+                            prevout.hash.ToString ().c_str ());
+            assert (!txPrev.vout[prevout.n].IsUnspendable ());
+            if (!dbset.utxo ().InsertUtxo (txPrev, prevout.n,
+                                           txindex.GetHeight ()))
+              return error ("DisconnectInputs: Failed to InsertUtxo");
+        }
+
+        if (fUndo && !dbset.tx ().EraseTxUndo (GetHash ()))
+            return error ("DisconnectInputs: EraseTxUndo failed");
+    }
+
+    // Remove transaction from index
+    if (!dbset.utxo ().RemoveUtxo (*this))
+      return error ("DisconnectInputs: Failed to RemoveUtxo");
+    if (!dbset.tx ().EraseTxIndex (*this))
+      return error ("DisconnectInputs: EraseTxPos failed");
+
+    return true;
 }
 
 bool
 CTransaction::ConnectInputs (DatabaseSet& dbset, CTestPool& testPool,
     CDiskTxPos posThisTx, CBlockIndex* pindexBlock, int64& nFees,
-    bool fBlock, bool fMiner, int64 nMinFee)
+    bool fBlock, bool fMiner, int64 nMinFee,
+    std::vector<CScriptCheck>* pvChecks)
 {
     // Take over previous transactions' spent pointers
     if (!IsCoinBase())
@@ -1260,8 +2284,12 @@ CTransaction::ConnectInputs (DatabaseSet& dbset, CTestPool& testPool,
                                     " at depth %d", heightDiff);
                   }
 
-                // Verify signature
-                if (!VerifySignature (txo.txo, *this, i))
+                /* Verify signature (possibly deferred to the script check
+                   threads).  Signatures checked for the memory pool are
+                   remembered so that connecting the block can skip them.  */
+                if (pvChecks)
+                    pvChecks->push_back (CScriptCheck (txo.txo, *this, i, !fBlock));
+                else if (!VerifySignature (txo.txo, *this, i, 0, !fBlock))
                     return error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str());
 
                 // Check for negative or overflow input values
@@ -1296,6 +2324,12 @@ CTransaction::ConnectInputs (DatabaseSet& dbset, CTestPool& testPool,
                                    pindexBlock, posThisTx, fBlock, fMiner))
             return false;
 
+        /* Keep the spent outputs for DisconnectInputs (and the game step
+           validation), which can't read them from pruned block files.  */
+        if (fBlock && nPruneTarget > 0 && !IsGameTx ()
+            && !dbset.tx ().WriteTxUndo (GetHash (), vTxoPrev))
+            return error ("ConnectInputs() : WriteTxUndo failed");
+
         if (!IsGameTx())
         {
             // Tally transaction fees
@@ -1328,6 +2362,93 @@ CTransaction::ConnectInputs (DatabaseSet& dbset, CTestPool& testPool,
 }
 
 
+bool CScriptCheck::operator()() const
+{
+    if (!VerifySignature (txoFrom, *ptxTo, nIn, 0, fCacheStore))
+        return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().substr(0,10).c_str());
+    return true;
+}
+
+// Several threads share each of these vnThreadsRunning counts
+static CCriticalSection cs_vnCheckThreads("cs_vnCheckThreads");
+
+static void ThreadScriptCheck(void* parg)
+{
+    CRITICAL_BLOCK(cs_vnCheckThreads)
+        vnThreadsRunning[6]++;
+    scriptcheckqueue.Thread();
+    CRITICAL_BLOCK(cs_vnCheckThreads)
+        vnThreadsRunning[6]--;
+}
+
+static void ThreadBlockCheck(void* parg)
+{
+    CRITICAL_BLOCK(cs_vnCheckThreads)
+        vnThreadsRunning[7]++;
+    blockcheckpipeline.Thread();
+    CRITICAL_BLOCK(cs_vnCheckThreads)
+        vnThreadsRunning[7]--;
+}
+
+// Connect blocks that have passed the block check threads
+void ProcessCheckedBlocks()
+{
+    std::vector<CBlockCheckJob*> vJobs;
+    blockcheckpipeline.PopChecked(vJobs);
+    if (vJobs.empty())
+        return;
+    CRITICAL_BLOCK(cs_main)
+    {
+        CBlockBatch batch;
+        BOOST_FOREACH(CBlockCheckJob* pjob, vJobs)
+        {
+            if (!pjob->fOk)
+                error("ProcessCheckedBlocks() : CheckBlock FAILED for %s", pjob->block.GetHash().ToString().substr(0,20).c_str());
+            else if (ProcessBlock(pjob->pfrom, &pjob->block, true))
+                mapAlreadyAskedFor.erase(CInv(MSG_BLOCK, pjob->block.GetHash()));
+        }
+    }
+    BOOST_FOREACH(CBlockCheckJob* pjob, vJobs)
+    {
+        CRITICAL_BLOCK(cs_vNodes)
+            pjob->pfrom->Release();
+        delete pjob;
+    }
+}
+
+void StartScriptCheckThreads()
+{
+    // -par=<n>: number of script check threads besides the calling one,
+    // default one less than the number of cores
+    nScriptCheckThreads = GetArg("-par", boost::thread::hardware_concurrency() - 1);
+    if (nScriptCheckThreads < 0)
+        nScriptCheckThreads = 0;
+    if (nScriptCheckThreads > 16)
+        nScriptCheckThreads = 16;
+
+    printf("Using %d script check threads\n", nScriptCheckThreads);
+    for (int i = 0; i < nScriptCheckThreads; i++)
+        if (!CreateThread(ThreadScriptCheck, NULL))
+            printf("Error: CreateThread(ThreadScriptCheck) failed\n");
+
+    // The same number of threads checks incoming blocks during initial
+    // download; they are idle otherwise
+    nBlockCheckThreads = nScriptCheckThreads;
+    for (int i = 0; i < nBlockCheckThreads; i++)
+        if (!CreateThread(ThreadBlockCheck, NULL))
+            printf("Error: CreateThread(ThreadBlockCheck) failed\n");
+
+    // One more thread precomputes game states of side branches
+    StartGameStateSpeculation();
+}
+
+void StopScriptCheckThreads()
+{
+    scriptcheckqueue.Quit();
+    blockcheckpipeline.Quit();
+    StopGameStateSpeculation();
+}
+
 bool CTransaction::ClientConnectInputs()
 {
     if (IsCoinBase() || IsGameTx())
@@ -1421,16 +2542,28 @@ CBlock::ConnectBlock (DatabaseSet& dbset, CBlockIndex* pindex)
 
     CTestPool poolUnused;
     int64 nFees = 0;
+
+    /* Signature checks are queued as soon as each transaction's inputs are
+       looked up, and run while the remaining transactions are connected.  */
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    std::vector<CScriptCheck> vChecks;
     BOOST_FOREACH(CTransaction& tx, vtx)
     {
         CDiskTxPos posThisTx(pindex->nFile, pindex->nBlockPos, nTxPos);
         nTxPos += ::GetSerializeSize(tx, SER_DISK);
 
         if (!tx.ConnectInputs (dbset, poolUnused, posThisTx, pindex,
-                               nFees, true, false))
+                               nFees, true, false, 0, &vChecks))
             return false;
+        control.Add(vChecks);
     }
 
+    // The game hook below writes the game transactions to the block files
+    // and changes the block index in memory, which a failed DB transaction
+    // doesn't undo; so all signatures must have passed before it runs
+    if (!control.Wait())
+        return error("ConnectBlock() : signature verification failed");
+
     int64 nFeesBeforeTax = nFees;
 
     // This call updates the game state and creates vgametx
@@ -1464,6 +2597,17 @@ CBlock::ConnectBlock (DatabaseSet& dbset, CBlockIndex* pindex)
     BOOST_FOREACH(CTransaction& tx, vgametx)
         SyncWithWallets(tx, this, true);
 
+    if (fDebug)
+    {
+        // hash computations avoided by the tx/block hash cache since the
+        // previous block was connected
+        static long nHashCacheHitsLast = 0;
+        long nHashCacheHitsNow = nHashCacheHits;
+        printf("ConnectBlock() : height %d, %lu hashes served from cache\n",
+               pindex->nHeight, (unsigned long)(nHashCacheHitsNow - nHashCacheHitsLast));
+        nHashCacheHitsLast = nHashCacheHitsNow;
+    }
+
     return true;
 }
 
@@ -1531,8 +2675,7 @@ Reorganize (DatabaseSet& dbset, CBlockIndex* pindexNew)
                 return error("Reorganize() : ReadFromDisk for connect failed");
             if (!block.ConnectBlock (dbset, pindex))
             {
-                // Invalid block
-                dbset.TxnAbort ();
+                // Invalid block, SetBestChain aborts the transaction
                 return error("Reorganize() : ConnectBlock failed");
             }
 
@@ -1557,6 +2700,10 @@ Reorganize (DatabaseSet& dbset, CBlockIndex* pindexNew)
         BOOST_FOREACH(CBlockIndex* pindex, vConnect)
             if (pindex->pprev)
                 pindex->pprev->pnext = pindex;
+
+        // The old branch is a side branch now and may come back
+        BOOST_REVERSE_FOREACH(CBlockIndex* pindex, vDisconnect)
+            QueueSpeculativeGameState(pindex);
     }
 
     // Resurrect memory transactions that were in the disconnected branch
@@ -1572,6 +2719,44 @@ Reorganize (DatabaseSet& dbset, CBlockIndex* pindexNew)
 }
 
 
+static CCriticalSection cs_chainSnapshot("cs_chainSnapshot");
+static CChainSnapshotRef pchainSnapshot(new CChainSnapshot());
+
+CBlockIndex* CChainSnapshot::GetAncestor(int nHeightIn) const
+{
+    CBlockIndex* pindex = pindexBest;
+    while (pindex && pindex->nHeight > nHeightIn)
+        pindex = pindex->pprev;
+    if (pindex && pindex->nHeight != nHeightIn)
+        return NULL;
+    return pindex;
+}
+
+CChainSnapshotRef GetChainSnapshot()
+{
+    CRITICAL_BLOCK(cs_chainSnapshot)
+        return pchainSnapshot;
+    return CChainSnapshotRef();
+}
+
+// Caller must hold cs_main.  The game state costs a copy per block, which
+// is skipped during initial download.
+void static PublishChainSnapshot(bool fGameState = true)
+{
+    CChainSnapshot* psnapshot = new CChainSnapshot();
+    psnapshot->pindexBest = pindexBest;
+    psnapshot->nHeight = nBestHeight;
+    psnapshot->hashBest = hashBestChain;
+    psnapshot->nChainWork = nBestChainWork;
+    psnapshot->nTimeBestReceived = nTimeBestReceived;
+    if (fGameState && pindexBest && !IsInitialBlockDownload())
+        psnapshot->pstate.reset(new Game::GameState(GetCurrentGameState()));
+
+    CChainSnapshotRef pnew(psnapshot);
+    CRITICAL_BLOCK(cs_chainSnapshot)
+        pchainSnapshot.swap(pnew);
+}
+
 bool
 CBlock::SetBestChain (DatabaseSet& dbset, CBlockIndex* pindexNew)
 {
@@ -1592,7 +2777,7 @@ CBlock::SetBestChain (DatabaseSet& dbset, CBlockIndex* pindexNew)
             || !dbset.tx ().WriteHashBestChain (hash))
         {
             dbset.TxnAbort ();
-            InvalidChainFound(pindexNew);
+            InvalidChainFound(dbset, pindexNew);
             return error("SetBestChain() : ConnectBlock failed");
         }
         if (!dbset.TxnCommit ())
@@ -1614,7 +2799,7 @@ CBlock::SetBestChain (DatabaseSet& dbset, CBlockIndex* pindexNew)
         if (!Reorganize (dbset, pindexNew))
         {
             dbset.TxnAbort ();
-            InvalidChainFound(pindexNew);
+            InvalidChainFound(dbset, pindexNew);
             return error("SetBestChain() : Reorganize failed");
         }
     }
@@ -1623,10 +2808,12 @@ CBlock::SetBestChain (DatabaseSet& dbset, CBlockIndex* pindexNew)
     hashBestChain = hash;
     pindexBest = pindexNew;
     nBestHeight = pindexBest->nHeight;
-    bnBestChainWork = pindexNew->bnChainWork;
+    nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
-    printf("SetBestChain: new best=%s  height=%d  work=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, bnBestChainWork.ToString().c_str());
+    printf("SetBestChain: new best=%s  height=%d  work=%s\n", hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, CBigNum(nBestChainWork).ToString().c_str());
+
+    PruneBlockFiles(dbset);
 
     // Update best block in wallet (so we can detect restored wallets)
     if (!IsInitialBlockDownload())
@@ -1636,6 +2823,8 @@ CBlock::SetBestChain (DatabaseSet& dbset, CBlockIndex* pindexNew)
         EraseBadMoveTransactions ();
     }
 
+    PublishChainSnapshot();
+
     // When everything is done, call hook for new block so that the game
     // state can be finally updated in front-ends and such.
     hooks->NewBlockAdded();
@@ -1644,6 +2833,17 @@ CBlock::SetBestChain (DatabaseSet& dbset, CBlockIndex* pindexNew)
 }
 
 
+// -loadutxoset: the chain state snapshot waiting for its block
+static string strChainStateSnapshot;
+static uint256 hashChainStateSnapshot = 0;
+
+bool static IsChainStateSnapshotPending()
+{
+    return !strChainStateSnapshot.empty();
+}
+
+bool static LoadChainStateSnapshot(DatabaseSet& dbset, CBlockIndex* pindexSnapshot);
+
 bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
 {
     // Check for duplicate
@@ -1652,31 +2852,44 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos)
         return error("AddToBlockIndex() : %s already exists", hash.ToString().substr(0,20).c_str());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
-    if (!pindexNew)
-        return error("AddToBlockIndex() : new CBlockIndex failed");
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    CBlockIndex* pindexNew = NewBlockIndex();
+    *pindexNew = CBlockIndex(nFile, nBlockPos, *this);
+    mapBlockIndex.insert(make_pair(hash, pindexNew));
+    CBlockIndexMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
     }
-    pindexNew->bnChainWork = (pindexNew->pprev ? pindexNew->pprev->bnChainWork : 0) + pindexNew->GetBlockWork();
+    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : uint256(0)) + pindexNew->GetBlockWork();
+    HeaderConnected(hash, pindexNew);
 
     {
-      DatabaseSet dbset;
+      // Join the block batch of the initial download if there is one
+      auto_ptr<DatabaseSet> pdbsetOwn(pdbsetBlockBatch ? NULL : new DatabaseSet());
+      DatabaseSet& dbset = (pdbsetBlockBatch ? *pdbsetBlockBatch : *pdbsetOwn);
       dbset.TxnBegin ();
       dbset.tx ().WriteBlockIndex (CDiskBlockIndex(pindexNew));
       if (!dbset.TxnCommit ())
         return false;
 
-      // New best
-      if (pindexNew->bnChainWork > bnBestChainWork)
-        if (!SetBestChain (dbset, pindexNew))
-          return false;
+      // New best; while a chain state snapshot waits for its block
+      // (-loadutxoset), the blocks before it are only indexed
+      if (pindexNew->pprev && IsChainStateSnapshotPending())
+        {
+          if (hash == hashChainStateSnapshot
+              && !LoadChainStateSnapshot (dbset, pindexNew))
+            return false;
+        }
+      else if (pindexNew->nChainWork > nBestChainWork)
+        {
+          if (!SetBestChain (dbset, pindexNew))
+            return false;
+        }
+      else
+        QueueSpeculativeGameState (pindexNew);
     }
+    BlockBatchConnected();
 
     if (pindexNew == pindexBest)
     {
@@ -1708,40 +2921,23 @@ int GetOurChainID(int algo)
     return chain_id[algo];
 }
 
-bool CBlock::WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet)
+bool CBlock::WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet, int nHeight)
 {
     CRITICAL_BLOCK(cs_AppendBlockFile)
     {
-        DatabaseSet dbset("r+");
-
-        unsigned nSize;
-        unsigned nTotalSize = ::GetSerializeSize (*this, SER_DISK);
-        nTotalSize += sizeof (pchMessageStart) + sizeof (nSize);
-
-        // Open history file to append
-        CAutoFile fileout = AppendBlockFile (dbset, nFileRet, nTotalSize);
-        if (!fileout)
-            return error("CBlock::WriteToDisk() : AppendBlockFile failed");
-        const unsigned startPos = ftell (fileout);
+        auto_ptr<DatabaseSet> pdbsetOwn(pdbsetBlockBatch ? NULL : new DatabaseSet("r+"));
+        DatabaseSet& dbset = (pdbsetBlockBatch ? *pdbsetBlockBatch : *pdbsetOwn);
 
-        // Write index header
-        nSize = fileout.GetSerializeSize(*this);
-        fileout << FLATDATA(pchMessageStart) << nSize;
+        // Serialise the whole record first, it is written in one piece
+        unsigned int nSize = ::GetSerializeSize(*this, SER_DISK);
+        CDataStream ss(SER_DISK);
+        ss.reserve(sizeof(pchMessageStart) + sizeof(nSize) + nSize);
+        ss << FLATDATA(pchMessageStart) << nSize << *this;
 
-        // Write block
-        nBlockPosRet = ftell(fileout);
-        if (nBlockPosRet == -1)
-            return error("CBlock::WriteToDisk() : ftell failed");
-        fileout << *this;
-
-        // Check that the total size estimate was correct.
-        const unsigned writtenSize = ftell (fileout) - startPos;
-        if (writtenSize != nTotalSize)
-          return error ("CBlock::WriteToDisk: nTotalSize was wrong: %d / %d",
-                        nTotalSize, writtenSize);
-
-        // Flush stdio buffers and commit to disk before returning
-        FlushBlockFile(fileout);
+        unsigned int nPos;
+        if (!blockfilewriter.Append(dbset.tx(), ss, nHeight, nFileRet, nPos))
+            return error("CBlock::WriteToDisk() : appending to the block file failed");
+        nBlockPosRet = nPos + sizeof(pchMessageStart) + sizeof(nSize);
 
         return true;
     }
@@ -1850,7 +3046,7 @@ bool CBlock::CheckBlock(int nHeight) const
     return true;
 }
 
-bool CBlock::AcceptBlock()
+bool CBlock::AcceptBlock(unsigned int nFile, unsigned int nBlockPos)
 {
     // Check for duplicate
     uint256 hash = GetHash();
@@ -1858,7 +3054,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    CBlockIndexMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return error("AcceptBlock() : prev block not found");
     CBlockIndex* pindexPrev = (*mi).second;
@@ -1889,10 +3085,8 @@ bool CBlock::AcceptBlock()
     if (!hooks->Lockin(nHeight, hash))
         return error("AcceptBlock() : rejected by checkpoint lockin at %d", nHeight);
 
-    // Write block to history file
-    unsigned int nFile = -1;
-    unsigned int nBlockPos = 0;
-    if (!WriteToDisk(nFile, nBlockPos))
+    // Write block to history file, unless it is read back from there
+    if (nFile == -1 && !WriteToDisk(nFile, nBlockPos, nHeight))
         return error("AcceptBlock() : WriteToDisk failed");
     if (!AddToBlockIndex(nFile, nBlockPos))
         return error("AcceptBlock() : AddToBlockIndex failed");
@@ -1925,7 +3119,7 @@ CBlock::GetSpentOutputs (std::set<COutPoint>& outs) const
   GetSpentOutputsOfVtx (vgametx, outs);
 }
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fChecked)
 {
     // Check for duplicate
     uint256 hash = pblock->GetHash();
@@ -1936,8 +3130,9 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 
     // Preliminary checks
 
-    // This will be checked again in ConnectBlock with the actual height
-    if (!pblock->CheckBlock(INT_MAX))
+    // This will be checked again in ConnectBlock with the actual height.
+    // Blocks from the block check threads have been checked already.
+    if (!fChecked && !pblock->CheckBlock(INT_MAX))
         return error("ProcessBlock() : CheckBlock FAILED");
 
     // If don't already have its previous block, shunt it off to holding area until we get it
@@ -1948,15 +3143,20 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         mapOrphanBlocks.insert(make_pair(hash, pblock2));
         mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
-        // Ask this guy to fill in what we're missing
-        if (pfrom)
-            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
+        // Ask this guy to fill in what we're missing, unless the block was
+        // fetched out of order by headers-first sync
+        if (pfrom && !mapHeaderIndex.count(hash))
+            PushGetBlocksOrHeaders(pfrom, pindexBest, GetOrphanRoot(pblock2));
         return true;
     }
 
-    // Store to disk
+    // Store to disk, in one batch with the orphans that follow it
+    CBlockBatch batch(mapOrphanBlocksByPrev.count(hash) > 0);
     if (!pblock->AcceptBlock())
+    {
+        InvalidateHeaders(hash);
         return error("ProcessBlock() : AcceptBlock FAILED");
+    }
 
     // Recursively process any orphan blocks that depended on this one
     vector<uint256> vWorkQueue;
@@ -1971,6 +3171,8 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             CBlock* pblockOrphan = (*mi).second;
             if (pblockOrphan->AcceptBlock())
                 vWorkQueue.push_back(pblockOrphan->GetHash());
+            else
+                InvalidateHeaders(pblockOrphan->GetHash());
             mapOrphanBlocks.erase(pblockOrphan->GetHash());
             delete pblockOrphan;
         }
@@ -2090,103 +3292,178 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
     return file;
 }
 
-static unsigned int nCurrentBlockFile = 1;
-
-/* Append to a splitting block history file.  The given size is the number of
-   bytes that will be written.  This is used to check for disk space as well
-   as extend the file in preallocated chunks to combat fragmentation.  */
-FILE*
-AppendBlockFile (DatabaseSet& dbset, unsigned int& nFileRet, unsigned size)
+// The genesis block has no parent to be accepted after; it is added and
+// connected on its own
+bool static AcceptGenesisBlock(CBlock& block, unsigned int nFile, unsigned int nBlockPos)
 {
-    CTxDB& txdb = dbset.tx ();
+    if (!block.AddToBlockIndex(nFile, nBlockPos))
+        return false;
 
-    if (!CheckDiskSpace (size))
-      {
-        printf ("ERROR: AppendBlockFile: out of disk space");
-        return NULL;
-      }
-    if (fDebug)
-      printf ("AppendBlockFile: adding %u bytes\n", size);
+    // Join the block batch of -reindex if there is one
+    auto_ptr<DatabaseSet> pdbsetOwn(pdbsetBlockBatch ? NULL : new DatabaseSet());
+    DatabaseSet& dbset = (pdbsetBlockBatch ? *pdbsetBlockBatch : *pdbsetOwn);
+    return block.ConnectBlock (dbset, pindexGenesisBlock);
+}
 
-    FILE* file = NULL;
-    nFileRet = 0;
-    loop
+bool RemoveChainState()
+{
+    // Pruned blocks can't be read back
     {
-        /* We want to open the file in "r+" mode, so that we can write
-           not only at the end (so that overwriting reserved bytes is possible).
-           Make sure the file exists first.  */
-        file = OpenBlockFile (nCurrentBlockFile, 0, "ab");
-        fclose (file);
-        file = OpenBlockFile (nCurrentBlockFile, 0, "rb+");
-        if (!file)
-          goto error;
-
-        /* reserved should be an int, since otherwise -reserved below
-           fails and the fseek has a wrong effect.  */
-        int reserved = txdb.ReadBlockFileReserved (nCurrentBlockFile);
-        if (size <= reserved)
-          {
-            if (fseek (file, -reserved, SEEK_END) != 0)
-              goto error;
-            reserved -= size;
-            if (!txdb.WriteBlockFileReserved (nCurrentBlockFile, reserved))
-              goto error;
-            break;
-          }
-
-        if (fseek (file, 0, SEEK_END) != 0)
-          goto error;
-        const unsigned fileSize = ftell (file);
-        assert (fileSize >= reserved);
-        const unsigned addedChunk = std::max (BLOCKFILE_CHUNK_SIZE,
-                                              size - reserved);
-
-        if (fileSize + addedChunk <= BLOCKFILE_MAX_SIZE)
-          {
-            std::vector<char> buf(addedChunk, '\0');
-            const unsigned written = fwrite (&buf[0], 1, addedChunk, file);
-            if (written != addedChunk)
-              {
-                printf ("ERROR: AppendBlockFile: write to extend"
-                        " by %u bytes failed, only %u written\n",
-                        addedChunk, written);
-                goto error;
-              }
-            printf ("Block file extended by %u bytes.\n", written);
-              
-            reserved += addedChunk;
-            if (fseek (file, -reserved, SEEK_END) != 0)
-              goto error;
-            reserved -= size;
-            if (!txdb.WriteBlockFileReserved (nCurrentBlockFile, reserved))
-              goto error;
-            break;
-          }
+        CTxDB txdb("cr");
+        int nPruneHeight;
+        if (txdb.ReadBlockPruneHeight(nPruneHeight) && nPruneHeight >= 0)
+            return error("RemoveChainState() : blocks up to height %d have been pruned", nPruneHeight);
+        txdb.Close();
+    }
 
-        fclose(file);
-        nCurrentBlockFile++;
+    printf("Removing the block index and chain state for -reindex\n");
+    DBFlush(false);
+    const char* pszFiles[] = { "blkindex.dat", "blkindex.snapshot", "utxo.dat", "nameindexfull.dat", "game.dat" };
+    for (unsigned int i = 0; i < sizeof(pszFiles) / sizeof(pszFiles[0]); i++)
+    {
+        boost::system::error_code ec;
+        boost::filesystem::remove(boost::filesystem::path(GetDataDir()) / pszFiles[i], ec);
+        if (ec)
+            return error("RemoveChainState() : removing %s failed: %s", pszFiles[i], ec.message().c_str());
     }
+    return true;
+}
 
-    nFileRet = nCurrentBlockFile;
-    return file;
+// Blocks read back by -reindex before their parent, by the parent's hash
+static multimap<uint256, CBlockCheckJob*> mapReindexOrphansByPrev;
 
-error:
-    if (file)
-      fclose (file);
-    return NULL;
+// Add a block read back by -reindex and the blocks that were waiting for
+// it; returns how many were added
+int static ReindexBlock(CBlockCheckJob* pjob)
+{
+    const uint256 hash = pjob->block.GetHash();
+    if (!pjob->fOk || mapBlockIndex.count(hash))
+    {
+        // damaged, or a block that was stored twice
+        delete pjob;
+        return 0;
+    }
+    if (hash != hashGenesisBlock && !mapBlockIndex.count(pjob->block.hashPrevBlock))
+    {
+        mapReindexOrphansByPrev.insert(make_pair(pjob->block.hashPrevBlock, pjob));
+        return 0;
+    }
+
+    int nAdded = 0;
+    vector<CBlockCheckJob*> vWorkQueue(1, pjob);
+    for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+    {
+        CBlockCheckJob* pjobNext = vWorkQueue[i];
+        CBlock& block = pjobNext->block;
+        const uint256 hashNext = block.GetHash();
+        bool fAdded;
+        if (hashNext == hashGenesisBlock)
+            fAdded = AcceptGenesisBlock(block, pjobNext->nFile, pjobNext->nBlockPos);
+        else
+            fAdded = !mapBlockIndex.count(hashNext) && block.AcceptBlock(pjobNext->nFile, pjobNext->nBlockPos);
+        if (fAdded)
+        {
+            nAdded++;
+            for (multimap<uint256, CBlockCheckJob*>::iterator mi = mapReindexOrphansByPrev.lower_bound(hashNext);
+                 mi != mapReindexOrphansByPrev.upper_bound(hashNext);
+                 ++mi)
+                vWorkQueue.push_back((*mi).second);
+            mapReindexOrphansByPrev.erase(hashNext);
+        }
+        delete pjobNext;
+    }
+    return nAdded;
 }
 
-void FlushBlockFile(FILE *f)
+// -reindex: rebuild the block index and the chain state from the blocks in
+// the block files.  The blocks are deserialised and checked on the block
+// check threads and added in file order, at the position they are stored
+// at; only game transactions not stored yet are appended.
+bool static ReindexBlockFiles()
 {
-    fflush(f);
-    if (!IsInitialBlockDownload() || (nBestHeight + 1) % 500 == 0)
+    const int64 nScanStart = GetTimeMillis();
+
+    // The reserved space at the end of each file has to be known before
+    // anything is appended, so all files are scanned first
+    vector<CBlockFileRecord> vRecords;
+    uint64 nTotalBytes = 0;
+    unsigned int nFiles = 0;
     {
-#ifdef __WXMSW__
-        _commit(_fileno(f));
-#else
-        fsync(fileno(f));
-#endif
+        CTxDB txdb;
+        for (unsigned int nFile = 1; boost::filesystem::exists(strprintf("%s/blk%04u.dat", GetDataDir().c_str(), nFile)); nFile++)
+        {
+            const unsigned int nFirst = vRecords.size();
+            unsigned int nReserved, nSkipped;
+            if (!ScanBlockFile(nFile, vRecords, nReserved, nSkipped))
+                return false;
+            if (nSkipped > 0)
+                printf("ReindexBlockFiles() : skipped %u damaged bytes in blk%04u.dat\n", nSkipped, nFile);
+            if (!txdb.WriteBlockFileReserved(nFile, nReserved))
+                return error("ReindexBlockFiles() : WriteBlockFileReserved failed");
+            for (unsigned int i = nFirst; i < vRecords.size(); i++)
+                nTotalBytes += vRecords[i].nSize;
+            nFiles++;
+        }
     }
+    printf("Reindex: %"PRIszu" blocks (%"PRI64u" MB) in %u block files found in %"PRI64d"ms\n",
+           vRecords.size(), nTotalBytes / (1024 * 1024), nFiles, GetTimeMillis() - nScanStart);
+
+    const int64 nStart = GetTimeMillis();
+    int64 nLastProgress = nStart;
+    unsigned int nNext = 0;
+    unsigned int nDone = 0;
+    unsigned int nAdded = 0;
+    uint64 nDoneBytes = 0;
+    CRITICAL_BLOCK(cs_main)
+    {
+        CBlockBatch batch;
+        while (nDone < vRecords.size() && !fShutdown)
+        {
+            vector<CBlockCheckJob*> vJobs;
+            if (nBlockCheckThreads == 0)
+            {
+                CBlockCheckJob* pjob = new CBlockCheckJob(vRecords[nNext].nFile, vRecords[nNext].nPos);
+                pjob->fOk = pjob->Run();
+                vJobs.push_back(pjob);
+                nNext++;
+            }
+            else
+            {
+                while (nNext < vRecords.size() && blockcheckpipeline.PushFromDisk(vRecords[nNext].nFile, vRecords[nNext].nPos))
+                    nNext++;
+                blockcheckpipeline.PopChecked(vJobs, true);
+            }
+
+            // The jobs come back in the order of the records
+            BOOST_FOREACH(CBlockCheckJob* pjob, vJobs)
+            {
+                nDoneBytes += vRecords[nDone++].nSize;
+                nAdded += ReindexBlock(pjob);
+            }
+
+            const int64 nNow = GetTimeMillis();
+            if (nNow - nLastProgress >= 10000 || nDone == vRecords.size())
+            {
+                const double dSeconds = std::max(nNow - nStart, (int64)1) / 1000.0;
+                printf("Reindex: %u/%"PRIszu" blocks, height %d, %.0f blocks/s, %.1f MB/s\n",
+                       nDone, vRecords.size(), nBestHeight, nDone / dSeconds, nDoneBytes / dSeconds / (1024 * 1024));
+                nLastProgress = nNow;
+            }
+        }
+    }
+
+    // Whatever still waits for its parent can't be added
+    const unsigned int nOrphans = mapReindexOrphansByPrev.size();
+    for (multimap<uint256, CBlockCheckJob*>::iterator mi = mapReindexOrphansByPrev.begin(); mi != mapReindexOrphansByPrev.end(); ++mi)
+        delete (*mi).second;
+    mapReindexOrphansByPrev.clear();
+
+    printf("Reindex %s: %u blocks added up to height %d in %"PRI64d"s, %u without parent\n",
+           fShutdown ? "interrupted" : "done", nAdded, nBestHeight, (GetTimeMillis() - nStart) / 1000, nOrphans);
+    if (IsChainStateSnapshotPending() && !fShutdown)
+        return error("ReindexBlockFiles() : block %s of the chain state snapshot not found",
+                     hashChainStateSnapshot.ToString().substr(0,20).c_str());
+    return true;
 }
 
 bool LoadBlockIndex(bool fAllowNew)
@@ -2234,7 +3511,7 @@ bool LoadBlockIndex(bool fAllowNew)
           /* Go through each blkindex object loaded into memory and
              write it again to disk.  */
           printf ("Updating blkindex.dat data format...\n");
-          map<uint256, CBlockIndex*>::const_iterator mi;
+          CBlockIndexMap::iterator mi;
           for (mi = mapBlockIndex.begin (); mi != mapBlockIndex.end (); ++mi)
             {
               CDiskBlockIndex disk(mi->second);
@@ -2250,6 +3527,11 @@ bool LoadBlockIndex(bool fAllowNew)
         }
     }
 
+    // -reindex: the index is rebuilt from the blocks already stored, the
+    // genesis block included
+    if (fReindex && mapBlockIndex.empty() && !ReindexBlockFiles())
+        return false;
+
     //
     // Init with genesis block
     //
@@ -2266,16 +3548,31 @@ bool LoadBlockIndex(bool fAllowNew)
         // Start new block file
         unsigned int nFile;
         unsigned int nBlockPos;
-        if (!block.WriteToDisk(nFile, nBlockPos))
+        if (!block.WriteToDisk(nFile, nBlockPos, 0))
             return error("LoadBlockIndex() : writing genesis block to disk failed");
-        if (!block.AddToBlockIndex(nFile, nBlockPos))
+        if (!AcceptGenesisBlock(block, nFile, nBlockPos))
             return error("LoadBlockIndex() : genesis block not accepted");
+    }
 
-        DatabaseSet dbset;
-        if (!block.ConnectBlock (dbset, pindexGenesisBlock))
-            return error("LoadBlockIndex() : genesis block not accepted");
+    // Undo data is recorded from the first block connected with -prune on;
+    // once blocks are gone, the data directory can't be run without it
+    {
+        CTxDB txdb;
+        int nUndoHeight;
+        if (nPruneTarget > 0)
+        {
+            if (!txdb.ReadUndoHeight(nUndoHeight) && !txdb.WriteUndoHeight(nBestHeight + 1))
+                return error("LoadBlockIndex() : WriteUndoHeight failed");
+        }
+        else if (nBlockPruneHeight >= 0)
+            return error("LoadBlockIndex() : blocks up to height %d have been pruned, -prune is needed", nBlockPruneHeight);
+        else if (txdb.ReadUndoHeight(nUndoHeight) && !txdb.EraseUndoHeight())
+            return error("LoadBlockIndex() : EraseUndoHeight failed");
     }
 
+    fBlockIndexLoaded = true;
+    PublishChainSnapshot(false);
+
     return true;
 }
 
@@ -2285,7 +3582,7 @@ void PrintBlockTree()
 {
     // precompute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (CBlockIndexMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2386,7 +3683,7 @@ string GetWarnings(string strFor)
     }
 
     // Longer invalid proof-of-work chain
-    if (pindexBest && bnBestInvalidWork > bnBestChainWork + pindexBest->GetBlockWork() * 6)
+    if (pindexBest && CBigNum(nBestInvalidWork) > CBigNum(nBestChainWork) + CBigNum(pindexBest->GetBlockWork()) * 6)
     {
         nPriority = 2000;
         strStatusBar = strRPC = "WARNING: Displayed transactions may not be correct!  You may need to upgrade, or other nodes may need to upgrade.";
@@ -2505,7 +3802,7 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
     switch (inv.type)
     {
     case MSG_TX:    return mapTransactions.count(inv.hash) || mapOrphanTransactions.count(inv.hash) || txdb.ContainsTx(inv.hash);
-    case MSG_BLOCK: return mapBlockIndex.count(inv.hash) || mapOrphanBlocks.count(inv.hash);
+    case MSG_BLOCK: return mapBlockIndex.count(inv.hash) || mapOrphanBlocks.count(inv.hash) || blockcheckpipeline.Contains(inv.hash);
     }
     // Don't know what it is, just say we already got one
     return true;
@@ -2607,7 +3904,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (!pfrom->fClient && (nAskedForBlocks < 1 || vNodes.size() <= 1))
         {
             nAskedForBlocks++;
-            pfrom->PushGetBlocks(pindexBest, uint256(0));
+            PushGetBlocksOrHeaders(pfrom, pindexBest, uint256(0));
         }
 
         // Relay alerts
@@ -2756,11 +4053,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (inv.type == MSG_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                CBlockIndexMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
+                    // Pruned blocks can't be sent
                     CBlock block;
-                    block.ReadFromDisk((*mi).second);
+                    if (!block.ReadFromDisk((*mi).second))
+                        continue;
                     pfrom->PushMessage("block", block);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
@@ -2815,9 +4114,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 printf("  getblocks stopping at %d %s (%u bytes)\n", pindex->nHeight, pindex->GetBlockHash().ToString().substr(0,20).c_str(), nBytes);
                 break;
             }
-            pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
             CBlock block;
-            block.ReadFromDisk(pindex);
+            if (!block.ReadFromDisk(pindex))
+            {
+                printf("  getblocks stopping at unavailable block %d\n", pindex->nHeight);
+                break;
+            }
+            pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
             nBytes += block.GetSerializeSize(SER_NETWORK);
             if (--nLimit <= 0 || nBytes >= SendBufferSize()/2)
             {
@@ -2833,11 +4136,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "getheaders")
     {
-        /* 'getheaders' is never sent by the client code and thus also
-           not well tested.  Disable it for this reason until it is actually
-           used by some clients in production.  */
-        printf ("warning: ignored 'getheaders' message\n");
-#if 0
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -2846,7 +4144,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -2859,18 +4157,58 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 pindex = pindex->pnext;
         }
 
+        // The index doesn't keep the auxpow, so read the headers from disk.
+        // Headers of pruned blocks can't be served; a pruned node doesn't
+        // advertise NODE_HEADERS, but answer with what we have anyway.
         vector<CBlock> vHeaders;
-        int nLimit = 2000 + locator.GetDistanceBack();
-        printf("getheaders %d to %s limit %d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().substr(0,20).c_str(), nLimit);
+        int nLimit = MAX_HEADERS_RESULTS;
+        printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().substr(0,20).c_str());
         for (; pindex; pindex = pindex->pnext)
         {
-            vHeaders.push_back(pindex->GetBlockHeader());
+            CBlock header;
+            if (!header.ReadFromDisk(pindex->nFile, pindex->nBlockPos, false))
+            {
+                if (pindex->nHeight <= nBlockPruneHeight)
+                    break;
+                return error("getheaders : failed to read block header at height %d", pindex->nHeight);
+            }
+            vHeaders.push_back(header);
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                 break;
         }
 
         pfrom->PushMessage("headers", vHeaders);
-#endif
+    }
+
+
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+            return error("message headers size() = %d", vHeaders.size());
+
+        CBlockIndex* pindexLast = NULL;
+        BOOST_FOREACH(CBlock& header, vHeaders)
+        {
+            header.CacheHashes();
+            if (!AcceptBlockHeader(header, pindexLast))
+            {
+                // Possibly on a fork we don't know yet, start from our best
+                if (!LookupBlockOrHeader(header.hashPrevBlock))
+                    pfrom->PushGetHeaders(GetBestHeader());
+                return error("headers : header %s not accepted", header.GetHash().ToString().substr(0,20).c_str());
+            }
+        }
+        if (pindexLast)
+        {
+            pfrom->fServedHeaders = true;
+            printf("received %d headers up to height %d, best header height %d\n", (int)vHeaders.size(), pindexLast->nHeight, GetBestHeaderHeight());
+        }
+
+        // A full message means there are more
+        if (vHeaders.size() == MAX_HEADERS_RESULTS && pindexLast)
+            pfrom->PushGetHeaders(pindexLast);
     }
 
 
@@ -2880,6 +4218,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CDataStream vMsg(vRecv);
         CTransaction tx;
         vRecv >> tx;
+        tx.CacheHash();
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
@@ -2913,6 +4252,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                     const CDataStream& vMsg = *((*mi).second);
                     CTransaction tx;
                     CDataStream(vMsg) >> tx;
+                    tx.CacheHash();
                     CInv inv(MSG_TX, tx.GetHash());
 
                     if (tx.AcceptToMemoryPool(true))
@@ -2941,12 +4281,21 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     {
         CBlock block;
         vRecv >> block;
+        block.CacheHashes();
 
         printf("received block %s\n", block.GetHash().ToString().substr(0,20).c_str());
         // block.print();
 
         CInv inv(MSG_BLOCK, block.GetHash());
         pfrom->AddInventoryKnown(inv);
+        MarkBlockReceived(pfrom, inv.hash);
+
+        // During initial download, leave the context-free checks to the
+        // block check threads; ProcessCheckedBlocks takes it from there
+        if (nBlockCheckThreads > 0 && IsInitialBlockDownload()
+            && !mapBlockIndex.count(inv.hash) && !blockcheckpipeline.Contains(inv.hash)
+            && blockcheckpipeline.Push(pfrom, block))
+            return true;
 
         if (ProcessBlock(pfrom, &block))
             mapAlreadyAskedFor.erase(inv);
@@ -3191,7 +4540,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Start block sync
         if (pto->fStartSync) {
             pto->fStartSync = false;
-            pto->PushGetBlocks(pindexBest, uint256(0));
+            PushGetBlocksOrHeaders(pto, pindexBest, uint256(0));
         }
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -3357,6 +4706,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
             pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
+        if (!pto->fClient && pto->nVersion >= BLKS_VERSION && HeadersFirstEnabled())
+            FindBlocksToDownload(pto, vGetData);
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
@@ -3442,27 +4793,6 @@ unsigned int static ScanHash_CryptoPP(char* pmidstate, char* pdata, char* phash1
 }
 
 
-class COrphan
-{
-public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-
-    COrphan(CTransaction* ptxIn)
-    {
-        ptx = ptxIn;
-        dPriority = 0;
-    }
-
-    void print() const
-    {
-        printf("COrphan(hash=%s, dPriority=%.1f)\n", ptx->GetHash().ToString().substr(0,10).c_str(), dPriority);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            printf("   setDependsOn %s\n", hash.ToString().substr(0,10).c_str());
-    }
-};
-
 void CBlock::SetNull()
 {
     nVersion = BLOCK_VERSION_DEFAULT | (GetOurChainID(ALGO_SHA256D) * BLOCK_VERSION_CHAIN_START);
@@ -3477,29 +4807,39 @@ void CBlock::SetNull()
     vMerkleTree.clear();
     vGameMerkleTree.clear();
     auxpow.reset();
+    fHashCached = false;
+    fPoWHashCached = false;
 
     nGameTxFile = nGameTxPos = -1;
 }
 
-CBlock* CreateNewBlock(CReserveKey& reservekey, int algo)
+static CCriticalSection cs_templateStats;
+static CBlockTemplateStats templateStats;
+
+void GetBlockTemplateStats(CBlockTemplateStats& stats)
 {
-    // Create new block
-    auto_ptr<CBlock> pblock(new CBlock());
-    if (!pblock.get())
-        return NULL;
+    CRITICAL_BLOCK(cs_templateStats)
+        stats = templateStats;
+}
 
-    pblock->nVersion = BLOCK_VERSION_DEFAULT | (GetOurChainID(algo) * BLOCK_VERSION_CHAIN_START);
-    switch (algo)
-    {
-        case ALGO_SHA256D:
-            break;
-        case ALGO_SCRYPT:
-            pblock->nVersion |= BLOCK_VERSION_SCRYPT;
-            break;
-        default:
-            error("CreateNewBlock: bad algo");
-            return NULL;
-    }
+CBlockTemplate::CBlockTemplate(CReserveKey& reservekeyIn, int algoIn)
+  : reservekey(reservekeyIn), algo(algoIn), pindexPrev(NULL),
+    nTransactionsUpdatedLast(0), pgameStepMiner(NULL)
+{
+}
+
+CBlockTemplate::~CBlockTemplate()
+{
+    delete pgameStepMiner;
+}
+
+// Start over on top of pindexBest
+void CBlockTemplate::Reset(DatabaseSet& dbset)
+{
+    block.SetNull();
+    block.nVersion = BLOCK_VERSION_DEFAULT | (GetOurChainID(algo) * BLOCK_VERSION_CHAIN_START);
+    if (algo == ALGO_SCRYPT)
+        block.nVersion |= BLOCK_VERSION_SCRYPT;
 
     // Create coinbase tx
     CTransaction txNew;
@@ -3509,149 +4849,202 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, int algo)
     txNew.vout[0].scriptPubKey.SetBitcoinAddress(reservekey.GetReservedKey());
 
     // Add our coinbase tx as first transaction
-    pblock->vtx.push_back(txNew);
+    block.vtx.push_back(txNew);
+
+    testPool = CTestPool();
+    nFees = 0;
+    nTax = 0;
+    nBlockSize = 1000;
+    nBlockSigOps = 100;
+    setIncluded.clear();
+    setRejected.clear();
+
+    // If we do not exclude invalid game transactions, the block won't be accepted by ConnectBlock
+    // Also we need to compute tax
+    delete pgameStepMiner;
+    pgameStepMiner = NULL;
+    pgameStepMiner = new GameStepMiner(dbset, pindexBest);
+    pindexPrev = pindexBest;
 
-    CBlockIndex* pindexPrev;
-
-    // Collect memory pool transactions into the block
-    int64 nFees = 0;
+    // Fill in header
+    block.hashPrevBlock = pindexPrev->GetBlockHash();
+    block.nBits         = GetNextWorkRequired(pindexPrev, algo);
+    block.nNonce        = 0;
+}
 
-    CRITICAL_BLOCK(cs_main)
-    CRITICAL_BLOCK(cs_mapTransactions)
+// Add memory pool transactions that aren't in the block yet.  Returns
+// whether any were added.
+bool CBlockTemplate::AddTransactions(DatabaseSet& dbset)
+{
+    bool fAdded = false;
+
+    // Collect transactions into block by fee rate.  Transactions that
+    // depend on others in the pool wait for them in mapWaiting and come
+    // back through mapReleased once they are in the block.
+    multimap<uint256, CMemPoolEntry*> mapWaiting;
+    multimap<int64, CMemPoolEntry*> mapReleased;
+    CMemPoolIndex::iterator it = mempoolindex.begin();
+    // AcceptToMemoryPool rejects transactions below 100 bytes
+    while (nBlockSize + 100 < MAX_BLOCK_SIZE_GEN)
     {
-        DatabaseSet dbset("r");
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        multimap<double, CTransaction*> mapPriority;
-        for (map<uint256, CTransaction>::iterator mi = mapTransactions.begin(); mi != mapTransactions.end(); ++mi)
+        // Take the transaction with the highest fee rate
+        CMemPoolEntry* pentry;
+        if (!mapReleased.empty() && (it == mempoolindex.end() || mapReleased.rbegin()->first >= it->first))
         {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || !tx.IsFinal())
-                continue;
+            multimap<int64, CMemPoolEntry*>::iterator mi = mapReleased.end();
+            --mi;
+            pentry = mi->second;
+            mapReleased.erase(mi);
+        }
+        else if (it != mempoolindex.end())
+            pentry = (it++)->second;
+        else
+            break;
+        CTransaction& tx = *pentry->ptx;
+        uint256 hash = tx.GetHash();
+        if (setIncluded.count(hash) || setRejected.count(hash))
+            continue;
+        if (tx.IsCoinBase() || !tx.IsFinal())
+            continue;
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        // Has to wait for dependencies
+        bool fWaiting = false;
+        BOOST_FOREACH(const uint256& hashParent, pentry->setParents)
+            if (!setIncluded.count(hashParent))
             {
-                /* Read prev output from UTXO set.  */
-                CUtxoEntry txo;
-                if (!dbset.utxo ().ReadUtxo (txin.prevout, txo))
-                {
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-
-                    assert (!dbset.utxo ().ReadUtxo (txin.prevout, txo));
-                    continue;
-                }
+                mapWaiting.insert(make_pair(hashParent, pentry));
+                fWaiting = true;
+                break;
+            }
+        if (fWaiting)
+            continue;
 
-                /* Calculate priority.  */
-                const int64 nValueIn = txo.txo.nValue;
-                const int nConf = 1 + nBestHeight - txo.height;
-                assert (nConf > 0);
-                dPriority += static_cast<double> (nValueIn) * nConf;
+        // Size limits; the block only grows, so what doesn't fit now
+        // never will
+        unsigned int nTxSize = pentry->nTxSize;
+        int nTxSigOps = pentry->nSigOps;
+        if (nBlockSize + nTxSize >= MAX_BLOCK_SIZE_GEN
+            || nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        {
+            setRejected.insert(hash);
+            continue;
+        }
 
-                if (fDebug && GetBoolArg("-printpriority"))
-                    printf("priority     nValueIn=%.8f nConf=%d dPriority=%.4f\n", static_cast<double> (nValueIn) / COIN, nConf, dPriority);
-            }
+        // Transaction fee required depends on block size
+        double dPriority = pentry->GetPriority(pindexPrev->nHeight);
+        bool fAllowFree = (nBlockSize + nTxSize < 4000 || CTransaction::AllowFree(dPriority));
+        int64 nMinFee = tx.GetMinFee(nBlockSize, fAllowFree, true);
+
+        // Connecting shouldn't fail due to dependency on other memory pool transactions
+        // because we're already processing them in order of dependency
+        CTestPool tmpPool(testPool);
+        if (!tx.ConnectInputs (dbset, tmpPool, CDiskTxPos(1,1,1),
+                               pindexPrev, nFees, false, true, nMinFee)
+            || !pgameStepMiner->AddTx(tx))
+        {
+            setRejected.insert(hash);
+            continue;
+        }
+        testPool.swap (tmpPool);
+
+        if (fDebug && GetBoolArg("-printpriority"))
+            printf("priority %.4f fee %s feerate %"PRI64d" %s\n", dPriority, FormatMoney(pentry->nFee).c_str(), pentry->nFeeRate, hash.ToString().substr(0,10).c_str());
+
+        // Added
+        block.vtx.push_back(tx);
+        nBlockSize += nTxSize;
+        nBlockSigOps += nTxSigOps;
+        setIncluded.insert(hash);
+        fAdded = true;
+
+        // Transactions that depend on this one can go in now
+        for (multimap<uint256, CMemPoolEntry*>::iterator mi = mapWaiting.lower_bound(hash);
+             mi != mapWaiting.upper_bound(hash); ++mi)
+            mapReleased.insert(make_pair(mi->second->nFeeRate, mi->second));
+        mapWaiting.erase(hash);
+    }
 
-            // Priority is sum(valuein * age) / txsize
-            dPriority /= ::GetSerializeSize(tx, SER_NETWORK);
+    return fAdded;
+}
 
-            if (porphan)
-                porphan->dPriority = dPriority;
-            else
-                mapPriority.insert(make_pair(-dPriority, &(*mi).second));
+void CBlockTemplate::UpdateCoinbase()
+{
+    block.vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees + nTax);
+    block.nTime = max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
+    block.hashMerkleRoot = block.BuildMerkleTree(false);
+    vCoinbaseBranch = block.GetMerkleBranch(0, false);
+}
 
-            if (fDebug && GetBoolArg("-printpriority"))
-            {
-                printf("priority %.4f %s\n%s", dPriority, tx.GetHash().ToString().substr(0,10).c_str(), tx.ToString().c_str());
-                if (porphan)
-                    porphan->print();
-                printf("\n");
-            }
-        }
+bool CBlockTemplate::Update()
+{
+    if (pindexPrev == pindexBest && nTransactionsUpdatedLast == nTransactionsUpdated)
+        return false;
 
-        // If we do not exclude invalid game transactions, the block won't be accepted by ConnectBlock
-        // Also we need to compute tax
-        pindexPrev = pindexBest;
-        GameStepMiner gameStepMiner(dbset, pindexPrev);
+    int64 nStart = GetTimeMicros();
+    bool fBuild = false;
+    bool fChanged = false;
+    CRITICAL_BLOCK(cs_main)
+    CRITICAL_BLOCK(cs_mapTransactions)
+    {
+        nTransactionsUpdatedLast = nTransactionsUpdated;
 
-        // Collect transactions into block
-        CTestPool testPool;
-        uint64 nBlockSize = 1000;
-        int nBlockSigOps = 100;
-        while (!mapPriority.empty())
+        DatabaseSet dbset("r");
+        if (pindexPrev != pindexBest)
         {
-            // Take highest priority transaction off priority queue
-            double dPriority = -(*mapPriority.begin()).first;
-            CTransaction& tx = *(*mapPriority.begin()).second;
-            mapPriority.erase(mapPriority.begin());
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK);
-            if (nBlockSize + nTxSize >= MAX_BLOCK_SIZE_GEN)
-                continue;
-            int nTxSigOps = tx.GetSigOpCount();
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+            Reset(dbset);
+            fBuild = true;
+        }
+        else
+            pgameStepMiner->SetDatabase(&dbset);
 
-            // Transaction fee required depends on block size
-            bool fAllowFree = (nBlockSize + nTxSize < 4000 || CTransaction::AllowFree(dPriority));
-            int64 nMinFee = tx.GetMinFee(nBlockSize, fAllowFree, true);
+        mempoolindex.Update(dbset, pindexPrev);
+        fChanged = AddTransactions(dbset);
 
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            CTestPool tmpPool(testPool);
-            if (!tx.ConnectInputs (dbset, tmpPool, CDiskTxPos(1,1,1),
-                                   pindexPrev, nFees, false, true, nMinFee))
-                continue;
-            if (!gameStepMiner.AddTx(tx))
-                continue;
-            testPool.swap (tmpPool);
+        // The game step pays tax (banking, kills) even without any
+        // transactions from the pool, so a fresh template needs it too
+        if (fBuild || fChanged)
+            nTax = pgameStepMiner->ComputeTax();
+        pgameStepMiner->SetDatabase(NULL);
 
-            // Added
-            pblock->vtx.push_back(tx);
-            nBlockSize += nTxSize;
-            nBlockSigOps += nTxSigOps;
+        if (fBuild || fChanged)
+            UpdateCoinbase();
+    }
+    if (!fBuild && !fChanged)
+        return false;
 
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                            mapPriority.insert(make_pair(-porphan->dPriority, porphan->ptx));
-                    }
-                }
-            }
+    int64 nTime = GetTimeMicros() - nStart;
+    CRITICAL_BLOCK(cs_templateStats)
+    {
+        if (fBuild)
+        {
+            templateStats.nBuilds++;
+            templateStats.nLastBuildTime = nTime;
+            templateStats.nTotalBuildTime += nTime;
+        }
+        else
+        {
+            templateStats.nUpdates++;
+            templateStats.nLastUpdateTime = nTime;
+            templateStats.nTotalUpdateTime += nTime;
         }
-
-        int64 nTax = gameStepMiner.ComputeTax();
-        nFees += nTax;
     }
-    pblock->vtx[0].vout[0].nValue = GetBlockValue(pindexPrev->nHeight+1, nFees);
+    if (fDebug)
+        printf("CBlockTemplate::Update() : %s %d transactions in %"PRI64d"us\n", fBuild ? "built" : "updated", (int)block.vtx.size(), nTime);
 
-    // Fill in header
-    pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree(false);
-    pblock->nTime          = max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
-    pblock->nBits          = GetNextWorkRequired(pindexPrev, algo);
-    pblock->nNonce         = 0;
+    return true;
+}
+
+CBlock* CreateNewBlock(CReserveKey& reservekey, int algo)
+{
+    if (algo != ALGO_SHA256D && algo != ALGO_SCRYPT)
+    {
+        error("CreateNewBlock: bad algo");
+        return NULL;
+    }
 
-    return pblock.release();
+    CBlockTemplate blocktemplate(reservekey, algo);
+    blocktemplate.Update();
+    return new CBlock(blocktemplate.GetBlock());
 }
 
 
@@ -4263,7 +5656,7 @@ std::string CBlockIndex::ToString() const
             GetBlockHash().ToString().substr(0,20).c_str());
 }
 
-CBigNum CBlockIndex::GetBlockWork() const
+uint256 CBlockIndex::GetBlockWork() const
 {
     CBigNum bnTarget;
     bnTarget.SetCompact(nBits);
@@ -4277,5 +5670,564 @@ CBigNum CBlockIndex::GetBlockWork() const
     if (GetAlgo() == ALGO_SCRYPT)
         work <<= 12;
 
-    return work;
+    return work.getuint256();
+}
+
+CBlockIndex* NewBlockIndex()
+{
+    return blockIndexArena.Allocate();
+}
+
+size_t GetBlockIndexMemoryUsage()
+{
+    return blockIndexArena.GetMemoryUsage();
+}
+
+CBlockIndexMap::iterator CBlockIndexMap::find(const uint256& hash) const
+{
+    if (vTable.empty())
+        return end();
+    const size_t nMask = vTable.size() - 1;
+    for (size_t i = GetSlot(hash); vTable[i] != NULL; i = (i + 1) & nMask)
+        if (*vTable[i]->phashBlock == hash)
+            return iterator(&vTable[i], &vTable[0] + vTable.size());
+    return end();
+}
+
+std::pair<CBlockIndexMap::iterator, bool> CBlockIndexMap::insert(const value_type& item)
+{
+    iterator mi = find(item.first);
+    if (mi != end())
+        return make_pair(mi, false);
+
+    // Keep the load factor below 3/4
+    if ((nSize + 1) * 4 > vTable.size() * 3)
+        Rehash(std::max(nBits + 1, 10U));
+
+    CBlockIndex* pindex = item.second;
+    pindex->hashBlock = item.first;
+    pindex->phashBlock = &pindex->hashBlock;
+
+    const size_t nMask = vTable.size() - 1;
+    size_t i = GetSlot(item.first);
+    while (vTable[i] != NULL)
+        i = (i + 1) & nMask;
+    vTable[i] = pindex;
+    nSize++;
+    return make_pair(iterator(&vTable[i], &vTable[0] + vTable.size()), true);
+}
+
+void CBlockIndexMap::reserve(size_t nCount)
+{
+    unsigned int nBitsNew = std::max(nBits, 10U);
+    while (((size_t)1 << nBitsNew) * 3 < nCount * 4)
+        nBitsNew++;
+    if (nBitsNew > nBits)
+        Rehash(nBitsNew);
+}
+
+void CBlockIndexMap::Rehash(unsigned int nBitsNew)
+{
+    if (vTable.empty())
+        nSalt = GetRand(~(uint64)0);
+
+    std::vector<CBlockIndex*> vOld;
+    vOld.swap(vTable);
+    vTable.resize((size_t)1 << nBitsNew, NULL);
+    nBits = nBitsNew;
+
+    const size_t nMask = vTable.size() - 1;
+    BOOST_FOREACH(CBlockIndex* pindex, vOld)
+    {
+        if (pindex == NULL)
+            continue;
+        size_t i = GetSlot(*pindex->phashBlock);
+        while (vTable[i] != NULL)
+            i = (i + 1) & nMask;
+        vTable[i] = pindex;
+    }
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Block index snapshot
+//
+
+// The block index as of the last clean shutdown, stored as one flat file
+// that is loaded in a single pass instead of scanning blkindex.dat.
+// Entries are in height order, so parents always come before children.
+// The file ends with a hash of everything before it.
+static const int BLOCK_INDEX_SNAPSHOT_VERSION = 1;
+
+static std::string GetBlockIndexSnapshotPath()
+{
+    return GetDataDir() + "/blkindex.snapshot";
+}
+
+static void WriteSnapshotData(CAutoFile& fileout, SHA256_CTX& ctx, CDataStream& ss)
+{
+    if (ss.empty())
+        return;
+    SHA256_Update(&ctx, (unsigned char*)&ss.begin()[0], ss.size());
+    fileout.write(&ss.begin()[0], ss.size());
+    ss.clear();
+}
+
+bool WriteBlockIndexSnapshot()
+{
+    CRITICAL_BLOCK(cs_main)
+    {
+        if (!fBlockIndexLoaded || pindexBest == NULL)
+            return false;
+        int64 nStart = GetTimeMillis();
+
+        vector<pair<int, CBlockIndex*> > vSortedByHeight;
+        vSortedByHeight.reserve(mapBlockIndex.size());
+        for (CBlockIndexMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+            vSortedByHeight.push_back(make_pair(mi->second->nHeight, mi->second));
+        sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+        // write to a temporary file first so an interrupted write never
+        // replaces a good snapshot
+        const string strPath = GetBlockIndexSnapshotPath();
+        const string strTmp = strPath + ".new";
+        CAutoFile fileout = fopen(strTmp.c_str(), "wb");
+        if (!fileout)
+            return error("WriteBlockIndexSnapshot() : cannot open %s", strTmp.c_str());
+
+        try
+        {
+            SHA256_CTX ctx;
+            SHA256_Init(&ctx);
+            CDataStream ss(SER_DISK);
+            ss.reserve(1100000);
+            ss << BLOCK_INDEX_SNAPSHOT_VERSION << hashBestChain << (unsigned int)vSortedByHeight.size();
+            BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+            {
+                const CBlockIndex* pindex = item.second;
+                ss << pindex->GetBlockHash() << (pindex->pprev ? pindex->pprev->GetBlockHash() : uint256(0));
+                ss << pindex->nFile << pindex->nBlockPos << pindex->nHeight << pindex->nChainWork;
+                ss << pindex->nVersion << pindex->hashMerkleRoot << pindex->hashGameMerkleRoot;
+                ss << pindex->nTime << pindex->nBits << pindex->nNonce;
+                if (ss.size() >= 1000000)
+                    WriteSnapshotData(fileout, ctx, ss);
+            }
+            WriteSnapshotData(fileout, ctx, ss);
+
+            // same double SHA-256 as Hash()
+            uint256 hash1;
+            SHA256_Final((unsigned char*)&hash1, &ctx);
+            uint256 hash2;
+            SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+            fileout << hash2;
+        }
+        catch (std::exception &e) {
+            fileout.fclose();
+            boost::filesystem::remove(strTmp);
+            return error("WriteBlockIndexSnapshot() : I/O error writing %s", strTmp.c_str());
+        }
+        fflush(fileout);
+#ifdef __WXMSW__
+        _commit(_fileno(fileout));
+#else
+        fsync(fileno(fileout));
+#endif
+        fileout.fclose();
+
+        try
+        {
+            boost::filesystem::remove(strPath);
+            boost::filesystem::rename(strTmp, strPath);
+        }
+        catch (boost::filesystem::filesystem_error &e) {
+            return error("WriteBlockIndexSnapshot() : %s", e.what());
+        }
+
+        printf("WriteBlockIndexSnapshot(): %"PRIszu" blocks written in %"PRI64d"ms\n",
+               vSortedByHeight.size(), GetTimeMillis() - nStart);
+    }
+    return true;
+}
+
+static bool ParseBlockIndexSnapshot(const char* pbegin, size_t nSize, const uint256& hashBestExpected)
+{
+    if (nSize < sizeof(uint256))
+        return false;
+    const char* pend = pbegin + nSize - sizeof(uint256);
+    uint256 hashChecksum;
+    memcpy(&hashChecksum, pend, sizeof(hashChecksum));
+    if (Hash(pbegin, pend) != hashChecksum)
+    {
+        printf("ReadBlockIndexSnapshot() : checksum mismatch, ignoring snapshot\n");
+        return false;
+    }
+
+    try
+    {
+        CMappedStream s(pbegin, pend);
+        int nSnapshotVersion;
+        uint256 hashBest;
+        unsigned int nCount;
+        s >> nSnapshotVersion >> hashBest >> nCount;
+        if (nSnapshotVersion != BLOCK_INDEX_SNAPSHOT_VERSION || hashBest != hashBestExpected)
+        {
+            printf("ReadBlockIndexSnapshot() : snapshot is stale, ignoring it\n");
+            return false;
+        }
+
+        // Nothing is added to the index before this point; if the snapshot
+        // turns out to be broken after it, the caller drops what was added
+        mapBlockIndex.reserve(mapBlockIndex.size() + nCount);
+        for (unsigned int i = 0; i < nCount; i++)
+        {
+            uint256 hash, hashPrev;
+            s >> hash >> hashPrev;
+            CBlockIndex* pindexNew = NewBlockIndex();
+            if (!mapBlockIndex.insert(make_pair(hash, pindexNew)).second)
+                return error("ReadBlockIndexSnapshot() : duplicate block %s", hash.ToString().c_str());
+            if (hashPrev != 0)
+            {
+                pindexNew->pprev = mapBlockIndex[hashPrev];
+                if (pindexNew->pprev == NULL)
+                    return error("ReadBlockIndexSnapshot() : parent of block %s missing", hash.ToString().c_str());
+            }
+            s >> pindexNew->nFile >> pindexNew->nBlockPos >> pindexNew->nHeight >> pindexNew->nChainWork;
+            s >> pindexNew->nVersion >> pindexNew->hashMerkleRoot >> pindexNew->hashGameMerkleRoot;
+            s >> pindexNew->nTime >> pindexNew->nBits >> pindexNew->nNonce;
+        }
+
+        // Link the main chain
+        CBlockIndex* pindexBestSnapshot = mapBlockIndex[hashBest];
+        if (pindexBestSnapshot == NULL)
+            return error("ReadBlockIndexSnapshot() : best block missing");
+        for (CBlockIndex* pindex = pindexBestSnapshot; pindex->pprev; pindex = pindex->pprev)
+            pindex->pprev->pnext = pindex;
+        pindexGenesisBlock = mapBlockIndex[hashGenesisBlock];
+    }
+    catch (std::exception &e) {
+        return error("ReadBlockIndexSnapshot() : %s", e.what());
+    }
+    return true;
+}
+
+bool ReadBlockIndexSnapshot(const uint256& hashBestExpected)
+{
+    const string strPath = GetBlockIndexSnapshotPath();
+    if (!boost::filesystem::exists(strPath))
+        return false;
+
+    int64 nStart = GetTimeMillis();
+    bool fRet = false;
+    try
+    {
+        boost::interprocess::file_mapping file(strPath.c_str(), boost::interprocess::read_only);
+        boost::interprocess::mapped_region region(file, boost::interprocess::read_only);
+        fRet = ParseBlockIndexSnapshot(static_cast<const char*>(region.get_address()), region.get_size(), hashBestExpected);
+    }
+    catch (boost::interprocess::interprocess_exception& e)
+    {
+        printf("ReadBlockIndexSnapshot() : mapping %s failed: %s\n", strPath.c_str(), e.what());
+    }
+
+    // The snapshot only matches the database until the block index changes
+    // again; remove it so that an unclean shutdown can't leave it stale
+    boost::system::error_code ec;
+    boost::filesystem::remove(strPath, ec);
+
+    if (fRet)
+        printf("ReadBlockIndexSnapshot(): %"PRIszu" blocks loaded in %"PRI64d"ms\n",
+               mapBlockIndex.size(), GetTimeMillis() - nStart);
+    else if (!mapBlockIndex.empty())
+    {
+        // Leave the index empty for the database scan
+        printf("ReadBlockIndexSnapshot() : dropping the %"PRIszu" blocks read from the broken snapshot\n",
+               mapBlockIndex.size());
+        mapBlockIndex.clear();
+        blockIndexArena.Clear();
+        pindexGenesisBlock = NULL;
+    }
+    return fRet;
+}
+
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Chain state snapshot
+//
+
+// The UTXO set, name index and game state at one block as one flat file
+// (dumputxoset): a header with the block, then the UTXO entries and the
+// names in key order, then the game state, and a hash of everything
+// before it at the end.  -loadutxoset takes it in place of connecting the
+// blocks up to that one while -reindex rebuilds the block index.
+static const int CHAIN_STATE_SNAPSHOT_VERSION = 1;
+
+// Set when a snapshot was loaded, for -verifyutxoset
+static bool fChainStateSnapshotLoaded = false;
+
+bool DumpChainStateSnapshot(const string& strPath, CChainStateSnapshotInfo& info)
+{
+    CRITICAL_BLOCK(cs_main)
+    {
+        if (pindexBest == NULL)
+            return false;
+        int64 nStart = GetTimeMillis();
+        info.hashBlock = hashBestChain;
+        info.nHeight = nBestHeight;
+
+        // write to a temporary file first so an interrupted dump never
+        // leaves a file that looks complete
+        const string strTmp = strPath + ".new";
+        FILE* file = fopen(strTmp.c_str(), "wb");
+        if (!file)
+            return error("DumpChainStateSnapshot() : cannot open %s", strTmp.c_str());
+
+        bool fOk = false;
+        try
+        {
+            // Changes to the UTXO set are flushed when each block's
+            // transaction commits, so utxo.dat is complete under cs_main
+            DatabaseSet dbset("r");
+            CUtxoDB utxodb("r");
+            CHashedFileWriter out(file);
+            out << CHAIN_STATE_SNAPSHOT_VERSION << info.hashBlock << info.nHeight;
+            fOk = utxodb.Dump(out, info.nUtxo)
+                  && dbset.name().Dump(out, info.nNames)
+                  && DumpGameState(dbset, pindexBest, out);
+            if (fOk)
+                info.hashFile = out.Finish();
+        }
+        catch (std::exception &e) {
+            printf("DumpChainStateSnapshot() : %s\n", e.what());
+            fOk = false;
+        }
+        if (fOk)
+        {
+            fflush(file);
+#ifdef __WXMSW__
+            _commit(_fileno(file));
+#else
+            fsync(fileno(file));
+#endif
+        }
+        fclose(file);
+        if (!fOk)
+        {
+            boost::filesystem::remove(strTmp);
+            return error("DumpChainStateSnapshot() : writing %s failed", strTmp.c_str());
+        }
+
+        try
+        {
+            boost::filesystem::remove(strPath);
+            boost::filesystem::rename(strTmp, strPath);
+        }
+        catch (boost::filesystem::filesystem_error &e) {
+            return error("DumpChainStateSnapshot() : %s", e.what());
+        }
+
+        printf("DumpChainStateSnapshot(): %u UTXO entries and %u names at height %d written to %s in %"PRI64d"ms\n",
+               info.nUtxo, info.nNames, info.nHeight, strPath.c_str(), GetTimeMillis() - nStart);
+    }
+    return true;
+}
+
+// Map a snapshot and check its hash; the data before the hash is
+// [pbeginRet, pendRet)
+bool static MapChainStateSnapshot(const string& strPath, boost::interprocess::mapped_region& region,
+                                  const char*& pbeginRet, const char*& pendRet)
+{
+    try
+    {
+        boost::interprocess::file_mapping file(strPath.c_str(), boost::interprocess::read_only);
+        boost::interprocess::mapped_region regionFile(file, boost::interprocess::read_only);
+        region.swap(regionFile);
+    }
+    catch (boost::interprocess::interprocess_exception& e)
+    {
+        return error("MapChainStateSnapshot() : mapping %s failed: %s", strPath.c_str(), e.what());
+    }
+
+    if (region.get_size() < sizeof(uint256))
+        return error("MapChainStateSnapshot() : %s is truncated", strPath.c_str());
+    pbeginRet = static_cast<const char*>(region.get_address());
+    pendRet = pbeginRet + region.get_size() - sizeof(uint256);
+    uint256 hashChecksum;
+    memcpy(&hashChecksum, pendRet, sizeof(hashChecksum));
+    if (Hash(pbeginRet, pendRet) != hashChecksum)
+        return error("MapChainStateSnapshot() : checksum mismatch in %s", strPath.c_str());
+    return true;
+}
+
+bool OpenChainStateSnapshot(const string& strPath)
+{
+    boost::interprocess::mapped_region region;
+    const char* pbegin;
+    const char* pend;
+    if (!MapChainStateSnapshot(strPath, region, pbegin, pend))
+        return false;
+
+    try
+    {
+        CMappedStream s(pbegin, pend);
+        int nSnapshotVersion;
+        uint256 hashBlock;
+        int nHeight;
+        s >> nSnapshotVersion >> hashBlock >> nHeight;
+        if (nSnapshotVersion != CHAIN_STATE_SNAPSHOT_VERSION)
+            return error("OpenChainStateSnapshot() : unknown format version %d", nSnapshotVersion);
+        if (nHeight <= 0)
+            return error("OpenChainStateSnapshot() : snapshot of the genesis block");
+
+        printf("Chain state snapshot %s is for block %s at height %d\n",
+               strPath.c_str(), hashBlock.ToString().substr(0,20).c_str(), nHeight);
+        strChainStateSnapshot = strPath;
+        hashChainStateSnapshot = hashBlock;
+    }
+    catch (std::exception &e) {
+        return error("OpenChainStateSnapshot() : %s", e.what());
+    }
+    return true;
+}
+
+// Add the transactions of a block below the snapshot to the tx index, at
+// the positions ConnectBlock gives them
+bool static IndexChainStateSnapshotBlock(DatabaseSet& dbset, const CBlock& block, CBlockIndex* pindex)
+{
+    unsigned int nTxPos = pindex->nBlockPos + ::GetSerializeSize(block, SER_DISK|SER_BLOCKHEADERONLY) + GetSizeOfCompactSize(block.vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        if (!dbset.tx().AddTxIndex(tx, CDiskTxPos(pindex->nFile, pindex->nBlockPos, nTxPos)))
+            return false;
+        nTxPos += ::GetSerializeSize(tx, SER_DISK);
+    }
+
+    nTxPos = block.nGameTxPos + GetSizeOfCompactSize(block.vgametx.size());
+    BOOST_FOREACH(const CTransaction& tx, block.vgametx)
+    {
+        if (!dbset.tx().AddTxIndex(tx, CDiskTxPos(pindex->nFile, pindex->nBlockPos, block.nGameTxFile, nTxPos)))
+            return false;
+        nTxPos += ::GetSerializeSize(tx, SER_DISK);
+    }
+
+    // Link it on disk like ConnectBlock
+    CDiskBlockIndex blockindexPrev(pindex->pprev);
+    blockindexPrev.hashNext = pindex->GetBlockHash();
+    return dbset.tx().WriteBlockIndex(blockindexPrev);
+}
+
+// Make the snapshot's block the best block without connecting the blocks
+// up to it: they are only linked and their transactions indexed, and the
+// chain state is replaced by the snapshot's
+bool static LoadChainStateSnapshot(DatabaseSet& dbset, CBlockIndex* pindexSnapshot)
+{
+    int64 nStart = GetTimeMillis();
+    printf("LoadChainStateSnapshot() : indexing the blocks up to height %d\n", pindexSnapshot->nHeight);
+
+    vector<CBlockIndex*> vChain;
+    for (CBlockIndex* pindex = pindexSnapshot; pindex->pprev; pindex = pindex->pprev)
+        vChain.push_back(pindex);
+    reverse(vChain.begin(), vChain.end());
+
+    unsigned int nIndexed = 0;
+    BOOST_FOREACH(CBlockIndex* pindex, vChain)
+    {
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return error("LoadChainStateSnapshot() : ReadFromDisk failed at height %d", pindex->nHeight);
+        dbset.TxnBegin();
+        if (!IndexChainStateSnapshotBlock(dbset, block, pindex))
+        {
+            dbset.TxnAbort();
+            return error("LoadChainStateSnapshot() : indexing block at height %d failed", pindex->nHeight);
+        }
+        if (!dbset.TxnCommit())
+            return error("LoadChainStateSnapshot() : TxnCommit failed");
+        pindex->pprev->pnext = pindex;
+
+        // The whole chain is too much for the block batch's transaction
+        if (pdbsetBlockBatch == &dbset && ++nIndexed % 500 == 0 && !CommitBlockBatch(true))
+            return false;
+    }
+
+    boost::interprocess::mapped_region region;
+    const char* pbegin;
+    const char* pend;
+    if (!MapChainStateSnapshot(strChainStateSnapshot, region, pbegin, pend))
+        return false;
+
+    CChainStateSnapshotInfo info;
+    dbset.TxnBegin();
+    try
+    {
+        CMappedStream s(pbegin, pend);
+        int nSnapshotVersion;
+        s >> nSnapshotVersion >> info.hashBlock >> info.nHeight;
+        if (nSnapshotVersion != CHAIN_STATE_SNAPSHOT_VERSION || info.hashBlock != pindexSnapshot->GetBlockHash()
+            || info.nHeight != pindexSnapshot->nHeight)
+        {
+            dbset.TxnAbort();
+            return error("LoadChainStateSnapshot() : %s changed", strChainStateSnapshot.c_str());
+        }
+        if (!dbset.utxo().Load(s, info.nUtxo)
+            || !dbset.name().Load(s, info.nNames)
+            || !LoadGameState(dbset, pindexSnapshot, s)
+            || !dbset.tx().WriteHashBestChain(info.hashBlock))
+        {
+            dbset.TxnAbort();
+            return error("LoadChainStateSnapshot() : replacing the chain state failed");
+        }
+    }
+    catch (std::exception &e) {
+        dbset.TxnAbort();
+        return error("LoadChainStateSnapshot() : %s", e.what());
+    }
+    if (!dbset.TxnCommit())
+        return error("LoadChainStateSnapshot() : TxnCommit failed");
+
+    hashBestChain = info.hashBlock;
+    pindexBest = pindexSnapshot;
+    nBestHeight = pindexBest->nHeight;
+    nBestChainWork = pindexBest->nChainWork;
+    nTimeBestReceived = GetTime();
+    nTransactionsUpdated++;
+
+    strChainStateSnapshot.clear();
+    hashChainStateSnapshot = 0;
+    fChainStateSnapshotLoaded = true;
+
+    printf("LoadChainStateSnapshot(): %u UTXO entries and %u names loaded at height %d in %"PRI64d"ms\n",
+           info.nUtxo, info.nNames, nBestHeight, GetTimeMillis() - nStart);
+    return true;
+}
+
+void static ThreadVerifyChainStateSnapshot(void* parg)
+{
+    printf("ThreadVerifyChainStateSnapshot started\n");
+    try
+    {
+        CUtxoDB utxodb("r");
+        if (utxodb.Verify())
+            printf("ThreadVerifyChainStateSnapshot: the loaded UTXO set matches the block chain\n");
+        else
+        {
+            strMiscWarning = _("Warning: The UTXO set loaded with -loadutxoset does not match the block chain, see debug.log");
+            printf("*** %s\n", strMiscWarning.c_str());
+        }
+    }
+    catch (std::exception& e) {
+        PrintException(&e, "ThreadVerifyChainStateSnapshot()");
+    }
+}
+
+void StartChainStateSnapshotVerify()
+{
+    if (!fChainStateSnapshotLoaded)
+        return;
+    if (!CreateThread(ThreadVerifyChainStateSnapshot, NULL))
+        printf("Error: CreateThread(ThreadVerifyChainStateSnapshot) failed\n");
 }
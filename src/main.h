@@ -11,10 +11,12 @@
 #include "walletdb.h"
 
 #include "scrypt.h"
+#include "blockstore.h"
 
 #include <list>
 #ifndef Q_MOC_RUN
 #include <boost/shared_ptr.hpp>
+#include <boost/detail/atomic_count.hpp>
 #endif
 
 #ifdef __WXMSW__
@@ -31,6 +33,7 @@ class CKeyItem;
 class CReserveKey;
 class CWalletDB;
 class CTestPool;
+class CScriptCheck;
 
 class CMessageHeader;
 class CAddress;
@@ -55,6 +58,10 @@ static const int COINBASE_MATURITY = 100;
 static const int COINBASE_MATURITY_DISPLAY = COINBASE_MATURITY + 20;
 static const int GAME_REWARD_MATURITY = 100;
 static const int GAME_REWARD_MATURITY_DISPLAY = GAME_REWARD_MATURITY + 20;
+// With -prune, the blocks of about the last day are kept; a pruned node
+// can't follow reorganisations deeper than that
+static const int MIN_BLOCKS_TO_KEEP = 1440;
+static const int64 MIN_PRUNE_TARGET = 550 * 1024 * 1024;
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
 #else
@@ -72,20 +79,23 @@ extern int miningAlgo;
 extern CCriticalSection cs_main;
 extern CCriticalSection cs_AppendBlockFile;
 extern CCriticalSection cs_mapTransactions;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+class CBlockIndexMap;
+extern CBlockIndexMap mapBlockIndex;
 extern uint256 hashGenesisBlock;
 extern CBigNum bnProofOfWorkLimit[NUM_ALGOS], bnInitialHashTarget[NUM_ALGOS];
 extern CBlockIndex* pindexGenesisBlock;
 extern int nBestHeight;
-extern CBigNum bnBestChainWork;
-extern CBigNum bnBestInvalidWork;
+extern uint256 nBestChainWork;
+extern uint256 nBestInvalidWork;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
 extern unsigned int nTransactionsUpdated;
+extern boost::detail::atomic_count nHashCacheHits;
 extern double dHashesPerSec;
 extern const std::string strMessageMagic;
 extern int64 nHPSTimerStart;
 extern int64 nTimeBestReceived;
+extern int nBlockPruneHeight;
 extern CCriticalSection cs_setpwalletRegistered;
 extern std::set<CWallet*> setpwalletRegistered;
 
@@ -98,6 +108,8 @@ extern int nLimitProcessors;
 extern int fMinimizeToTray;
 extern int fMinimizeOnClose;
 extern int fUseUPnP;
+extern int64 nPruneTarget;
+extern bool fReindex;
 
 /* Handle fork heights.  The function checks whether a fork is in effect
    at the given height -- and may use different heights for testnet
@@ -134,13 +146,30 @@ void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false);
-bool ProcessBlock(CNode* pfrom, CBlock* pblock);
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fChecked=false);
+void ProcessCheckedBlocks();
 bool CheckDiskSpace (uint64 nAdditionalBytes = 0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
-FILE* AppendBlockFile (DatabaseSet& dbset, unsigned int& nFileRet,
-                       unsigned size);
-void FlushBlockFile(FILE *f);
+
+/** Read an object from a block file, from its memory mapping if possible */
+template<typename T>
+bool ReadFromBlockFile(unsigned int nFile, unsigned int nPos, T& obj, int nType=SER_DISK)
+{
+    if (blockfilemap.Read(nFile, nPos, obj, nType))
+        return true;
+    CAutoFile filein = OpenBlockFile(nFile, nPos, "rb");
+    if (!filein)
+        return false;
+    filein.nType = nType;
+    filein >> obj;
+    return true;
+}
+// -reindex: remove the databases that LoadBlockIndex rebuilds from the
+// block files
+bool RemoveChainState();
 bool LoadBlockIndex(bool fAllowNew=true);
+void StartScriptCheckThreads();
+void StopScriptCheckThreads();
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
@@ -150,13 +179,14 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, int algo);
 int64 GetBlockValue(int nHeight, int64 nFees);
 CBlock* CreateNewBlock(CReserveKey& reservekey);
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, int64& nPrevTime);
-void IncrementExtraNonceWithAux(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, int64& nPrevTime, std::vector<unsigned char>& vchAux);
+void IncrementExtraNonceWithAux(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce, int64& nPrevTime, std::vector<unsigned char>& vchAux, const std::vector<uint256>* pvCoinbaseBranch = NULL);
 void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1);
 const CBlockIndex* GetLastBlockIndexForAlgo(const CBlockIndex* pindex, int algo);
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 bool CheckProofOfWork(uint256 hash, unsigned int nBits, int algo);
 int GetTotalBlocksEstimate();
 int GetNumBlocksOfPeers();
+int GetBestHeaderHeight();
 bool IsInitialBlockDownload();
 std::string GetWarnings(std::string strFor);
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
@@ -548,6 +578,10 @@ public:
     std::vector<CTxOut> vout;
     unsigned int nLockTime;
 
+    // memory only: see CacheHash
+    mutable uint256 hashCached;
+    mutable bool fHashCached;
+
 
     CTransaction()
     {
@@ -561,6 +595,8 @@ public:
         READWRITE(vin);
         READWRITE(vout);
         READWRITE(nLockTime);
+        if (fRead)
+            fHashCached = false;
     )
 
     void SetNull()
@@ -569,6 +605,7 @@ public:
         vin.clear();
         vout.clear();
         nLockTime = 0;
+        fHashCached = false;
     }
 
     bool IsNull() const
@@ -578,9 +615,30 @@ public:
 
     uint256 GetHash() const
     {
+        if (fHashCached)
+        {
+            ++nHashCacheHits;
+            return hashCached;
+        }
         return SerializeHash(*this);
     }
 
+    // Remember the hash of a transaction that is not going to be modified
+    // any more (received from the network or read from disk).  Copies
+    // keep the cached hash; SetNull and deserialising clear it.  Code that
+    // changes vin, vout, nVersion or nLockTime afterwards must call
+    // UncacheHash.
+    void CacheHash() const
+    {
+        hashCached = SerializeHash(*this);
+        fHashCached = true;
+    }
+
+    void UncacheHash()
+    {
+        fHashCached = false;
+    }
+
     inline const char*
     GetHashForLog () const
     {
@@ -692,14 +750,9 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos)
     {
-        CAutoFile filein = OpenBlockFile(pos.nTxFile, 0, "rb");
-        if (!filein)
-            return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
-
         // Read transaction
-        if (fseek(filein, pos.nTxPos, SEEK_SET) != 0)
-            return error("CTransaction::ReadFromDisk() : fseek failed");
-        filein >> *this;
+        if (!ReadFromBlockFile(pos.nTxFile, pos.nTxPos, *this))
+            return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
         return true;
     }
 
@@ -746,7 +799,8 @@ public:
     
     bool ConnectInputs(DatabaseSet& dbset, CTestPool& testPool,
                        CDiskTxPos posThisTx, CBlockIndex* pindexBlock,
-                       int64& nFees, bool fBlock, bool fMiner, int64 nMinFee=0);
+                       int64& nFees, bool fBlock, bool fMiner, int64 nMinFee=0,
+                       std::vector<CScriptCheck>* pvChecks=NULL);
     bool ClientConnectInputs();
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(DatabaseSet& dbset, bool fCheckInputs=true,
@@ -762,6 +816,39 @@ public:
 
 
 
+//
+// Deferred signature check of one transaction input.  ConnectInputs
+// produces these once the previous output is known, so the (expensive)
+// script evaluation can run on the script check threads.
+//
+class CScriptCheck
+{
+private:
+    CTxOut txoFrom;
+    const CTransaction* ptxTo;
+    unsigned int nIn;
+    bool fCacheStore;
+
+public:
+    CScriptCheck() : ptxTo(NULL), nIn(0), fCacheStore(true) {}
+    CScriptCheck(const CTxOut& txoFromIn, const CTransaction& txToIn, unsigned int nInIn, bool fCacheStoreIn)
+      : txoFrom(txoFromIn), ptxTo(&txToIn), nIn(nInIn), fCacheStore(fCacheStoreIn) {}
+
+    bool operator()() const;
+
+    void swap(CScriptCheck& check)
+    {
+        txoFrom.scriptPubKey.swap(check.txoFrom.scriptPubKey);
+        std::swap(txoFrom.nValue, check.txoFrom.nValue);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(fCacheStore, check.fCacheStore);
+    }
+};
+
+
+
+
 //
 // A transaction with a merkle branch linking it to the block chain
 //
@@ -1018,6 +1105,10 @@ public:
 
     // memory only
     mutable std::vector<uint256> vMerkleTree, vGameMerkleTree;
+    mutable uint256 hashCached;
+    mutable bool fHashCached;
+    mutable uint256 hashPoWCached;
+    mutable bool fPoWHashCached;
     
     // Game data
     uint256 hashGameMerkleRoot;            // disk, disk+header
@@ -1044,6 +1135,11 @@ public:
         READWRITE(nNonce);
 
         nSerSize += ReadWriteAuxPow(s, auxpow, nType, nVersion, ser_action);
+        if (fRead)
+        {
+            fHashCached = false;
+            fPoWHashCached = false;
+        }
 
         if ((nType & SER_DISK) && (nType & SER_GETHASH))
             printf("CBlock serialization error: nType contains both SER_DISK and SER_GETHASH\n");
@@ -1096,9 +1192,19 @@ public:
 
     uint256 GetHash() const
     {
+        if (fHashCached)
+        {
+            ++nHashCacheHits;
+            return hashCached;
+        }
         return Hash(BEGIN(nVersion), END(nNonce));
     }
 
+    // Like CTransaction::CacheHash, for the header, the auxpow parent block
+    // and all transactions.  Blocks being mined change nNonce etc. and must
+    // not use this.
+    void CacheHashes() const;
+
     // Note: we use explicitly provided algo instead of the one returned by GetAlgo(), because this can be a block
     // from foreign chain (parent block in merged mining) which does not encode algo in its nVersion field.
     uint256 GetPoWHash(int algo) const
@@ -1107,9 +1213,18 @@ public:
             return GetHash();
         else
         {
+            // A block with cached hashes keeps its scrypt hash as well, so
+            // CheckBlock in ConnectBlock doesn't redo the most expensive part
+            if (fHashCached && fPoWHashCached)
+                return hashPoWCached;
             uint256 thash;
             // Caution: scrypt_1024_1_1_256 assumes fixed length of 80 bytes
             scrypt_1024_1_1_256(BEGIN(nVersion), BEGIN(thash));
+            if (fHashCached)
+            {
+                hashPoWCached = thash;
+                fPoWHashCached = true;
+            }
             return thash;
         }
     }
@@ -1182,7 +1297,7 @@ public:
         return hash;
     }
 
-    bool WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet);
+    bool WriteToDisk(unsigned int& nFileRet, unsigned int& nBlockPosRet, int nHeight);
 
     bool CheckProofOfWork(int nHeight) const;
 
@@ -1228,7 +1343,9 @@ public:
     bool SetBestChain (DatabaseSet& dbset, CBlockIndex* pindexNew);
     bool AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos);
     bool CheckBlock(int nHeight) const;
-    bool AcceptBlock();
+    // A block read back from the block files (-reindex) passes its
+    // position and is not written again
+    bool AcceptBlock(unsigned int nFile = -1, unsigned int nBlockPos = 0);
 
     /* Put all outpoints spent by this block into the set.  This is used
        to later remove transactions that are double-spends of them
@@ -1259,7 +1376,10 @@ public:
     unsigned int nFile;
     unsigned int nBlockPos;
     int nHeight;
-    CBigNum bnChainWork;
+    uint256 nChainWork;
+
+    // phashBlock points here for objects in mapBlockIndex
+    uint256 hashBlock;
 
     // block header
     int nVersion;
@@ -1276,7 +1396,7 @@ public:
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
-        bnChainWork = 0;
+        nChainWork = 0;
 
         nVersion       = 0;
         hashMerkleRoot = 0;
@@ -1294,7 +1414,7 @@ public:
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
-        bnChainWork = 0;
+        nChainWork = 0;
 
         nVersion       = block.nVersion;
         hashMerkleRoot = block.hashMerkleRoot;
@@ -1353,7 +1473,7 @@ public:
         return (int64)nTime;
     }
 
-    CBigNum GetBlockWork() const;
+    uint256 GetBlockWork() const;
 
     bool IsInMainChain() const
     {
@@ -1402,6 +1522,196 @@ public:
 
 
 
+//
+// Allocates the index objects of mapBlockIndex in large chunks.  This saves
+// the heap overhead of every single object, and the index of a chain that
+// is loaded in height order ends up in one piece of memory.  The objects
+// are only freed when an unusable block index snapshot is dropped at
+// startup, before anything else refers to them.
+//
+class CBlockIndexArena
+{
+private:
+    enum { CHUNK_SIZE = 4096 };
+
+    std::vector<CBlockIndex*> vChunks;
+    unsigned int nUsed;
+
+public:
+    CBlockIndexArena() : nUsed(CHUNK_SIZE)
+    {
+    }
+
+    CBlockIndex* Allocate()
+    {
+        if (nUsed == CHUNK_SIZE)
+        {
+            vChunks.push_back(new CBlockIndex[CHUNK_SIZE]);
+            nUsed = 0;
+        }
+        return &vChunks.back()[nUsed++];
+    }
+
+    void Clear()
+    {
+        BOOST_FOREACH(CBlockIndex* pchunk, vChunks)
+            delete[] pchunk;
+        vChunks.clear();
+        nUsed = CHUNK_SIZE;
+    }
+
+    size_t GetMemoryUsage() const
+    {
+        return vChunks.size() * CHUNK_SIZE * sizeof(CBlockIndex);
+    }
+};
+
+
+
+//
+// Block index objects by block hash, in an open addressing hash table with
+// linear probing.  The table holds only pointers; the hash of an entry is
+// its CBlockIndex::hashBlock, which insert() fills in and points phashBlock
+// to.  This offers the part of the std::map interface the code uses, but
+// iterators yield copies of the (hash, pointer) pairs, are invalidated by
+// insert() and don't visit the entries in any particular order.  Entries
+// are never removed.
+//
+class CBlockIndexMap
+{
+public:
+    typedef std::pair<uint256, CBlockIndex*> value_type;
+
+    class iterator
+    {
+    private:
+        CBlockIndex* const* p;
+        CBlockIndex* const* pend;
+        mutable value_type value;
+
+        iterator(CBlockIndex* const* pIn, CBlockIndex* const* pendIn) : p(pIn), pend(pendIn)
+        {
+            while (p != pend && *p == NULL)
+                ++p;
+        }
+
+        friend class CBlockIndexMap;
+
+    public:
+        iterator() : p(NULL), pend(NULL)
+        {
+        }
+
+        const value_type& operator*() const
+        {
+            value.first = *(*p)->phashBlock;
+            value.second = *p;
+            return value;
+        }
+
+        const value_type* operator->() const
+        {
+            return &**this;
+        }
+
+        iterator& operator++()
+        {
+            ++p;
+            while (p != pend && *p == NULL)
+                ++p;
+            return *this;
+        }
+
+        bool operator==(const iterator& it) const { return p == it.p; }
+        bool operator!=(const iterator& it) const { return p != it.p; }
+    };
+    typedef iterator const_iterator;
+
+private:
+    std::vector<CBlockIndex*> vTable;
+    unsigned int nBits;
+    size_t nSize;
+    uint64 nSalt;
+
+    size_t GetSlot(const uint256& hash) const
+    {
+        // Only blocks with valid proof of work get here, so peers can't
+        // cheaply pick their hashes.  The salt only changes the slot
+        // layout from run to run; hashes with equal low 64 bits still
+        // share a slot whatever the salt is.
+        return (size_t)(((hash.GetLow64() ^ nSalt) * 0x9E3779B97F4A7C15ULL) >> (64 - nBits));
+    }
+
+    void Rehash(unsigned int nBitsNew);
+
+public:
+    CBlockIndexMap() : nBits(0), nSize(0), nSalt(0)
+    {
+    }
+
+    iterator begin() const { return iterator(vTable.empty() ? NULL : &vTable[0], vTable.empty() ? NULL : &vTable[0] + vTable.size()); }
+    iterator end() const { return iterator(vTable.empty() ? NULL : &vTable[0] + vTable.size(), vTable.empty() ? NULL : &vTable[0] + vTable.size()); }
+
+    size_t size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator find(const uint256& hash) const;
+    size_t count(const uint256& hash) const { return find(hash) != end() ? 1 : 0; }
+
+    // Unlike std::map, a missing hash gives NULL and is not inserted
+    CBlockIndex* operator[](const uint256& hash) const
+    {
+        iterator mi = find(hash);
+        return (mi != end() ? mi->second : NULL);
+    }
+
+    std::pair<iterator, bool> insert(const value_type& item);
+
+    // Make room for nCount entries without rehashing
+    void reserve(size_t nCount);
+
+    // Remove all entries; see CBlockIndexArena::Clear
+    void clear()
+    {
+        std::vector<CBlockIndex*>().swap(vTable);
+        nBits = 0;
+        nSize = 0;
+    }
+
+    size_t GetMemoryUsage() const
+    {
+        return vTable.size() * sizeof(CBlockIndex*);
+    }
+};
+
+// Allocate a new index object for mapBlockIndex
+CBlockIndex* NewBlockIndex();
+size_t GetBlockIndexMemoryUsage();
+
+// Flat copy of the block index, written at clean shutdown and read (and
+// removed) at startup if it matches the database's best chain
+bool WriteBlockIndexSnapshot();
+bool ReadBlockIndexSnapshot(const uint256& hashBestExpected);
+
+// The UTXO set, name index and game state at one block, written by
+// dumputxoset for the best block.  -loadutxoset opens one before -reindex
+// takes it instead of connecting the blocks up to that one, and
+// -verifyutxoset checks it against the blocks afterwards.
+struct CChainStateSnapshotInfo
+{
+    uint256 hashBlock;
+    int nHeight;
+    unsigned int nUtxo;
+    unsigned int nNames;
+    uint256 hashFile;
+};
+
+bool DumpChainStateSnapshot(const std::string& strPath, CChainStateSnapshotInfo& info);
+bool OpenChainStateSnapshot(const std::string& strPath);
+void StartChainStateSnapshotVerify();
+
+
+
 //
 // Used to marshal pointers into hashes for db storage.
 //
@@ -1525,7 +1835,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1571,7 +1881,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1590,7 +1900,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1606,7 +1916,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            CBlockIndexMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1829,6 +2139,118 @@ public:
 
 
 
+class GameStepMiner;
+
+/* A block template for the mining RPCs that follows the chain and the
+   memory pool.  A new best block builds it from scratch; new memory pool
+   transactions are appended to it instead.  The coinbase's merkle branch
+   is kept, so that a changed coinbase (extra nonce, aux data) costs only
+   a few hashes instead of the whole merkle tree.  */
+class CBlockTemplate
+{
+private:
+    CReserveKey& reservekey;
+    int algo;
+
+    CBlock block;
+    CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdatedLast;
+
+    /* What's needed to append further transactions.  */
+    CTestPool testPool;
+    GameStepMiner* pgameStepMiner;
+    int64 nFees;
+    int64 nTax;
+    uint64 nBlockSize;
+    int nBlockSigOps;
+    std::set<uint256> setIncluded;
+    std::set<uint256> setRejected;
+
+    std::vector<uint256> vCoinbaseBranch;
+
+    void Reset(DatabaseSet& dbset);
+    bool AddTransactions(DatabaseSet& dbset);
+    void UpdateCoinbase();
+
+    CBlockTemplate(const CBlockTemplate&);
+    void operator=(const CBlockTemplate&);
+
+public:
+    CBlockTemplate(CReserveKey& reservekeyIn, int algoIn);
+    ~CBlockTemplate();
+
+    /* Bring the template up to date with the best chain and the memory
+       pool.  Returns true if it changed.  */
+    bool Update();
+
+    const CBlock& GetBlock() const
+    {
+        return block;
+    }
+
+    CBlockIndex* GetPrev() const
+    {
+        return pindexPrev;
+    }
+
+    int GetAlgo() const
+    {
+        return algo;
+    }
+
+    const std::vector<uint256>& GetCoinbaseBranch() const
+    {
+        return vCoinbaseBranch;
+    }
+};
+
+struct CBlockTemplateStats
+{
+    uint64 nBuilds;
+    uint64 nUpdates;
+    /* In microseconds.  */
+    int64 nLastBuildTime;
+    int64 nLastUpdateTime;
+    int64 nTotalBuildTime;
+    int64 nTotalUpdateTime;
+};
+
+void GetBlockTemplateStats(CBlockTemplateStats& stats);
+
+namespace Game
+{
+    struct GameState;
+}
+
+/* Read-mostly chain state, published under cs_main whenever the best chain
+   changes.  A published snapshot is never modified, so readers (RPC) can
+   keep using it without cs_main while newer ones replace it.  Block index
+   objects are never freed and their pprev, nHeight and hash don't change,
+   so walking back from pindexBest is safe as well.  */
+class CChainSnapshot
+{
+public:
+    CBlockIndex* pindexBest;
+    int nHeight;
+    uint256 hashBest;
+    uint256 nChainWork;
+    int64 nTimeBestReceived;
+
+    /* Game state at pindexBest; not kept during initial download.  */
+    boost::shared_ptr<const Game::GameState> pstate;
+
+    CChainSnapshot()
+      : pindexBest(NULL), nHeight(-1), hashBest(0), nChainWork(0), nTimeBestReceived(0)
+    {
+    }
+
+    CBlockIndex* GetAncestor(int nHeightIn) const;
+};
+
+typedef boost::shared_ptr<const CChainSnapshot> CChainSnapshotRef;
+
+CChainSnapshotRef GetChainSnapshot();
+
 extern std::map<uint256, CTransaction> mapTransactions;
 extern CHooks* hooks;
 
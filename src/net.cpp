@@ -47,7 +47,7 @@ bool OpenNetworkConnection(const CAddress& addrConnect);
 //
 bool fClient = false;
 bool fAllowDNS = false;
-uint64 nLocalServices = (fClient ? 0 : NODE_NETWORK);
+uint64 nLocalServices = (fClient ? 0 : NODE_NETWORK | NODE_HEADERS);
 static CNode* pnodeSync = NULL;
 CAddress addrLocalHost("0.0.0.0", 0, false, nLocalServices);
 CNode* pnodeLocalHost = NULL;
@@ -56,12 +56,12 @@ array<int, 10> vnThreadsRunning;
 SOCKET hListenSocket = INVALID_SOCKET;
 
 vector<CNode*> vNodes;
-CCriticalSection cs_vNodes;
+CCriticalSection cs_vNodes("cs_vNodes");
 map<vector<unsigned char>, CAddress> mapAddresses;
-CCriticalSection cs_mapAddresses;
+CCriticalSection cs_mapAddresses("cs_mapAddresses");
 map<CInv, CDataStream> mapRelay;
 deque<pair<int64, CInv> > vRelayExpiration;
-CCriticalSection cs_mapRelay;
+CCriticalSection cs_mapRelay("cs_mapRelay");
 map<CInv, int64> mapAlreadyAskedFor;
 
 // Settings
@@ -88,6 +88,11 @@ void CNode::PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd)
     PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
 }
 
+void CNode::PushGetHeaders(CBlockIndex* pindexBegin)
+{
+    PushMessage("getheaders", CBlockLocator(pindexBegin), uint256(0));
+}
+
 
 
 
@@ -1521,6 +1526,11 @@ void ThreadMessageHandler2(void* parg)
             if (fShutdown)
                 return;
 
+            // Connect blocks the block check threads are done with
+            ProcessCheckedBlocks();
+            if (fShutdown)
+                return;
+
             // Send messages
             TRY_CRITICAL_BLOCK(pnode->cs_vSend)
                 SendMessages(pnode, pnode == pnodeTrickle);
@@ -1735,6 +1745,8 @@ bool StopNode()
     printf("StopNode()\n");
     fShutdown = true;
     nTransactionsUpdated++;
+    StopScriptCheckThreads();
+    StopBlockFileSync();
     int64 nStart = GetTime();
     while (vnThreadsRunning[0] > 0 || vnThreadsRunning[2] > 0 || vnThreadsRunning[3] > 0 || vnThreadsRunning[4] > 0
 #ifdef USE_UPNP
@@ -1752,6 +1764,10 @@ bool StopNode()
     if (vnThreadsRunning[3] > 0) printf("ThreadBitcoinMiner still running\n");
     if (vnThreadsRunning[4] > 0) printf("ThreadRPCServer still running\n");
     if (fHaveUPnP && vnThreadsRunning[5] > 0) printf("ThreadMapPort still running\n");
+    if (vnThreadsRunning[6] > 0) printf("ThreadScriptCheck still running\n");
+    if (vnThreadsRunning[7] > 0) printf("ThreadBlockCheck still running\n");
+    if (vnThreadsRunning[8] > 0) printf("ThreadSpeculativeGameState still running\n");
+    if (vnThreadsRunning[9] > 0) printf("ThreadBlockFileSync still running\n");
     while (vnThreadsRunning[2] > 0 || vnThreadsRunning[4] > 0)
         MilliSleep(20);
     MilliSleep(50);
@@ -36,6 +36,8 @@ static const unsigned int PUBLISH_HOPS = 5;
 enum
 {
     NODE_NETWORK = (1 << 0),
+    // answers "getheaders" (headers-first sync)
+    NODE_HEADERS = (1 << 1),
 };
 
 
@@ -538,6 +540,10 @@ public:
     int nStartingHeight;
     bool fStartSync;
 
+    // headers-first sync
+    bool fServedHeaders;
+    std::set<uint256> setBlocksInFlight;
+
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
@@ -583,6 +589,7 @@ public:
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
         fStartSync = false;
+        fServedHeaders = false;
         fGetAddr = false;
         vfSubscribe.assign(256, false);
 
@@ -962,6 +969,7 @@ public:
 
 
     void PushGetBlocks(CBlockIndex* pindexBegin, uint256 hashEnd);
+    void PushGetHeaders(CBlockIndex* pindexBegin);
     bool IsSubscribed(unsigned int nChannel);
     void Subscribe(unsigned int nChannel, unsigned int nHops=0);
     void CancelSubscribe(unsigned int nChannel);
@@ -4,10 +4,14 @@
 #include "headers.h"
 #include "huntercoin.h"
 
+#include <boost/tuple/tuple.hpp>
+#include <boost/tuple/tuple_comparison.hpp>
+
 using namespace std;
 using namespace boost;
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+bool CheckSig(const vector<unsigned char>& vchSig, const vector<unsigned char>& vchPubKey, const CScript& scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, bool fCacheStore);
 
 
 
@@ -69,7 +73,8 @@ static inline void popstack(vector<valtype>& stack)
 }
 
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                bool fCacheStore = true)
 {
     CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
@@ -753,7 +758,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // Drop the signature, since there's no way for a signature to sign itself
                     scriptCode.FindAndDelete(CScript(vchSig));
 
-                    bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+                    bool fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, fCacheStore);
 
                     popstack(stack);
                     popstack(stack);
@@ -813,7 +818,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         valtype& vchPubKey = stacktop(-ikey);
 
                         // Check signature
-                        if (CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType))
+                        if (CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, fCacheStore))
                         {
                             isig++;
                             nSigsCount--;
@@ -878,6 +883,7 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
         return 1;
     }
     CTransaction txTmp(txTo);
+    txTmp.UncacheHash();
 
     // In case concatenating two scripts ends up with two codeseparators,
     // or an extra one at the end, this prevents all those possible incompatibilities.
@@ -933,23 +939,120 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 }
 
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType)
+//
+// Valid (signature hash, public key, signature) triples.  Transactions are
+// verified when they enter the memory pool and again when their block is
+// connected; the second check can be answered from here.
+//
+class CSignatureCache
 {
-    CKey key;
-    if (!key.SetPubKey(vchPubKey))
-        return false;
+private:
+    typedef boost::tuple<uint256, std::vector<unsigned char>, std::vector<unsigned char> > sigdata_type;
+    std::set<sigdata_type> setValid;
+    CCriticalSection cs_sigcache;
+    unsigned int nMaxCacheSize;
+
+    uint64 nHits;
+    uint64 nMisses;
+    uint64 nEvictions;
+
+public:
+    CSignatureCache() : nMaxCacheSize(0), nHits(0), nMisses(0), nEvictions(0)
+    {
+    }
+
+    bool Get(const uint256& hash, const std::vector<unsigned char>& vchSig,
+             const std::vector<unsigned char>& vchPubKey, bool fErase)
+    {
+        CRITICAL_BLOCK(cs_sigcache)
+        {
+            std::set<sigdata_type>::iterator mi = setValid.find(sigdata_type(hash, vchSig, vchPubKey));
+            if (mi == setValid.end())
+            {
+                nMisses++;
+                return false;
+            }
+            nHits++;
+            // an entry used for a block is not going to be needed again
+            if (fErase)
+                setValid.erase(mi);
+        }
+        return true;
+    }
+
+    void Set(const uint256& hash, const std::vector<unsigned char>& vchSig,
+             const std::vector<unsigned char>& vchPubKey)
+    {
+        CRITICAL_BLOCK(cs_sigcache)
+        {
+            if (nMaxCacheSize == 0)
+                nMaxCacheSize = std::max((int64)0, GetArg("-maxsigcachesize", 50000));
+            if (nMaxCacheSize == 0)
+                return;
+
+            while (setValid.size() >= nMaxCacheSize)
+            {
+                // Evict a random entry.  Random because that helps foil
+                // attackers who try to flush the cache with their own
+                // signatures.
+                uint256 hashRand;
+                RAND_bytes((unsigned char*)&hashRand, sizeof(hashRand));
+                std::set<sigdata_type>::iterator it = setValid.lower_bound(sigdata_type(hashRand, std::vector<unsigned char>(), std::vector<unsigned char>()));
+                if (it == setValid.end())
+                    it = setValid.begin();
+                setValid.erase(it);
+                nEvictions++;
+            }
+
+            setValid.insert(sigdata_type(hash, vchSig, vchPubKey));
+        }
+    }
 
+    void GetStats(CSignatureCacheStats& stats)
+    {
+        CRITICAL_BLOCK(cs_sigcache)
+        {
+            stats.nSize = setValid.size();
+            stats.nMaxSize = nMaxCacheSize ? nMaxCacheSize : GetArg("-maxsigcachesize", 50000);
+            stats.nHits = nHits;
+            stats.nMisses = nMisses;
+            stats.nEvictions = nEvictions;
+        }
+    }
+};
+
+static CSignatureCache signatureCache;
+
+void GetSignatureCacheStats(CSignatureCacheStats& stats)
+{
+    signatureCache.GetStats(stats);
+}
+
+bool CheckSig(const vector<unsigned char>& vchSigIn, const vector<unsigned char>& vchPubKey, const CScript& scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, bool fCacheStore)
+{
     // Hash type is one byte tacked on to the end of the signature
-    if (vchSig.empty())
+    if (vchSigIn.empty())
         return false;
     if (nHashType == 0)
-        nHashType = vchSig.back();
-    else if (nHashType != vchSig.back())
+        nHashType = vchSigIn.back();
+    else if (nHashType != vchSigIn.back())
+        return false;
+    valtype vchSig(vchSigIn.begin(), vchSigIn.end() - 1);
+
+    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    if (signatureCache.Get(sighash, vchSig, vchPubKey, !fCacheStore))
+        return true;
+
+    CKey key;
+    if (!key.SetPubKey(vchPubKey))
+        return false;
+    if (!key.Verify(sighash, vchSig))
         return false;
-    vchSig.pop_back();
 
-    return key.Verify(SignatureHash(scriptCode, txTo, nIn, nHashType), vchSig);
+    if (fCacheStore)
+        signatureCache.Set(sighash, vchSig, vchPubKey);
+    return true;
 }
 
 
@@ -1264,12 +1367,13 @@ uint160 CScript::GetBitcoinAddressHash160() const
     return 0;
 }
 
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType)
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                  bool fCacheStore)
 {
     vector<vector<unsigned char> > stack;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType))
+    if (!EvalScript(stack, scriptSig, txTo, nIn, nHashType, fCacheStore))
         return false;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, nHashType, fCacheStore))
         return false;
     if (stack.empty())
         return false;
@@ -1289,6 +1393,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     // The checksig op will also drop the signatures from its hash.
     const uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
 
+    txTo.UncacheHash();
     if (!Solver(keystore, rawScript, hash, nHashType, txin.scriptSig))
         return false;
 
@@ -1309,7 +1414,7 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
 
 bool
 VerifySignature (const CTxOut& txoFrom, const CTransaction& txTo,
-                 unsigned int nIn, int nHashType)
+                 unsigned int nIn, int nHashType, bool fCacheStore)
 {
     /* If the receiving transaction is a game transaction, this shouldn't
        ever be called.  They are generated deterministically (on player death)
@@ -1321,7 +1426,7 @@ VerifySignature (const CTxOut& txoFrom, const CTransaction& txTo,
     const CTxIn& txin = txTo.vin[nIn];
 
     if (!VerifyScript (txin.scriptSig, txoFrom.scriptPubKey,
-                       txTo, nIn, nHashType))
+                       txTo, nIn, nHashType, fCacheStore))
         return false;
 
     return true;
@@ -713,13 +713,25 @@ bool IsSpendable(const CKeyStore& keystore, const CScript& scriptPubKey);
 bool IsSpendable(const CKeyStore& keystore, const std::string& address);
 bool ExtractPubKey(const CScript& scriptPubKey, const CKeyStore* pkeystore, std::vector<unsigned char>& vchPubKeyRet);
 bool ExtractHash160(const CScript& scriptPubKey, uint160& hash160Ret);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType,
+                  bool fCacheStore=true);
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool VerifySignature (const CTxOut& txoFrom, const CTransaction& txTo,
-                      unsigned int nIn, int nHashType=0);
+                      unsigned int nIn, int nHashType=0, bool fCacheStore=true);
 bool ExtractDestination(const CScript& scriptPubKey, std::string& addressRet);
 
+// Counters of the signature cache used by CheckSig
+struct CSignatureCacheStats
+{
+    unsigned int nSize;
+    unsigned int nMaxSize;
+    uint64 nHits;
+    uint64 nMisses;
+    uint64 nEvictions;
+};
+void GetSignatureCacheStats(CSignatureCacheStats& stats);
+
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
 CScript CombineSignatures(CScript scriptPubKey, const CTransaction& txTo, unsigned int nIn, const CScript& scriptSig1, const CScript& scriptSig2);
@@ -368,6 +368,11 @@ public:
         return sizeof(pn);
     }
 
+    uint64 GetLow64() const
+    {
+        return pn[0] | (uint64)pn[1] << 32;
+    }
+
 
     unsigned int GetSerializeSize(int nType=0, int nVersion=VERSION) const
     {
@@ -1201,3 +1201,59 @@ bool SoftSetBoolArg(const std::string& strArg, bool fValue)
     else
         return SoftSetArg(strArg, std::string("0"));
 }
+
+
+
+//
+// Lock contention statistics
+//
+
+// Named critical sections are globals that may be constructed before any
+// other static object, so the registry is created on first use
+static boost::mutex& LockRegistryMutex()
+{
+    static boost::mutex mutex;
+    return mutex;
+}
+
+static vector<CCriticalSection*>& LockRegistry()
+{
+    static vector<CCriticalSection*> vRegistry;
+    return vRegistry;
+}
+
+void CCriticalSection::EnterContended()
+{
+    int64 nStart = GetTimeMicros();
+    Lock();
+    nContentions++;
+    nWaitMicros += GetTimeMicros() - nStart;
+}
+
+void CCriticalSection::Register()
+{
+    boost::mutex::scoped_lock lock(LockRegistryMutex());
+    LockRegistry().push_back(this);
+}
+
+void CCriticalSection::Unregister()
+{
+    boost::mutex::scoped_lock lock(LockRegistryMutex());
+    vector<CCriticalSection*>& vRegistry = LockRegistry();
+    vRegistry.erase(std::remove(vRegistry.begin(), vRegistry.end(), this), vRegistry.end());
+}
+
+void GetLockStats(vector<CLockStats>& vStats)
+{
+    boost::mutex::scoped_lock lock(LockRegistryMutex());
+    vStats.clear();
+    BOOST_FOREACH(const CCriticalSection* pcs, LockRegistry())
+    {
+        CLockStats stats;
+        stats.strName = pcs->pszName;
+        stats.nLocks = pcs->nLocks;
+        stats.nContentions = pcs->nContentions;
+        stats.nWaitMicros = pcs->nWaitMicros;
+        vStats.push_back(stats);
+    }
+}
@@ -273,33 +273,83 @@ std::string DecodeBase64(const std::string &s);
 
 
 
-// Wrapper to automatically initialize critical sections
+// Wrapper to automatically initialize critical sections.
+// Critical sections constructed with a name count how often they were
+// entered and how often and how long callers had to wait (see getlockinfo).
 class CCriticalSection
 {
 #ifdef __WXMSW__
 protected:
     CRITICAL_SECTION cs;
+    void Init() { InitializeCriticalSection(&cs); }
+    void Destroy() { DeleteCriticalSection(&cs); }
+    void Lock() { EnterCriticalSection(&cs); }
+    bool TryLock() { return TryEnterCriticalSection(&cs); }
 public:
-    explicit CCriticalSection() { InitializeCriticalSection(&cs); }
-    ~CCriticalSection() { DeleteCriticalSection(&cs); }
-    void Enter() { EnterCriticalSection(&cs); }
     void Leave() { LeaveCriticalSection(&cs); }
-    bool TryEnter() { return TryEnterCriticalSection(&cs); }
 #else
 protected:
     boost::interprocess::interprocess_recursive_mutex mutex;
+    void Init() { }
+    void Destroy() { }
+    void Lock() { mutex.lock(); }
+    bool TryLock() { return mutex.try_lock(); }
 public:
-    explicit CCriticalSection() { }
-    ~CCriticalSection() { }
-    void Enter() { mutex.lock(); }
     void Leave() { mutex.unlock(); }
-    bool TryEnter() { return mutex.try_lock(); }
 #endif
 public:
+    explicit CCriticalSection(const char* pszNameIn = NULL)
+      : pszName(pszNameIn), nLocks(0), nContentions(0), nWaitMicros(0)
+    {
+        Init();
+        if (pszName)
+            Register();
+    }
+    ~CCriticalSection()
+    {
+        if (pszName)
+            Unregister();
+        Destroy();
+    }
+    void Enter()
+    {
+        if (!TryLock())
+            EnterContended();
+        nLocks++;
+    }
+    bool TryEnter()
+    {
+        if (!TryLock())
+            return false;
+        nLocks++;
+        return true;
+    }
+
     const char* pszFile;
     int nLine;
+
+    // Statistics, only written while holding the lock
+    const char* pszName;
+    uint64 nLocks;
+    uint64 nContentions;
+    int64 nWaitMicros;
+
+private:
+    void EnterContended();
+    void Register();
+    void Unregister();
+};
+
+struct CLockStats
+{
+    std::string strName;
+    uint64 nLocks;
+    uint64 nContentions;
+    int64 nWaitMicros;
 };
 
+void GetLockStats(std::vector<CLockStats>& vStats);
+
 // Automatically leave critical section when leaving block, needed for exception safety
 class CCriticalBlock
 {
@@ -457,6 +507,12 @@ inline int64 GetTimeMillis()
             boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_milliseconds();
 }
 
+inline int64 GetTimeMicros()
+{
+    return (boost::posix_time::ptime(boost::posix_time::microsec_clock::universal_time()) -
+            boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_microseconds();
+}
+
 inline std::string DateTimeStrFormat(const char* pszFormat, int64 nTime)
 {
     time_t n = nTime;
@@ -274,7 +274,7 @@ int64 CWalletTx::GetTxTime() const
         // If we did not receive the transaction directly, we rely on the block's
         // time to figure out when it happened.  We use the median over a range
         // of blocks to try to filter out inaccurate block times.
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        CBlockIndexMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
         {
             CBlockIndex* pindex = (*mi).second;
@@ -537,7 +537,12 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
         while (pindex)
         {
             CBlock block;
-            block.ReadFromDisk(pindex);
+            // skip blocks deleted by -prune
+            if (!block.ReadFromDisk(pindex))
+            {
+                pindex = pindex->pnext;
+                continue;
+            }
             BOOST_FOREACH(CTransaction& tx, block.vtx)
             {
                 if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
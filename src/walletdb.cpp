@@ -71,42 +71,22 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 
     bool fAllAccounts = (strAccount == "*");
 
-    Dbc* pcursor = GetCursor();
-    if (!pcursor)
-        throw runtime_error("CWalletDB::ListAccountCreditDebit() : cannot create DB cursor");
-    unsigned int fFlags = DB_SET_RANGE;
-    loop
+    CDBScan scan(*this, "acentry", boost::make_tuple(string("acentry"), (fAllAccounts? string("") : strAccount), uint64(0)));
+    while (scan.Next())
     {
-        // Read next record
-        CDataStream ssKey;
-        if (fFlags == DB_SET_RANGE)
-            ssKey << make_tuple(string("acentry"), (fAllAccounts? string("") : strAccount), uint64(0));
-        CDataStream ssValue;
-        int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
-        fFlags = DB_NEXT;
-        if (ret == DB_NOTFOUND)
-            break;
-        else if (ret != 0)
-        {
-            pcursor->close();
-            throw runtime_error("CWalletDB::ListAccountCreditDebit() : error scanning DB");
-        }
-
         // Unserialize
-        string strType;
-        ssKey >> strType;
-        if (strType != "acentry")
-            break;
+        CMappedStream ssKey = scan.Key();
         CAccountingEntry acentry;
         ssKey >> acentry.strAccount;
         if (!fAllAccounts && acentry.strAccount != strAccount)
             break;
 
+        CMappedStream ssValue = scan.Value();
         ssValue >> acentry;
         entries.push_back(acentry);
     }
-
-    pcursor->close();
+    if (!scan.Ok())
+        throw runtime_error("CWalletDB::ListAccountCreditDebit() : error scanning DB");
 }
 
 
@@ -127,21 +107,12 @@ bool CWalletDB::LoadWallet(CWallet* pwallet)
     CRITICAL_BLOCK(pwallet->cs_mapWallet)
     CRITICAL_BLOCK(pwallet->cs_mapKeys)
     {
-        // Get cursor
-        Dbc* pcursor = GetCursor();
-        if (!pcursor)
-            return false;
-
-        loop
+        // Read all records; the scan buffer is wiped when it is done
+        CDBScan scan(*this, "");
+        while (scan.Next())
         {
-            // Read next record
-            CDataStream ssKey;
-            CDataStream ssValue;
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
-            if (ret == DB_NOTFOUND)
-                break;
-            else if (ret != 0)
-                return false;
+            CMappedStream ssKey = scan.Key();
+            CMappedStream ssValue = scan.Value();
 
             // Unserialize
             // Taking advantage of the fact that pair serialization
@@ -320,7 +291,8 @@ bool CWalletDB::LoadWallet(CWallet* pwallet)
                 if (fHaveUPnP && strKey == "fUseUPnP")           ssValue >> fUseUPnP;
             }
         }
-        pcursor->close();
+        if (!scan.Ok())
+            return false;
     }
 
     BOOST_FOREACH(uint256 hash, vWalletUpgrade)